@@ -32,6 +32,9 @@
 #define kTV1CommandTimeoutMillis 100
 #define kTV1CommandMinimumMillis 30
 
+// The unit's RS232 rate is set from its front panel. This is the factory setting, negotiateBaud will find any other.
+#define kTV1BaudDefault 57600
+
 // Sources - Note only higher end models have more than 2 in....
 //#pragma mark -
 //#pragma mark Channel / Sources
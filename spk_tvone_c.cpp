@@ -0,0 +1,273 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// C interface: batches of commands across units, completed asynchronously for a host event loop
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#if defined(SPK_TVONE_POSIX)
+
+#include "spk_tvone_c.h"
+#include "spk_tvone_mbed.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+struct batchType
+{
+    uint64_t tag;
+    std::atomic<int> unitsLeft;
+};
+
+// A unit's share of a batch. Results point into the caller's array.
+struct batchPartType
+{
+    batchType *batch;
+    std::vector<SPKTVOneBatchRecord> records;
+    std::vector<SPKTVOneBatchResult*> results;
+};
+
+struct unitType
+{
+    SPKTVOne *tvOne;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<batchPartType*> pending;
+    std::thread thread;
+};
+
+struct SPKTVOneHost
+{
+    std::vector<unitType*> units;
+    std::atomic<bool> running;
+    
+    int completionFd;
+    std::mutex completedLock;
+    std::deque<uint64_t> completed;
+};
+
+static void completeBatch(SPKTVOneHost *host, batchType *batch)
+{
+    {
+        std::lock_guard<std::mutex> guard(host->completedLock);
+        host->completed.push_back(batch->tag);
+    }
+    delete batch;
+    
+    uint64_t one = 1;
+    if (write(host->completionFd, &one, sizeof(one))) {}
+}
+
+static void runUnit(SPKTVOneHost *host, unitType *unit)
+{
+    while (true)
+    {
+        batchPartType *part;
+        {
+            std::unique_lock<std::mutex> guard(unit->lock);
+            unit->wake.wait(guard, [host, unit] { return !unit->pending.empty() || !host->running; });
+            if (unit->pending.empty()) return;
+            part = unit->pending.front();
+            unit->pending.pop_front();
+        }
+        
+        // TASK: Run this unit's share of the batch, not split by anything else queued on the unit
+        
+        unit->tvOne->beginCommandGroup();
+        for (size_t i = 0; i < part->records.size(); i++)
+        {
+            const SPKTVOneBatchRecord &record = part->records[i];
+            SPKTVOneBatchResult *result = part->results[i];
+            
+            result->payload = record.payload;
+            if (record.flags & kSPKTVOneBatchRead)
+            {
+                result->ok = unit->tvOne->readCommand(record.channel, record.window, record.func, result->payload);
+            }
+            else
+            {
+                SPKTVOne::writeMode mode = (record.flags & kSPKTVOneBatchFast) ? SPKTVOne::writeFast : SPKTVOne::writeVerified;
+                result->ok = unit->tvOne->command(record.channel, record.window, record.func, record.payload, mode);
+            }
+        }
+        unit->tvOne->endCommandGroup();
+        
+        if (--part->batch->unitsLeft == 0) completeBatch(host, part->batch);
+        delete part;
+    }
+}
+
+SPKTVOneHost* spkTVOneOpen(const char *const ports[], int count)
+{
+    SPKTVOneHost *host = new SPKTVOneHost;
+    host->running = true;
+    host->completionFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (host->completionFd < 0)
+    {
+        delete host;
+        return NULL;
+    }
+    
+    for (int i = 0; i < count; i++)
+    {
+        unitType *unit = new unitType;
+        unit->tvOne = new SPKTVOne(ports[i], NC);
+        host->units.push_back(unit);
+    }
+    
+    for (size_t i = 0; i < host->units.size(); i++)
+    {
+        unitType *unit = host->units[i];
+        try
+        {
+            unit->thread = std::thread(runUnit, host, unit);
+        }
+        catch (const std::system_error &)
+        {
+            spkTVOneClose(host);
+            return NULL;
+        }
+    }
+    
+    return host;
+}
+
+void spkTVOneClose(SPKTVOneHost *host)
+{
+    if (!host) return;
+    
+    // Units finish what they were given before stopping
+    host->running = false;
+    for (size_t i = 0; i < host->units.size(); i++)
+    {
+        unitType *unit = host->units[i];
+        {
+            std::lock_guard<std::mutex> guard(unit->lock);
+            unit->wake.notify_one();
+        }
+        if (unit->thread.joinable()) unit->thread.join();
+    }
+    
+    for (size_t i = 0; i < host->units.size(); i++)
+    {
+        delete host->units[i]->tvOne;
+        delete host->units[i];
+    }
+    
+    close(host->completionFd);
+    delete host;
+}
+
+int spkTVOneSubmit(SPKTVOneHost *host, const SPKTVOneBatchRecord records[], SPKTVOneBatchResult results[], int count, uint64_t tag)
+{
+    if (!host->running) return -1;
+    
+    // TASK: Split the batch by unit, refusing what could never succeed
+    
+    std::vector<batchPartType*> parts(host->units.size(), (batchPartType*)NULL);
+    batchType *batch = new batchType;
+    batch->tag = tag;
+    
+    int partCount = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const SPKTVOneBatchRecord &record = records[i];
+        
+        bool known = (record.unit < host->units.size());
+        if (known && (record.flags & kSPKTVOneBatchRead)) known = (kTV1FunctionDescriptor(record.func) != NULL);
+        else if (known) known = (kTV1FunctionWriteError(record.channel, record.window, record.func, record.payload) == NULL);
+        
+        if (!known)
+        {
+            results[i].ok = -1;
+            results[i].payload = record.payload;
+            continue;
+        }
+        
+        batchPartType *&part = parts[record.unit];
+        if (!part)
+        {
+            part = new batchPartType;
+            part->batch = batch;
+            partCount++;
+        }
+        part->records.push_back(record);
+        part->results.push_back(&results[i]);
+    }
+    
+    // All parts are counted before any is handed over, so no unit can complete the batch early
+    batch->unitsLeft = partCount;
+    if (partCount == 0)
+    {
+        completeBatch(host, batch);
+        return 0;
+    }
+    
+    // TASK: Hand each unit its part
+    
+    for (size_t u = 0; u < parts.size(); u++)
+    {
+        if (!parts[u]) continue;
+        
+        unitType *unit = host->units[u];
+        std::lock_guard<std::mutex> guard(unit->lock);
+        unit->pending.push_back(parts[u]);
+        unit->wake.notify_one();
+    }
+    
+    return 0;
+}
+
+int spkTVOneCompletionFd(SPKTVOneHost *host)
+{
+    return host->completionFd;
+}
+
+int spkTVOneReap(SPKTVOneHost *host, uint64_t tags[], int maxTags)
+{
+    // Clear the fd first, so a batch completing from here on makes it readable again
+    uint64_t count;
+    if (read(host->completionFd, &count, sizeof(count))) {}
+    
+    std::lock_guard<std::mutex> guard(host->completedLock);
+    
+    int reaped = 0;
+    while (reaped < maxTags && !host->completed.empty())
+    {
+        tags[reaped++] = host->completed.front();
+        host->completed.pop_front();
+    }
+    
+    // Leave it readable if there's more than would fit
+    if (!host->completed.empty())
+    {
+        uint64_t one = 1;
+        if (write(host->completionFd, &one, sizeof(one))) {}
+    }
+    
+    return reaped;
+}
+
+#endif
@@ -0,0 +1,80 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// C interface: batches of commands across units, completed asynchronously for a host event loop
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A C interface to the host build, for apps in C or with C bindings. Built like spk_tvone_posix.cpp, eg.
+// g++ -std=c++11 -pthread -DSPK_TVONE_POSIX -c spk_tvone_mbed.cpp spk_tvone_posix.cpp spk_tvone_c.cpp
+//
+// A batch is any number of records, across any of the units opened, submitted in one call. Each unit has a thread that runs
+// its part of each batch in order, as one command group, while the other units run theirs. Records are copied on submit,
+// results are filled in as each command finishes, so must stay put until the batch's tag comes back from spkTVOneReap.
+// The completion fd is an eventfd, readable when batches have completed, for poll, epoll or the app's own event loop.
+//
+// Result ok is 1 for success, 0 for a command the unit didn't ack, -1 for a record refused before sending: 
+// an unknown unit, or a function or payload the unit would reject. Payload is the value read, or for a write, what was sent.
+
+#ifndef SPKTVOne_C_h
+#define SPKTVOne_C_h
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define kSPKTVOneBatchRead      0x01    // Read func into the result, rather than write payload
+#define kSPKTVOneBatchFast      0x02    // Write without waiting for the echoed payload, see SPKTVOne::writeFast
+
+typedef struct SPKTVOneHost SPKTVOneHost;
+
+typedef struct
+{
+    uint32_t unit;
+    uint8_t  channel;
+    uint8_t  window;
+    uint16_t flags;
+    int32_t  func;
+    int32_t  payload;
+} SPKTVOneBatchRecord;
+
+typedef struct
+{
+    int32_t ok;
+    int32_t payload;
+} SPKTVOneBatchResult;
+
+// Ports are device paths, or any form SPKTVOne takes on the host, see spk_tvone_posix.h. Returns NULL if any thread couldn't start.
+SPKTVOneHost* spkTVOneOpen(const char *const ports[], int count);
+void          spkTVOneClose(SPKTVOneHost *host);
+
+// Returns 0, or -1 if the host is closing
+int spkTVOneSubmit(SPKTVOneHost *host, const SPKTVOneBatchRecord records[], SPKTVOneBatchResult results[], int count, uint64_t tag);
+
+int spkTVOneCompletionFd(SPKTVOneHost *host);
+
+// Takes up to maxTags tags of completed batches, in the order they completed. Returns how many.
+int spkTVOneReap(SPKTVOneHost *host, uint64_t tags[], int maxTags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
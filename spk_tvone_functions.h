@@ -0,0 +1,268 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Function descriptor table: what each kTV1Function takes, so bad commands are caught before they're sent
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SPKTVOne_Functions_h
+#define SPKTVOne_Functions_h
+
+#include <stdint.h>
+#include <string.h>
+
+#include "spk_tvone.h"
+
+// Ranges are as documented in spk_tvone.h, widened where the unit is known to accept more (eg. ActiveH of 2048 for dual-head XGA).
+// Functions the table doesn't know about are passed through unchecked.
+// Where the documentation gives one function ID several names (eg. 0x144), the entry is the union of them all.
+
+// The payload is sent as 24 bits, signed values as two's complement
+#define kTV1PayloadMin                          (-0x800000)
+#define kTV1PayloadMax                          0xFFFFFF
+
+#define kTV1FunctionFlagReadOnly                0x01    // Status, writing is an error
+#define kTV1FunctionFlagChannel                 0x02    // Needs a source channel, eg. kTV1SourceRGB1
+#define kTV1FunctionFlagWindow                  0x04    // Needs a window, eg. kTV1WindowIDA
+#define kTV1FunctionFlagImageToAdjust           0x08    // Applies to the resolution selected by kTV1FunctionAdjustResolutionImageToAdjust
+#define kTV1FunctionFlagCacheable               0x10    // Value persists as written, so a local copy can stand in for a read
+#define kTV1FunctionFlagTrigger                 0x20    // Writing acts as well as sets, so no write may be dropped as a repeat, eg. lock then unlock
+
+struct SPKTVOneFunction
+{
+    int32_t func;
+    int32_t minimum;
+    int32_t maximum;
+    uint8_t flags;
+    const char *name;
+};
+
+// Sorted by function ID, for the binary search below
+constexpr SPKTVOneFunction kTV1Functions[] = 
+{
+    {kTV1FunctionAdjustSourceSharpness, -7, 7, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceSharpness"},
+    {kTV1FunctionAdjustResolutionImageToAdjust, 0, 1000, kTV1FunctionFlagCacheable, "AdjustResolutionImageToAdjust"},
+    {kTV1FunctionAdjustWindowsWindowSource, 0x10, 0xFF, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsWindowSource"},
+    {kTV1FunctionAdjustOutputsOutputResolution, 0, 1000, kTV1FunctionFlagCacheable, "AdjustOutputsOutputResolution"},
+    {kTV1FunctionAdjustOutputsSCHPhase, -180, 180, kTV1FunctionFlagCacheable, "AdjustOutputsSCHPhase"},
+    {kTV1FunctionAdjustWindowsZoomLevel, 100, 1000, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsZoomLevel"},
+    {kTV1FunctionAdjustWindowsShrinkLevel, 10, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsShrinkLevel"},
+    {kTV1FunctionAdjustResolutionStartH, 0, 1023, kTV1FunctionFlagImageToAdjust, "AdjustResolutionStartH"},
+    {kTV1FunctionAdjustResolutionStartV, 0, 1023, kTV1FunctionFlagImageToAdjust, "AdjustResolutionStartV"},
+    {kTV1FunctionAdjustResolutionCLKS, 64, 4095, kTV1FunctionFlagImageToAdjust, "AdjustResolutionCLKS"},
+    {kTV1FunctionAdjustResolutionLines, 64, 2047, kTV1FunctionFlagImageToAdjust, "AdjustResolutionLines"},
+    {kTV1FunctionAdjustResolutionSyncH, 8, 1023, kTV1FunctionFlagImageToAdjust, "AdjustResolutionSyncH"},
+    {kTV1FunctionAdjustResolutionSyncV, 1, 1023, kTV1FunctionFlagImageToAdjust, "AdjustResolutionSyncV"},
+    {kTV1FunctionAdjustSourcePixelPhase, 0, 31, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourcePixelPhase"},
+    {kTV1FunctionAdjustWindowsFlickerReduction, 0, 3, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsFlickerReduction"},
+    {kTV1FunctionAdjustResolutionSyncPolarity, 0, 3, kTV1FunctionFlagImageToAdjust, "AdjustResolutionSyncPolarity"},
+    {kTV1FunctionAdjustWindowsImageFlip, 0, 3, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsImageFlip"},
+    {kTV1FunctionAdjustResolutionActiveH, 64, 4095, kTV1FunctionFlagImageToAdjust, "AdjustResolutionActiveH"},
+    {kTV1FunctionAdjustResolutionActiveV, 64, 4095, kTV1FunctionFlagImageToAdjust, "AdjustResolutionActiveV"},
+    {kTV1FunctionAdjustWindowsImageFreeze, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable | kTV1FunctionFlagTrigger, "AdjustWindowsImageFreeze"},
+    {kTV1FunctionAdjustWindowsZoomPanH, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsZoomPanH"},
+    {kTV1FunctionAdjustWindowsZoomPanV, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsZoomPanV"},
+    {kTV1FunctionAdjustWindowsImageSmoothing, 0, 2, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsImageSmoothing"},
+    {kTV1FunctionAdjustSourceOnSourceLoss, 0, 4, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceOnSourceLoss"},
+    {kTV1FunctionAdjustWindowsOutShiftH, -4096, 4096, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsOutShiftH"},    // Also AdjustLogoOutShiftH
+    {kTV1FunctionAdjustWindowsOutShiftV, -4096, 4096, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsOutShiftV"},    // Also AdjustLogoOutShiftV
+    {kTV1FunctionAdjustKeyerMinY, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerMinY"},
+    {kTV1FunctionAdjustKeyerMinU, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerMinU"},
+    {kTV1FunctionAdjustKeyerMinV, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerMinV"},
+    {kTV1FunctionAdjustKeyerMaxY, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerMaxY"},
+    {kTV1FunctionAdjustKeyerMaxU, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerMaxU"},
+    {kTV1FunctionAdjustKeyerMaxV, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerMaxV"},
+    {kTV1FunctionAdjustSourcePositionH, -100, 100, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourcePositionH"},
+    {kTV1FunctionAdjustSourcePositionV, -100, 100, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourcePositionV"},
+    {kTV1FunctionAdjustSourceDeInterlace, 0, 6, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceDeInterlace"},
+    {kTV1FunctionAdjustSourceSaturation, 0, 180, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceSaturation"},
+    {kTV1FunctionAdjustSourceHue, -180, 180, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceHue"},
+    {kTV1FunctionAdjustSourceBrightness, 0, 180, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceBrightness"},
+    {kTV1FunctionAdjustSourceContrast, 0, 180, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceContrast"},
+    {kTV1FunctionAdjustSourceLumaDelay, -4, 3, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceLumaDelay"},
+    {kTV1FunctionAdjustResolutionFreqCoarseH, 10000, 200000, kTV1FunctionFlagImageToAdjust, "AdjustResolutionFreqCoarseH"},
+    {kTV1FunctionAdjustResolutionFreqFineH, 10000, 200000, kTV1FunctionFlagImageToAdjust, "AdjustResolutionFreqFineH"},
+    {kTV1FunctionAdjustSourceRGBInType, 0, 4, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceRGBInType"},
+    {kTV1FunctionReadBoardType, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagReadOnly, "ReadBoardType"},
+    {kTV1FunctionReadProductType, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagReadOnly, "ReadProductType"},
+    {kTV1FunctionAdjustSourceRGBContributionR, 75, 150, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceRGBContributionR"},
+    {kTV1FunctionAdjustSourceRGBContributionG, 75, 150, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceRGBContributionG"},
+    {kTV1FunctionAdjustSourceRGBContributionB, 75, 150, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceRGBContributionB"},
+    {kTV1FunctionPowerOnPresetStore, 0, 1, 0, "PowerOnPresetStore"},
+    {kTV1FunctionAdjustSourceFieldSwap, 0, 1, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceFieldSwap"},
+    {kTV1FunctionAdjustResolutionInterlaced, 0, 1, kTV1FunctionFlagImageToAdjust, "AdjustResolutionInterlaced"},
+    {kTV1FunctionReadSoftwareVersion, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagReadOnly, "ReadSoftwareVersion"},
+    {kTV1FunctionAdjustWindowsShrinkPosH, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsShrinkPosH"},
+    {kTV1FunctionAdjustWindowsShrinkPosV, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsShrinkPosV"},
+    {kTV1FunctionAdjustSourceTestCard, 0, 10, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceTestCard"},
+    {kTV1FunctionAdjustSourceSizeH, -100, 100, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceSizeH"},
+    {kTV1FunctionAdjustSourceSizeV, -100, 100, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceSizeV"},
+    {kTV1FunctionAdjustOutputsOutputImageTypeA, 0, 7, kTV1FunctionFlagCacheable, "AdjustOutputsOutputImageTypeA"},
+    {kTV1FunctionAdjustSourceFilmMode, 0, 1, kTV1FunctionFlagReadOnly | kTV1FunctionFlagChannel, "AdjustSourceFilmMode"},
+    {kTV1FunctionAdjustTransitionFadeTime, 0, 50, kTV1FunctionFlagCacheable, "AdjustTransitionFadeTime"},
+    {kTV1FunctionAdjustWindowsSourceResolution, 0, 1000, kTV1FunctionFlagReadOnly | kTV1FunctionFlagWindow, "AdjustWindowsSourceResolution"},
+    {kTV1FunctionAdjustFrontPanelLock, 0, 1, kTV1FunctionFlagCacheable | kTV1FunctionFlagTrigger, "AdjustFrontPanelLock"},
+    {kTV1FunctionAdjustWindowsHeadPhonVolume, -16, 15, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsHeadPhonVolume"},
+    {kTV1FunctionAdjustSourceAutoSet, 0, 1, kTV1FunctionFlagChannel, "AdjustSourceAutoSet"},
+    {kTV1FunctionAdjustOutputsOutputStandard, 0, 2, kTV1FunctionFlagCacheable, "AdjustOutputsOutputStandard"},
+    {kTV1FunctionAdjustWindowsAspectAdjust, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsAspectAdjust"},
+    {kTV1FunctionAdjustWindowsZoomLevelH, 100, 1000, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsZoomLevelH"},
+    {kTV1FunctionAdjustWindowsShrinkLevelH, 10, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsShrinkLevelH"},
+    {kTV1FunctionAdjustWindowsZoomLevelV, 100, 1000, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsZoomLevelV"},
+    {kTV1FunctionAdjustWindowsShrinkLevelV, 10, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsShrinkLevelV"},
+    {kTV1FunctionAdjustWindowsAspectRationIn, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagReadOnly | kTV1FunctionFlagWindow, "AdjustWindowsAspectRationIn"},
+    {kTV1FunctionMode, 0, 2, kTV1FunctionFlagCacheable, "Mode"},
+    {kTV1FunctionAdjustOutputsLockMethod, 0, 0xFF, kTV1FunctionFlagCacheable, "AdjustOutputsLockMethod"},
+    {kTV1FunctionAdjustWindowsMaxFadeLevel, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsMaxFadeLevel"},    // Also AdjustLogoMaxFadeLevel
+    {kTV1FunctionAdjustTransitionType, 0, 3, kTV1FunctionFlagCacheable, "AdjustTransitionType"},
+    {kTV1FunctionAdjustOutputsTake, 0, 1, 0, "AdjustOutputsTake"},
+    {kTV1FunctionAdjustKeyerSoftnessY, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerSoftnessY"},
+    {kTV1FunctionAdjustKeyerInvertY, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerInvertY"},
+    {kTV1FunctionAdjustKeyerSoftnessU, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerSoftnessU"},
+    {kTV1FunctionAdjustKeyerInvertU, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerInvertU"},
+    {kTV1FunctionAdjustKeyerSoftnessV, 0, 255, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerSoftnessV"},
+    {kTV1FunctionAdjustKeyerInvertV, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerInvertV"},
+    {kTV1FunctionAdjustKeyerEnable, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustKeyerEnable"},
+    {kTV1FunctionAdjustWindowsEnable, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsEnable"},    // Also AdjustLogoEnable
+    {kTV1FunctionAdjustOutputsPalWSS, 0, 8, kTV1FunctionFlagCacheable, "AdjustOutputsPalWSS"},
+    {kTV1FunctionAdjustOutputsCVYCIRE, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagCacheable, "AdjustOutputsCVYCIRE"},
+    {kTV1FunctionAdjustOutputsLumaBandwidth, 0, 2, kTV1FunctionFlagCacheable, "AdjustOutputsLumaBandwidth"},
+    {kTV1FunctionAdjustOutputsChromaBandwidth, 0, 2, kTV1FunctionFlagCacheable, "AdjustOutputsChromaBandwidth"},
+    {kTV1FunctionAdjustOutputsOutputChromaDelay, -4, 3, kTV1FunctionFlagCacheable, "AdjustOutputsOutputChromaDelay"},
+    {kTV1FunctionAdjustOutputsCVYCHue, -22, 22, kTV1FunctionFlagCacheable, "AdjustOutputsCVYCHue"},
+    {kTV1FunctionAdjustOutputsBackgroundY, 16, 235, kTV1FunctionFlagCacheable, "AdjustOutputsBackgroundY"},
+    {kTV1FunctionAdjustOutputsBackgroundU, 16, 235, kTV1FunctionFlagCacheable, "AdjustOutputsBackgroundU"},
+    {kTV1FunctionAdjustOutputsBackgroundV, 16, 235, kTV1FunctionFlagCacheable, "AdjustOutputsBackgroundV"},
+    {kTV1FunctionAdjustLogoNumber, 0, 9, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustLogoNumber"},
+    {kTV1FunctionAdjustWindowsLayerPriority, 0, 5, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsLayerPriority"},    // Also AdjustKeyerSwap, AdjustLogoLayerPriority
+    {kTV1FunctionAdjustTransitionWipeType, 0, 5, kTV1FunctionFlagCacheable, "AdjustTransitionWipeType"},
+    {kTV1FunctionAdjustTransitionWipeSize, 10, 2000, kTV1FunctionFlagCacheable, "AdjustTransitionWipeSize"},
+    {kTV1FunctionAdjustOutputsLockSource, 0x10, 0xFF, kTV1FunctionFlagCacheable, "AdjustOutputsLockSource"},
+    {kTV1FunctionAdjustOutputsLockHShift, -4096, 4096, kTV1FunctionFlagCacheable, "AdjustOutputsLockHShift"},
+    {kTV1FunctionAdjustOutputsLockVShift, -4096, 4096, kTV1FunctionFlagCacheable, "AdjustOutputsLockVShift"},
+    {kTV1FunctionAdjustBorderEnable, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderEnable"},
+    {kTV1FunctionAdjustBorderSizeH, 0, 99, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderSizeH"},
+    {kTV1FunctionAdjustBorderSizeV, 0, 99, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderSizeV"},
+    {kTV1FunctionAdjustBorderOffsetH, 0, 99, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderOffsetH"},
+    {kTV1FunctionAdjustBorderOffsetV, 0, 99, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderOffsetV"},
+    {kTV1FunctionAdjustBorderY, 16, 235, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderY"},
+    {kTV1FunctionAdjustBorderU, 16, 240, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderU"},
+    {kTV1FunctionAdjustBorderV, 16, 240, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderV"},
+    {kTV1FunctionAdjustBorderOpacity, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustBorderOpacity"},
+    {kTV1FunctionAdjustOutputsOutputImageTypeD, 0, 9, kTV1FunctionFlagCacheable, "AdjustOutputsOutputImageTypeD"},
+    {kTV1FunctionAdjustOutputsOutputEnable, 0, 1, kTV1FunctionFlagCacheable, "AdjustOutputsOutputEnable"},
+    {kTV1FunctionAdjustWindowsShrinkEnable, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsShrinkEnable"},
+    {kTV1FunctionAdjustWindowsAspectChange, 0, 2, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsAspectChange"},
+    {kTV1FunctionAdjustWindowsFadeOutIn, -1, 1, kTV1FunctionFlagWindow, "AdjustWindowsFadeOutIn"},
+    {kTV1FunctionAdjustSourceFieldOffset, 0, 7, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceFieldOffset"},
+    {kTV1FunctionAdjustOutputsSDIOptimization, 0, 1, kTV1FunctionFlagCacheable, "AdjustOutputsSDIOptimization"},
+    {kTV1FunctionAdjustOutputsVolume, -16, 15, kTV1FunctionFlagCacheable, "AdjustOutputsVolume"},
+    {kTV1FunctionAdjustWindowsAudioVolume, -128, 127, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsAudioVolume"},    // Also AdjustWindowsAudioVolumeEnable
+    {kTV1FunctionAdjustWindowsInTopLeftH, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsInTopLeftH"},
+    {kTV1FunctionAdjustWindowsInSizeH, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsInSizeH"},
+    {kTV1FunctionAdjustWindowsInTopLeftV, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsInTopLeftV"},
+    {kTV1FunctionAdjustWindowsInSizeV, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsInSizeV"},
+    {kTV1FunctionAdjustWindowsOutTopLeftH, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsOutTopLeftH"},
+    {kTV1FunctionAdjustWindowsOutSizeH, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsOutSizeH"},
+    {kTV1FunctionAdjustWindowsOutTopLeftV, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsOutTopLeftV"},
+    {kTV1FunctionAdjustWindowsOutTopLeft, kTV1PayloadMin, kTV1PayloadMax, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsOutTopLeft"},
+    {kTV1FunctionAdjustWindowsCropH, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsCropH"},
+    {kTV1FunctionAdjustWindowsCropV, 0, 100, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsCropV"},
+    {kTV1FunctionPreset, 0, 10, kTV1FunctionFlagCacheable, "Preset"},
+    {kTV1FunctionPresetLoad, 0, 1, 0, "PresetLoad"},
+    {kTV1FunctionPresetStore, 0, 1, 0, "PresetStore"},
+    {kTV1FunctionPresetErase, 0, 1, 0, "PresetErase"},
+    {kTV1FunctionAdjustWindowsTemporalInterp, 0, 1, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsTemporalInterp"},
+    {kTV1FunctionAdjustSourceSourceStable, 0, 1, kTV1FunctionFlagReadOnly | kTV1FunctionFlagChannel, "AdjustSourceSourceStable"},
+    {kTV1FunctionAdjustSourceDiagonalInterp, 0, 1, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceDiagonalInterp"},
+    {kTV1FunctionAdjustOutputsHDCPRequired, 0, 1, kTV1FunctionFlagCacheable, "AdjustOutputsHDCPRequired"},
+    {kTV1FunctionAdjustOutputsHDCPStatus, 0, 4, kTV1FunctionFlagReadOnly, "AdjustOutputsHDCPStatus"},
+    {kTV1FunctionAdjustSourceHDCPAdvertize, 0, 1, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceHDCPAdvertize"},
+    {kTV1FunctionAdjustSourceHDCPStatus, 0, 1, kTV1FunctionFlagReadOnly | kTV1FunctionFlagChannel, "AdjustSourceHDCPStatus"},
+    {kTV1FunctionAdjustSourceYUVSetup, 0, 1, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceYUVSetup"},
+    {kTV1FunctionAdjustSourceNoiseReduction, 0, 1, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceNoiseReduction"},
+    {kTV1FunctionAdjustSourceAspectCorrect, 0, 4, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceAspectCorrect"},
+    {kTV1FunctionAdjustWindowsSelectUniSource, 0xE0, 0xEF, kTV1FunctionFlagWindow | kTV1FunctionFlagCacheable, "AdjustWindowsSelectUniSource"},
+    {kTV1FunctionAdjustSourceEDID, 0, 7, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceEDID"},
+    {kTV1FunctionAdjustSourceEDIDCapureID, 0, 7, kTV1FunctionFlagChannel | kTV1FunctionFlagCacheable, "AdjustSourceEDIDCapureID"},
+    {kTV1FunctionAdjustSourceEditCaptureGrab, 0, 1, kTV1FunctionFlagChannel, "AdjustSourceEditCaptureGrab"}
+};
+
+constexpr int kTV1FunctionCount = sizeof(kTV1Functions) / sizeof(kTV1Functions[0]);
+
+// constexpr, so usable at compile time when func is a constant and a cheap binary search otherwise
+
+constexpr int kTV1FunctionIndex(int32_t func, int low = 0, int high = kTV1FunctionCount - 1)
+{
+    return (low > high) ? -1 :
+           (kTV1Functions[(low + high) / 2].func == func) ? (low + high) / 2 :
+           (kTV1Functions[(low + high) / 2].func < func) ? kTV1FunctionIndex(func, (low + high) / 2 + 1, high) :
+                                                           kTV1FunctionIndex(func, low, (low + high) / 2 - 1);
+}
+
+constexpr const SPKTVOneFunction* kTV1FunctionDescriptor(int32_t func)
+{
+    return (kTV1FunctionIndex(func) == -1) ? nullptr : &kTV1Functions[kTV1FunctionIndex(func)];
+}
+
+constexpr bool kTV1FunctionIsWritable(int32_t func)
+{
+    return (kTV1FunctionIndex(func) == -1) || !(kTV1Functions[kTV1FunctionIndex(func)].flags & kTV1FunctionFlagReadOnly);
+}
+
+constexpr bool kTV1FunctionInRange(int32_t func, int32_t payload)
+{
+    return (kTV1FunctionIndex(func) == -1) ? (payload >= kTV1PayloadMin && payload <= kTV1PayloadMax) :
+           (payload >= kTV1Functions[kTV1FunctionIndex(func)].minimum && payload <= kTV1Functions[kTV1FunctionIndex(func)].maximum);
+}
+
+constexpr bool kTV1FunctionHasFlag(int32_t func, uint8_t flag)
+{
+    return (kTV1FunctionIndex(func) != -1) && (kTV1Functions[kTV1FunctionIndex(func)].flags & flag);
+}
+
+constexpr bool kTV1FunctionsSorted(int i = 1)
+{
+    return (i >= kTV1FunctionCount) || (kTV1Functions[i - 1].func < kTV1Functions[i].func && kTV1FunctionsSorted(i + 1));
+}
+
+static_assert(kTV1FunctionsSorted(), "kTV1Functions must be sorted by function ID with no duplicates");
+
+// Checks a write against the table, without sending anything. Returns NULL if OK, otherwise why not.
+inline const char* kTV1FunctionWriteError(uint8_t channel, uint8_t window, int32_t func, int32_t payload)
+{
+    if (!kTV1FunctionIsWritable(func))                                    return "function is read only";
+    if (!kTV1FunctionInRange(func, payload))                              return "payload out of range";
+    if (kTV1FunctionHasFlag(func, kTV1FunctionFlagChannel) && channel == 0) return "function needs a source channel";
+    if (kTV1FunctionHasFlag(func, kTV1FunctionFlagWindow) && window == 0)   return "function needs a window";
+    
+    return NULL;
+}
+
+// For text front-ends: takes the name without the kTV1Function prefix, eg. "AdjustWindowsZoomLevel". Linear, so not for hot paths.
+inline const SPKTVOneFunction* kTV1FunctionNamed(const char *name)
+{
+    for (int i = 0; i < kTV1FunctionCount; i++)
+    {
+        if (strcmp(kTV1Functions[i].name, name) == 0) return &kTV1Functions[i];
+    }
+    
+    return NULL;
+}
+
+#endif
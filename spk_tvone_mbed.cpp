@@ -21,14 +21,49 @@
  */
 
 #include "spk_tvone_mbed.h"
-#include "mbed.h"
+#include "spk_tvone_resolutions.h"
+
+#include <ctype.h>
+
+#if defined(SPK_TVONE_POSIX)
+#include <glob.h>
+#include <termios.h>
+
+static_assert(SPKTVOne::maxSyncUnits <= Serial::maxWaitSerials, "Synchronised units must all fit in one wait");
+#endif
+
+const int32_t SPKTVOne::keyerFunctions[SPKTVOne::keyerFunctionCount] = 
+{
+    kTV1FunctionAdjustKeyerEnable,
+    kTV1FunctionAdjustKeyerMinY,
+    kTV1FunctionAdjustKeyerMinU,
+    kTV1FunctionAdjustKeyerMinV,
+    kTV1FunctionAdjustKeyerMaxY,
+    kTV1FunctionAdjustKeyerMaxU,
+    kTV1FunctionAdjustKeyerMaxV,
+    kTV1FunctionAdjustKeyerSoftnessY,
+    kTV1FunctionAdjustKeyerSoftnessU,
+    kTV1FunctionAdjustKeyerSoftnessV,
+    kTV1FunctionAdjustKeyerInvertY,
+    kTV1FunctionAdjustKeyerInvertU,
+    kTV1FunctionAdjustKeyerInvertV,
+    kTV1FunctionAdjustKeyerSwap
+};
 
 SPKTVOne::SPKTVOne(PinName txPin, PinName rxPin, PinName signWritePin, PinName signErrorPin, Serial *debugSerial)
 {
     // Create Serial connection for TVOne unit comms
     // Creating our own as this is exclusively for TVOne comms
     serial = new Serial(txPin, rxPin);
-    serial->baud(57600);
+    baudRate = kTV1BaudDefault;
+    serial->baud(baudRate);
+    resetWireStats();
+    
+    // Received bytes are buffered by interrupt, so waits can sleep until something arrives
+    rxHead = 0;
+    rxTail = 0;
+    rxOverflow = 0;
+    serial->attach(this, &SPKTVOne::rxInterrupt, Serial::RxIrq);
     
     if (signWritePin != NC) writeDO = new DigitalOut(signWritePin);
     else writeDO = NULL;
@@ -40,109 +75,624 @@ SPKTVOne::SPKTVOne(PinName txPin, PinName rxPin, PinName signWritePin, PinName s
     processor.productType = -1;
     processor.boardType = -1;
     
+    linkState = linkUp;
+    linkFailures = 0;
+    linkFailedAtUs = 0;
+    linkProbing = false;
+    linkResyncing = false;
+    resyncHandler = NULL;
+    resyncContext = NULL;
+    resetLinkStats();
+    
+    for (int i = 0; i < priorityCount; i++) 
+    {
+        queueHead[i] = 0;
+        queueTail[i] = 0;
+        for (int j = 0; j < commandQueueLength; j++) commandQueue[i][j].sequence = j;
+    }
+    resetQueueStats();
+    commandGroupDepth = 0;
+    processingQueue = false;
+#if defined(SPK_TVONE_POSIX)
+    workerRunning = false;
+#endif
+    
+    invalidateKeyer();
+    invalidateWindowGeometry();
+    memset(stateCache, 0, sizeof(stateCache));
+    statePath[0] = 0;
+    stateBatchMillis = 0;
+    stateDirty = false;
+    stateDirtySinceUs = 0;
+    stateBoots = 0;
+    
+    fastAckPending = false;
+    fastWriteVerifyInterval = 10;
+    resetFastWriteStats();
+    
+    for (int i = 0; i < imageManifestSlots; i++)
+    {
+        imageManifests[i].hashes = NULL;
+        imageManifests[i].dataLength = 0;
+    }
+    memset(&uploadStats, 0, sizeof(uploadStats));
+    
     resetCommandPeriods();
     
-    timer.start();
-    timerCheckTicker.attach(this, &SPKTVOne::timerCheck, 60);
+    timebaseLow = us_ticker_read();
+    timebaseHigh = 0;
+    timebaseTicker.attach(this, &SPKTVOne::timebaseSample, 60*30);
+    
+    lastCommandSentUs = timeUs();
+    sleptUs = 0;
+    resetLoadStats();
+    
+    lastAckLatencyUs = 0;
+    framesSent = 0;
+    latencyOverallUs = 0;
+    for (int i = 0; i <= kTV1FunctionCount; i++) latencyEstimateUs[i] = 0;
+    holdLineAtUs = 0;
+    resetTimingStats();
     
     // Link up debug Serial object
     // Passing in shared object as debugging is shared between all DVI mixer functions
     debug = debugSerial;
 }
 
-bool SPKTVOne::command(uint8_t channel, uint8_t window, int32_t func, int32_t payload)
+SPKTVOne::~SPKTVOne()
 {
-    int ackBuff[standardAckLength] = {0};
+#if defined(SPK_TVONE_POSIX)
+    stopWorker();
+#endif
     
-    bool success = command(writeCommandType, ackBuff, standardAckLength, channel, window, func, payload);
+    timebaseTicker.detach();
+    wakeTimeout.detach();
+    signErrorTimeout.detach();
     
-    // TASK: Check return payload is what we tried to set it to
-    char payloadStr[7];
-    for (int i = 0; i < 6; i++)
+    invalidateImageManifests();
+    
+    delete writeDO;
+    delete errorDO;
+    delete serial;
+}
+
+bool SPKTVOne::command(uint8_t channel, uint8_t window, int32_t func, int32_t payload, writeMode mode, periodsType periods)
+{
+    int ackBuff[standardAckLength] = {0};
+    
+    if (mode == writeFast)
     {
-        payloadStr[i] = ackBuff[11+i];
+        bool success = command(writeCommandType, ackBuff, standardAckLength, channel, window, func, payload, true, periods);
+        
+        // TASK: Keep what we have of the ack, the rest will be picked up and maybe verified before the next command
+        if (success)
+        {
+            fastWriteStats.writes++;
+            
+            for (int i = 0; i < standardAckLength; i++) fastAck[i] = ackBuff[i];
+            fastAckPos = fastAckLength;
+            fastAckPending = true;
+            fastAckVerify = (fastWriteVerifyInterval > 0) && (fastWriteStats.writes % fastWriteVerifyInterval == 0);
+            fastAckCommand.channel = channel;
+            fastAckCommand.window = window;
+            fastAckCommand.func = func;
+            fastAckCommand.payload = payload;
+            
+            recordState(channel, window, func, payload);
+        }
+        else forgetState(channel, window, func);
+        
+        return success;
     }
-    payloadStr[6] = NULL;
     
-    int payloadBack = strtol (payloadStr, NULL, 16);
+    bool success = command(writeCommandType, ackBuff, standardAckLength, channel, window, func, payload, false, periods);
+    
+    // TASK: Check return payload is what we tried to set it to
+    int payloadBack = ackPayload(ackBuff, func);
     
-    if (payload != payloadBack)
+    if (success && (payload & 0xFFFFFF) != (payloadBack & 0xFFFFFF))
     {
         success = false;
         if (debug) debug->printf("TVOne return value (%d) is not what was set (%d). Channel: %#x, Window: %#x, Function: %#x \r\n", payloadBack, payload, channel, window, func); 
     }
+    
+    if (success) recordState(channel, window, func, payload);
+    else         forgetState(channel, window, func);
+    
     return success;
 }
 
-bool SPKTVOne::readCommand(uint8_t channel, uint8_t window, int32_t func, int32_t &payload)
+bool SPKTVOne::readCommand(uint8_t channel, uint8_t window, int32_t func, int32_t &payload, periodsType periods)
 {
     int ackBuff[standardAckLength] = {0};
     
-    bool success = command(readCommandType, ackBuff, standardAckLength, channel, window, func, payload);
+    bool success = command(readCommandType, ackBuff, standardAckLength, channel, window, func, payload, false, periods);
     
     if (success)
     {    
-        char payloadStr[7];
-        for (int i = 0; i < 6; i++)
+        payload = ackPayload(ackBuff, func);
+        recordState(channel, window, func, payload);
+    }
+    
+    return success;
+}
+
+int32_t SPKTVOne::ackPayload(const int *ackBuffer, int32_t func)
+{
+    char payloadStr[7];
+    for (int i = 0; i < 6; i++)
+    {
+        payloadStr[i] = ackBuffer[11+i];
+    }
+    payloadStr[6] = 0;
+    
+    int32_t payload = strtol (payloadStr, NULL, 16);
+    
+    // The payload comes back as 24 bits, so restore the sign for functions that take negative values
+    const SPKTVOneFunction *descriptor = kTV1FunctionDescriptor(func);
+    if (descriptor && descriptor->minimum < 0 && (payload & 0x800000)) payload -= 0x1000000;
+    
+    return payload;
+}
+
+void SPKTVOne::finishFastAck()
+{
+    if (!fastAckPending) return;
+    fastAckPending = false;
+    
+    // By now the pacing period has passed, so the rest of the ack should be sat in the receive buffer
+    rxPoll();
+    while (fastAckPos < standardAckLength && rxHead != rxTail) fastAck[fastAckPos++] = rxGetc();
+    
+    if (!fastAckVerify) return;
+    
+    if (fastAckPos < standardAckLength)
+    {
+        fastWriteStats.incomplete++;
+        return;
+    }
+    
+    fastWriteStats.verified++;
+    
+    int32_t payloadBack = ackPayload(fastAck, fastAckCommand.func);
+    if ((payloadBack & 0xFFFFFF) != (fastAckCommand.payload & 0xFFFFFF))
+    {
+        fastWriteStats.mismatches++;
+        recordState(fastAckCommand.channel, fastAckCommand.window, fastAckCommand.func, payloadBack);
+        if (debug) debug->printf("TVOne fast write return value (%d) is not what was set (%d). Channel: %#x, Window: %#x, Function: %#x \r\n", payloadBack, fastAckCommand.payload, fastAckCommand.channel, fastAckCommand.window, fastAckCommand.func);
+    }
+}
+
+void SPKTVOne::setFastWriteVerifyInterval(int interval)
+{
+    fastWriteVerifyInterval = interval;
+}
+
+SPKTVOne::fastWriteStatsType SPKTVOne::getFastWriteStats()
+{
+    return fastWriteStats;
+}
+
+void SPKTVOne::resetFastWriteStats()
+{
+    fastWriteStats.writes = 0;
+    fastWriteStats.verified = 0;
+    fastWriteStats.mismatches = 0;
+    fastWriteStats.incomplete = 0;
+}
+
+bool SPKTVOne::commandAt(uint64_t deadlineUs, uint8_t channel, uint8_t window, int32_t func, int32_t payload)
+{
+    const char *error = kTV1FunctionWriteError(channel, window, func, payload);
+    if (error)
+    {
+        if (debug) debug->printf("TVOne scheduled command rejected, %s. Channel: %#x, Window: %#x, Function: %#x Payload: %i \r\n", error, channel, window, func, payload);
+        return false;
+    }
+    
+    // TASK: Work out when to send so the ack, and so the change, lands on the deadline
+    
+    uint64_t latencyUs = commandLatencyUs(func);
+    uint64_t sendAt = (deadlineUs > latencyUs) ? deadlineUs - latencyUs : 0;
+    
+    // TASK: Use the time until then for queued commands, as long as they'll be off the line by sendAt
+    
+    holdLineAtUs = sendAt;
+    processQueue();
+    holdLineAtUs = 0;
+    
+    uint64_t readyAt = lastCommandSentUs + (uint64_t)commandMinimumPeriod * 1000;
+    bool late = (timeUs() > sendAt) || (readyAt > sendAt);
+    
+    if (debug) debug->printf("TVOne Write at %ims, sending %ius early. Channel: %#x, Window: %#x, Function: %#x Payload: %i \r\n", (int)(deadlineUs / 1000), (int)latencyUs, channel, window, func, payload);
+    
+    waitFor(sendAt, false);
+    
+    // TASK: Send directly, there's no time for anything the normal command path might do first
+    
+    char frame[kTV1FrameLength];
+    kTV1EncodeWriteFrame(frame, channel, window, func, payload);
+    
+    int ackBuff[standardAckLength] = {0};
+    bool success = sendFrame(frame, kTV1FrameLength, ackBuff, standardAckLength, false);
+    uint64_t ackedAt = timeUs();
+    
+    if (success && (ackPayload(ackBuff, func) & 0xFFFFFF) != (payload & 0xFFFFFF)) success = false;
+    
+    // TASK: Record how far off the deadline the ack came
+    
+    timingStats.scheduled++;
+    if (late) timingStats.late++;
+    if (!success)
+    {
+        timingStats.failed++;
+        forgetState(channel, window, func);
+        return false;
+    }
+    
+    recordState(channel, window, func, payload);
+    
+    recordLatency(func, lastAckLatencyUs);
+    
+    int errorUs = (int)((int64_t)ackedAt - (int64_t)deadlineUs);
+    int absErrorUs = (errorUs < 0) ? -errorUs : errorUs;
+    
+    timingStats.lastErrorUs = errorUs;
+    timingStats.totalAbsErrorUs += absErrorUs;
+    if (absErrorUs > timingStats.maxAbsErrorUs) timingStats.maxAbsErrorUs = absErrorUs;
+    
+    return true;
+}
+
+bool SPKTVOne::commandSynchronised(SPKTVOne *const units[], const queuedCommand commands[], int count, uint64_t takeAtUs, syncResultType *result)
+{
+    if (count < 1 || count > maxSyncUnits) return false;
+    
+    SPKTVOne *lead = units[0];
+    
+    // TASK: Pre-stage every frame, so nothing but byte writes happens once the sends start
+    
+    char     frames[maxSyncUnits][kTV1FrameLength];
+    uint64_t latencyUs[maxSyncUnits];
+    
+    for (int i = 0; i < count; i++)
+    {
+        const queuedCommand &c = commands[i];
+        const char *error = kTV1FunctionWriteError(c.channel, c.window, c.func, c.payload);
+        if (error)
         {
-            payloadStr[i] = ackBuff[11+i];
+            if (units[i]->debug) units[i]->debug->printf("TVOne synchronised command rejected, %s. Unit: %i, Channel: %#x, Window: %#x, Function: %#x Payload: %i \r\n", error, i, c.channel, c.window, c.func, c.payload);
+            return false;
         }
-        payloadStr[6] = NULL;
         
-        payload = strtol (payloadStr, NULL, 16);
+        kTV1EncodeWriteFrame(frames[i], c.channel, c.window, c.func, c.payload);
+        latencyUs[i] = units[i]->commandLatencyUs(c.func);
     }
     
-    return success;
+    // TASK: Pick the target, the earliest time every unit can make given its line and latency. Then hold queues clear of it.
+    // Each unit keeps its own timebase on mbed, so the target is on the lead's clock and anything of a unit's is taken as time from now.
+    
+    uint64_t targetUs = takeAtUs;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            uint64_t unitReadyAt = units[i]->lastCommandSentUs + (uint64_t)units[i]->commandMinimumPeriod * 1000;
+            uint64_t unitNow = units[i]->timeUs();
+            uint64_t readyAt = lead->timeUs() + ((unitReadyAt > unitNow) ? unitReadyAt - unitNow : 0);
+            if (readyAt + latencyUs[i] > targetUs) targetUs = readyAt + latencyUs[i];
+        }
+        
+        // Second pass picks up any unit whose queue ran over, though the hold should have stopped that
+        if (pass == 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                uint64_t leadNow = lead->timeUs();
+                uint64_t holdAt = targetUs - latencyUs[i];
+                units[i]->holdLineAtUs = units[i]->timeUs() + ((holdAt > leadNow) ? holdAt - leadNow : 0);
+                units[i]->processQueue();
+                units[i]->holdLineAtUs = 0;
+            }
+        }
+    }
+    
+    if (lead->debug) lead->debug->printf("TVOne synchronised take of %i units at %ims \r\n", count, (int)(targetUs / 1000));
+    
+    uint64_t sendAt[maxSyncUnits];
+    uint64_t startUs[maxSyncUnits];
+    uint64_t timeoutAt = 0;
+    int      sent[maxSyncUnits];
+    
+    for (int i = 0; i < count; i++)
+    {
+        units[i]->finishFastAck();
+        units[i]->rxFlush();
+        if (units[i]->writeDO) *units[i]->writeDO = 1;
+        
+        sendAt[i] = targetUs - latencyUs[i];
+        sent[i] = 0;
+    }
+    
+    // TASK: Release, interleaving bytes across ports so no unit waits on another's frame
+    
+    int sending = count;
+    while (sending > 0)
+    {
+        uint64_t now = lead->timeUs();
+        uint64_t nextAt = 0;
+        bool wrote = false;
+        
+        for (int i = 0; i < count; i++)
+        {
+            if (sent[i] == kTV1FrameLength) continue;
+            
+            if (now < sendAt[i])
+            {
+                if (nextAt == 0 || sendAt[i] < nextAt) nextAt = sendAt[i];
+                continue;
+            }
+            
+            if (!units[i]->serial->writeable()) continue;
+            
+            if (sent[i] == 0) startUs[i] = now;
+            units[i]->serial->putc(frames[i][sent[i]++]);
+            wrote = true;
+            
+            if (sent[i] == kTV1FrameLength)
+            {
+                units[i]->lastCommandSentUs = units[i]->timeUs();
+                
+                uint64_t unitTimeoutAt = lead->timeUs() + (uint64_t)units[i]->commandTimeoutPeriod * 1000;
+                if (unitTimeoutAt > timeoutAt) timeoutAt = unitTimeoutAt;
+                sending--;
+            }
+        }
+        
+        if (!wrote && nextAt) lead->waitFor(nextAt, false);
+    }
+    
+    // TASK: Collect every unit's ack, framed and matched to its frame as sendFrame does
+    
+    int           ackBuff[maxSyncUnits][standardAckLength];
+    ackFramerType framers[maxSyncUnits];
+    uint64_t      ackedAt[maxSyncUnits];
+    
+    for (int i = 0; i < count; i++)
+    {
+        framers[i].pos = 0;
+        framers[i].skipToCR = false;
+        ackedAt[i] = 0;
+    }
+    
+    int pending = count;
+    while (pending > 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            SPKTVOne *unit = units[i];
+            while (!ackedAt[i] && unit->rxHead != unit->rxTail)
+            {
+                if (unit->frameAck(framers[i], unit->rxGetc(), ackBuff[i], standardAckLength, frames[i]) != ackWhole) continue;
+                
+                ackedAt[i] = lead->timeUs();
+                pending--;
+            }
+        }
+        
+        if (pending == 0 || lead->timeUs() >= timeoutAt) break;
+        
+        waitForAny(units, count, timeoutAt);
+    }
+    
+    // TASK: Check each ack, learn from its latency, and measure how close together they landed
+    
+    int acked = 0;
+    uint64_t firstAckUs = 0;
+    uint64_t lastAckUs = 0;
+    int maxErrorUs = 0;
+    
+    for (int i = 0; i < count; i++)
+    {
+        SPKTVOne *unit = units[i];
+        if (unit->writeDO) *unit->writeDO = 0;
+        
+        bool ok = ackedAt[i] && ackBuff[i][1] == '4' && (ackPayload(ackBuff[i], commands[i].func) & 0xFFFFFF) == (commands[i].payload & 0xFFFFFF);
+        unit->recordLinkResult(ok);
+        if (!ok)
+        {
+            if (unit->debug) unit->debug->printf("TVOne synchronised command failed on unit %i, received %i ack chars \r\n", i, ackedAt[i] ? standardAckLength : framers[i].pos);
+            unit->forgetState(commands[i].channel, commands[i].window, commands[i].func);
+            continue;
+        }
+        
+        unit->recordState(commands[i].channel, commands[i].window, commands[i].func, commands[i].payload);
+        unit->recordLatency(commands[i].func, ackedAt[i] - startUs[i]);
+        
+        if (acked == 0 || ackedAt[i] < firstAckUs) firstAckUs = ackedAt[i];
+        if (acked == 0 || ackedAt[i] > lastAckUs) lastAckUs = ackedAt[i];
+        
+        int errorUs = (ackedAt[i] > targetUs) ? ackedAt[i] - targetUs : targetUs - ackedAt[i];
+        if (errorUs > maxErrorUs) maxErrorUs = errorUs;
+        
+        acked++;
+    }
+    
+    if (result)
+    {
+        result->acked = acked;
+        result->skewUs = lastAckUs - firstAckUs;
+        result->maxErrorUs = maxErrorUs;
+        result->targetUs = targetUs;
+    }
+    
+    return acked == count;
+}
+
+void SPKTVOne::waitForAny(SPKTVOne *const units[], int count, uint64_t deadlineUs)
+{
+    // As waitFor, but returns when any of the units has received a byte
+    SPKTVOne *lead = units[0];
+    uint64_t now = lead->timeUs();
+    if (now >= deadlineUs) return;
+    
+    uint64_t wait = deadlineUs - now;
+    
+#if defined(SPK_TVONE_POSIX)
+    Serial *serials[maxSyncUnits];
+    for (int i = 0; i < count; i++) serials[i] = units[i]->serial;
+    
+    Serial::waitReadable(serials, count, wait);
+    for (int i = 0; i < count; i++) units[i]->rxInterrupt();
+#else
+    lead->wakeTimeout.attach_us(lead, &SPKTVOne::wakeInterrupt, (wait > 0x7FFFFFFF) ? 0x7FFFFFFF : (uint32_t)wait);
+    __disable_irq();
+    bool ready = false;
+    for (int i = 0; i < count; i++) ready = ready || (units[i]->rxHead != units[i]->rxTail);
+    if (!ready) sleep();
+    __enable_irq();
+    lead->wakeTimeout.detach();
+#endif
+    
+    lead->sleptUs += lead->timeUs() - now;
+}
+
+uint32_t SPKTVOne::commandLatencyUs(int32_t func)
+{
+    int index = kTV1FunctionIndex(func);
+    uint32_t latencyUs = latencyEstimateUs[(index == -1) ? kTV1FunctionCount : index];
+    
+    return latencyUs ? latencyUs : latencyOverallUs;
+}
+
+void SPKTVOne::recordLatency(int32_t func, uint32_t latencyUs)
+{
+    // Moving averages, weighting the latest sample 1/8. The first sample for a function stands on its own.
+    int index = kTV1FunctionIndex(func);
+    uint32_t &estimateUs = latencyEstimateUs[(index == -1) ? kTV1FunctionCount : index];
+    
+    estimateUs = estimateUs ? estimateUs + ((int32_t)latencyUs - (int32_t)estimateUs) / 8 : latencyUs;
+    latencyOverallUs = latencyOverallUs ? latencyOverallUs + ((int32_t)latencyUs - (int32_t)latencyOverallUs) / 8 : latencyUs;
+}
+
+SPKTVOne::timingStatsType SPKTVOne::getTimingStats()
+{
+    return timingStats;
+}
+
+void SPKTVOne::resetTimingStats()
+{
+    timingStats.scheduled = 0;
+    timingStats.late = 0;
+    timingStats.failed = 0;
+    timingStats.lastErrorUs = 0;
+    timingStats.maxAbsErrorUs = 0;
+    timingStats.totalAbsErrorUs = 0;
 }
 
-bool SPKTVOne::command(commandType readWrite, int* ackBuffer, int ackLength, uint8_t channel, uint8_t window, int32_t func, int32_t payload) 
+bool SPKTVOne::command(commandType readWrite, int* ackBuffer, int ackLength, uint8_t channel, uint8_t window, int32_t func, int32_t payload, bool fast, periodsType periods) 
 { 
+  // TASK: Reject writes the unit won't accept before spending any serial time on them
+  if (readWrite == writeCommandType)
+  {
+    const char *error = kTV1FunctionWriteError(channel, window, func, payload);
+    if (error)
+    {
+        if (debug) debug->printf("TVOne command rejected, %s. Channel: %#x, Window: %#x, Function: %#x Payload: %i \r\n", error, channel, window, func, payload);
+        return false;
+    }
+  }
+
+  // TASK: Let any interactive commands waiting in the queue jump ahead, unless we're mid-group
+  if (!processingQueue && commandGroupDepth == 0) processQueue(priorityInteractive);
+
   if (debug) debug->printf("TVOne %s Channel: %#x, Window: %#x, Function: %#x Payload: %i \r\n", (readWrite == writeCommandType) ? "Write" : "Read", channel, window, func, payload);
 
-  // TASK: Sign start of serial command write
-  if (writeDO) *writeDO = 1;
-  
-  // TASK: Prepare to issue command to the TVOne unit
-  // - discard anything waiting to be read in the return serial buffer
-  // - make sure we're past the minimum time between command sends as the unit can get overloaded
-  while (serial->readable() || timer.read_ms() < commandMinimumPeriod) {
-    if (serial->readable()) serial->getc();
-  }
-  
-  // TASK: Create the bytes of command
-
-  uint8_t cmd[8];
-  uint8_t checksum = 0;
-
-  // CMD
-  cmd[0] = readWrite<<7 | 1<<2;
-  // CHA
-  cmd[1] = channel;
-  // WINDOW
-  cmd[2] = window;
-  // OUTPUT & FUNCTION
-  //            cmd[3]  cmd[4]
-  // output 0 = 0000xxx xxxxxxx
-  // function = xxxXXXX XXXXXXX
-  cmd[3] = func >> 8;
-  cmd[4] = func & 0xFF;
-  // PAYLOAD
-  cmd[5] = (payload >> 16) & 0xFF;
-  cmd[6] = (payload >> 8) & 0xFF;
-  cmd[7] = payload & 0xFF;
-
-  // TASK: Write the bytes of command to RS232 as correctly packaged 20 characters of ASCII
+  // TASK: Create the bytes of command, packaged as 20 characters of ASCII for a write, 14 for a read
+
+  char frame[kTV1FrameLength];
+  int frameLength = kTV1FrameLength;
   
   if (readWrite == writeCommandType)
   {
-    for (int i=0; i<8; i++) checksum += cmd[i];
-    serial->printf("F%02X%02X%02X%02X%02X%02X%02X%02X%02X\r", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], cmd[5], cmd[6], cmd[7], checksum);
+    kTV1EncodeWriteFrame(frame, channel, window, func, payload);
   }
   if (readWrite == readCommandType)
   {
-    for (int i=0; i<5; i++) checksum += cmd[i];
-    serial->printf("F%02X%02X%02X%02X%02X%02X\r", cmd[0], cmd[1], cmd[2], cmd[3], cmd[4], checksum);
+    frameLength = kTV1EncodeReadFrame(frame, channel, window, func);
   } 
+  
+  bool success = sendFrame(frame, frameLength, ackBuffer, ackLength, fast, periods);
+  
+  if (success && lastAckLatencyUs) recordLatency(func, lastAckLatencyUs);
+  
+  return success;
+}
+
+bool SPKTVOne::ackMatchesFrame(const int *ackBuffer, const char *frame)
+{
+    for (int i = kTV1FrameFunctionOffset; i < kTV1FrameFunctionOffset + 4; i++)
+    {
+        if (toupper(ackBuffer[i]) != toupper(frame[i])) return false;
+    }
+    return true;
+}
+
+SPKTVOne::ackProgressType SPKTVOne::frameAck(ackFramerType &framer, int c, int *ackBuffer, int ackLength, const char *frame)
+{
+    // Anything between frames is skipped, as is the rest of a frame we've given up on
+    if (framer.skipToCR)
+    {
+        if (c == '\r') framer.skipToCR = false;
+        return ackPartial;
+    }
+    if (framer.pos == 0 && c != 'F') return ackPartial;
+    
+    ackBuffer[framer.pos++] = c;
+    
+    bool ended = (c == '\r');
+    if (!ended && framer.pos < ackLength) return ackPartial;
+    
+    // TASK: Resync on frame boundaries rather than sitting out the timeout on a frame that will never be right
+    // An early CR is a short frame, no CR at the end means we came in mid-frame. F is also a hex digit, so only a CR can resync.
+    // A whole ack for a different function is a late one for an earlier command, so keep listening for ours.
+    bool framed = ended && framer.pos == ackLength;
+    if (framed && ackMatchesFrame(ackBuffer, frame)) return ackWhole;
+    
+    if (framed) linkStats.staleAcks++;
+    else        linkStats.framingErrors++;
+    framer.skipToCR = !ended;
+    framer.pos = 0;
+    
+    return ackResynced;
+}
+
+bool SPKTVOne::sendFrame(const char *frame, int frameLength, int* ackBuffer, int ackLength, bool fast, periodsType periods)
+{
+  // TASK: If the link is down, find out quickly whether the unit is back rather than waiting out a full timeout
+  if (linkState == linkDown && !linkProbing && !probeLink()) return false;
+
+  periods = effectivePeriods(periods);
+
+  uint64_t startUs = timeUs();
+  uint64_t sleptOnStart = sleptUs;
+
+  // TASK: Sign start of serial command write
+  if (writeDO) *writeDO = 1;
+  
+  // TASK: Prepare to issue command to the TVOne unit
+  // - make sure we're past the minimum time between command sends as the unit can get overloaded
+  // - discard anything waiting to be read in the return serial buffer
+  uint64_t readyAt = lastCommandSentUs + (uint64_t)periods.minimumMs * 1000;
+  waitFor(readyAt, false);
+  finishFastAck();
+  rxFlush();
+  
+  // TASK: Write the bytes of command to RS232
+  
+  uint64_t frameStartUs = timeUs();
+  for (int i=0; i<frameLength; i++) serial->putc(frame[i]);
+  framesSent++;
    
   // TASK: Check the unit's return string, to enable return to main program as soon as unit is ready
 
@@ -153,37 +703,62 @@ bool SPKTVOne::command(commandType readWrite, int* ackBuffer, int ackLength, uin
   // 100ms is too slow for us. Going with returning after 30ms if we've received an acknowledgement, returning after 100ms otherwise.
   
   bool success = false;  
-  int ackPos = 0;
-  timer.reset();
+  ackFramerType framer = {0, false};
+  lastCommandSentUs = timeUs();
+  uint64_t timeoutAt = lastCommandSentUs + (uint64_t)periods.timeoutMs * 1000;
 
-  while (timer.read_ms() < commandTimeoutPeriod) 
+  while (waitFor(timeoutAt, true)) 
   {
-    if (serial->readable())
+    ackProgressType progress = frameAck(framer, rxGetc(), ackBuffer, ackLength, frame);
+    if (progress == ackWhole) break;
+    if (progress == ackPartial && !(fast && framer.pos == fastAckLength)) continue;
+    
+    // TASK: Return a fast write once the ack has got as far as the function, if it's the one we sent
+    // A header alone could be a late ack for an earlier command, so it's treated as any other stale ack.
+    if (progress == ackPartial)
     {
-        if (ackPos == 0)
-        {
-            ackBuffer[0] = serial->getc();
-            if (ackBuffer[0] == 'F') ackPos = 1;
-        }
-        else
-        {
-            ackBuffer[ackPos] = serial->getc();
-            ackPos++;
-            if (ackPos == ackLength) break;
-        }
+        if (ackMatchesFrame(ackBuffer, frame)) break;
+        
+        linkStats.staleAcks++;
+        framer.skipToCR = true;
+        framer.pos = 0;
     }
+    
+    // Our ack may yet follow, but if it hasn't within a command period it isn't coming
+    uint64_t resyncTimeoutAt = timeUs() + (uint64_t)periods.minimumMs * 1000;
+    if (resyncTimeoutAt < timeoutAt) timeoutAt = resyncTimeoutAt;
   }
 
   // Return true if we got the no error acknowledgement from the unit. The rest of the ack will be verified elsewhere if needed.
-  if (ackPos == ackLength && ackBuffer[1] == '4') 
+  // Fast writes stop at the function, which is all that's needed to know this command was accepted.
+  if ((framer.pos == ackLength || (fast && framer.pos == fastAckLength)) && ackBuffer[1] == '4') 
   {
      success = true;
   }
   
+  // Time from starting to send to the full ack, which is as close as we can see to when the unit acted on it
+  lastAckLatencyUs = (framer.pos == ackLength) ? timeUs() - frameStartUs : 0;
+  
+  // Ten bits a character, for the start and stop bits
+  if (lastAckLatencyUs)
+  {
+      uint32_t wireUs = (uint32_t)((uint64_t)(frameLength + ackLength) * 10 * 1000000 / baudRate);
+      uint32_t unitUs = (lastAckLatencyUs > wireUs) ? (uint32_t)lastAckLatencyUs - wireUs : 0;
+      
+      wireStats.commands++;
+      wireStats.lastWireUs = wireUs;
+      wireStats.lastUnitUs = unitUs;
+      wireStats.totalWireUs += wireUs;
+      wireStats.totalUnitUs += unitUs;
+  }
+  
   // TASK: Sign end of write
   
   if (writeDO) *writeDO = 0;
   
+  recordLoad(startUs, sleptOnStart);
+  recordLinkResult(success);
+  
   if (!success) {
         if (errorDO) {
             signErrorTimeout.detach();
@@ -192,7 +767,7 @@ bool SPKTVOne::command(commandType readWrite, int* ackBuffer, int ackLength, uin
         }
         
         if (debug) {
-            debug->printf("TVOne serial error. Time from finishing writing command: %ims. Received %i ack chars:", timer.read_ms(), ackPos);
+            debug->printf("TVOne serial error. Time from finishing writing command: %ims. Received %i ack chars:", millisSinceLastCommandSent(), framer.pos);
             for (int i = 0; i<ackLength; i++) 
             {
                 debug->printf("%c", ackBuffer[i]);
@@ -204,38 +779,1292 @@ bool SPKTVOne::command(commandType readWrite, int* ackBuffer, int ackLength, uin
   return success;
 }
 
-void SPKTVOne::setCommandTimeoutPeriod(int millis)
+void SPKTVOne::recordLinkResult(bool success)
+{
+    if (success)
+    {
+        if (linkFailures > 0)
+        {
+            linkStats.recoveries++;
+            linkStats.lastRecoveryMs = (int)((timeUs() - linkFailedAtUs) / 1000);
+            linkStats.totalRecoveryMs += linkStats.lastRecoveryMs;
+        }
+        linkFailures = 0;
+        return;
+    }
+    
+    if (linkFailures++ == 0) linkFailedAtUs = timeUs();
+    
+    if (linkState == linkUp && linkFailures >= linkDownThreshold)
+    {
+        linkState = linkDown;
+        linkStats.linkDowns++;
+        
+        if (debug) debug->printf("TVOne link down after %i failed commands \r\n", linkFailures);
+    }
+}
+
+bool SPKTVOne::probeLink()
+{
+    char frame[kTV1ReadFrameLength];
+    int  frameLength = kTV1EncodeReadFrame(frame, 0, kTV1WindowIDA, kTV1FunctionReadSoftwareVersion);
+    int  ackBuff[standardAckLength] = {0};
+    
+    // A version read is always answered and quick to act on, so allow only a little over the usual latency
+    periodsType periods = {0, commandMinimumPeriod + 2 * (int)(latencyOverallUs / 1000)};
+    if (periods.timeoutMs > commandTimeoutPeriod) periods.timeoutMs = commandTimeoutPeriod;
+    
+    linkProbing = true;
+    bool ok = sendFrame(frame, frameLength, ackBuff, standardAckLength, false, periods);
+    linkProbing = false;
+    
+    if (!ok) return false;
+    
+    int32_t version = ackPayload(ackBuff, kTV1FunctionReadSoftwareVersion);
+    bool recovered = (linkState == linkDown);
+    bool identityChanged = (processor.version != -1 && version != processor.version);
+    
+    if (processor.version == -1) processor.version = version;
+    if (!recovered && !identityChanged) return true;
+    
+    linkState = linkUp;
+    
+    // TASK: Check it's the unit we had. A reboot into other firmware, or a different unit on the end of the cable, invalidates what we cached.
+    int32_t boardType = -1;
+    if (!readCommand(0, kTV1WindowIDA, kTV1FunctionReadBoardType, boardType)) boardType = -1;
+    if (processor.boardType != -1 && boardType != -1 && boardType != processor.boardType) identityChanged = true;
+    
+    processor.version = version;
+    processor.productType = -1;
+    processor.boardType = boardType;
+    
+    // Image slots on another unit hold who knows what, so the next upload to each is in full
+    if (identityChanged)
+    {
+        linkStats.identityChanges++;
+        invalidateImageManifests();
+    }
+    
+    if (debug) debug->printf("TVOne link %s, v: %i, b: %i%s \r\n", recovered ? "recovered" : "checked", version, boardType, identityChanged ? ", unit has changed" : "");
+    
+    // Whatever happened while we couldn't see it, the state cache is no longer to be trusted
+    invalidateStateCache();
+    
+    resyncState(identityChanged);
+    
+    return true;
+}
+
+void SPKTVOne::resyncState(bool identityChanged)
+{
+    // TASK: Put back what we know we'd set, as a power-cycled unit comes back up with its stored settings
+    for (int i = 0; i < 2; i++)
+    {
+        uint8_t window = kTV1WindowIDA + i;
+        
+        if (keyerValid[i])
+        {
+            queuedCommand commands[keyerFunctionCount] = {};
+            for (int j = 0; j < keyerFunctionCount; j++)
+            {
+                commands[j].window = window;
+                commands[j].func = keyerFunctions[j];
+                commands[j].payload = keyerApplied[i][j];
+                commands[j].mode = writeFast;
+            }
+            if (!queueCommands(priorityNormal, commands, keyerFunctionCount)) keyerValid[i] = false;
+        }
+        
+        if (geometryValid[i])
+        {
+            geometryValid[i] = false;
+            setWindowGeometry(geometryApplied[i], window, priorityNormal);
+        }
+    }
+    
+    // TASK: Let the app restore the rest. Guarded, as anything it sends could itself find the link down and recover.
+    if (resyncHandler && !linkResyncing)
+    {
+        linkResyncing = true;
+        resyncHandler(resyncContext, identityChanged);
+        linkResyncing = false;
+    }
+}
+
+SPKTVOne::linkStateType SPKTVOne::getLinkState()
+{
+    return linkState;
+}
+
+bool SPKTVOne::checkLink()
+{
+    return probeLink();
+}
+
+void SPKTVOne::setResyncHandler(void (*handler)(void *context, bool identityChanged), void *context)
+{
+    resyncHandler = handler;
+    resyncContext = context;
+}
+
+SPKTVOne::linkStatsType SPKTVOne::getLinkStats()
+{
+    return linkStats;
+}
+
+void SPKTVOne::resetLinkStats()
+{
+    memset(&linkStats, 0, sizeof(linkStats));
+}
+
+SPKTVOne::periodsType SPKTVOne::effectivePeriods(periodsType periods)
+{
+    if (periods.minimumMs == 0) periods.minimumMs = commandMinimumPeriod;
+    if (periods.timeoutMs == 0) periods.timeoutMs = commandTimeoutPeriod;
+    
+    return periods;
+}
+
+SPKTVOne::periodsType SPKTVOne::increasedPeriods(periodsType periods, int millis)
+{
+    periods = effectivePeriods(periods);
+    periods.minimumMs += millis;
+    periods.timeoutMs += millis;
+    
+    if (debug) debug->printf("Command periods increased; minimum: %i, timeout: %i", periods.minimumMs, periods.timeoutMs);
+    
+    return periods;
+}
+
+void SPKTVOne::setCommandTimeoutPeriod(int millis)
+{
+    commandTimeoutPeriod = millis;
+}
+
+void SPKTVOne::setCommandMinimumPeriod(int millis)
+{
+    commandMinimumPeriod = millis;
+}
+
+void SPKTVOne::increaseCommandPeriods(int millis)
+{
+    commandTimeoutPeriod += millis;
+    commandMinimumPeriod += millis;
+    
+    if (debug) debug->printf("Command periods increased; minimum: %i, timeout: %i", commandMinimumPeriod, commandTimeoutPeriod);
+}
+
+void SPKTVOne::resetCommandPeriods()
+{
+    commandTimeoutPeriod = kTV1CommandTimeoutMillis;
+    commandMinimumPeriod = kTV1CommandMinimumMillis;
+}
+
+const int SPKTVOne::baudLadder[] = {230400, 115200, 57600, 38400, 19200, 9600};
+const int SPKTVOne::baudLadderLength = sizeof(baudLadder) / sizeof(baudLadder[0]);
+
+int SPKTVOne::negotiateBaud(const char *persistPath)
+{
+    int remembered = 0;
+    
+    if (persistPath)
+    {
+        FILE *file = fopen(persistPath, "r");
+        if (file)
+        {
+            if (fscanf(file, "%i", &remembered) != 1) remembered = 0;
+            fclose(file);
+        }
+    }
+    
+    // TASK: Try the rate that worked last time, then the ladder from the top
+    int found = 0;
+    if (remembered > 0 && baudAnswers(remembered)) found = remembered;
+    for (int i = 0; !found && i < baudLadderLength; i++)
+    {
+        if (baudLadder[i] != remembered && baudAnswers(baudLadder[i])) found = baudLadder[i];
+    }
+    
+    if (!found)
+    {
+        if (debug) debug->printf("TVOne did not answer at any baud rate \r\n");
+        setBaud(kTV1BaudDefault);
+        return 0;
+    }
+    
+    if (debug) debug->printf("TVOne answering at %i baud \r\n", found);
+    
+    if (persistPath && found != remembered)
+    {
+        FILE *file = fopen(persistPath, "w");
+        if (file)
+        {
+            fprintf(file, "%i\n", found);
+            fclose(file);
+        }
+    }
+    
+    return found;
+}
+
+bool SPKTVOne::baudAnswers(int baud)
+{
+    setBaud(baud);
+    
+    // A CR ends any half frame the unit took from line noise at the last rate
+    serial->putc('\r');
+    
+    char frame[kTV1ReadFrameLength];
+    int  frameLength = kTV1EncodeReadFrame(frame, 0, kTV1WindowIDA, kTV1FunctionReadSoftwareVersion);
+    int  ackBuff[standardAckLength] = {0};
+    
+    // Not through the link health checks, as failing at the wrong rates is expected and isn't the link going down
+    linkStateType state = linkState;
+    linkStatsType stats = linkStats;
+    int failures = linkFailures;
+    linkProbing = true;
+    
+    bool ok = false;
+    for (int attempt = 0; !ok && attempt < 2; attempt++)
+    {
+        ok = sendFrame(frame, frameLength, ackBuff, standardAckLength, false);
+        if (ok) ok = (ackPayload(ackBuff, kTV1FunctionReadSoftwareVersion) > 0);
+    }
+    
+    linkProbing = false;
+    linkStats = stats;
+    linkState = ok ? linkUp : state;
+    linkFailures = ok ? 0 : failures;
+    
+    return ok;
+}
+
+void SPKTVOne::setBaud(int baud)
+{
+    baudRate = baud;
+    serial->baud(baud);
+    rxFlush();
+    
+    // Latencies measured at another rate no longer hold
+    for (int i = 0; i <= kTV1FunctionCount; i++) latencyEstimateUs[i] = 0;
+    latencyOverallUs = 0;
+}
+
+int SPKTVOne::getBaud()
+{
+    return baudRate;
+}
+
+SPKTVOne::wireStatsType SPKTVOne::getWireStats()
+{
+    return wireStats;
+}
+
+void SPKTVOne::resetWireStats()
+{
+    memset(&wireStats, 0, sizeof(wireStats));
+}
+
+int SPKTVOne::getCommandTimeoutPeriod()
+{
+    return commandTimeoutPeriod;
+}
+
+int SPKTVOne::millisSinceLastCommandSent()
+{
+    uint64_t millis = (timeUs() - lastCommandSentUs) / 1000;
+    
+    return (millis > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)millis;
+}
+
+uint64_t SPKTVOne::timeUs()
+{
+#if defined(SPK_TVONE_POSIX)
+    // The host clock is already 64-bit and monotonic
+    return spkPosixTimeUs();
+#else
+    // Called from interrupts too, so the read and wrap check must be atomic. 
+    // Restore rather than enable, we may be called with interrupts already off.
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    
+    uint32_t now = us_ticker_read();
+    if (now < timebaseLow) timebaseHigh++;
+    timebaseLow = now;
+    
+    uint64_t time = ((uint64_t)timebaseHigh << 32) | now;
+    
+    __set_PRIMASK(primask);
+    
+    return time;
+#endif
+}
+
+SPKTVOne::loadStatsType SPKTVOne::getLoadStats()
+{
+    return loadStats;
+}
+
+void SPKTVOne::resetLoadStats()
+{
+    loadStats.commands = 0;
+    loadStats.elapsedUs = 0;
+    loadStats.sleptUs = 0;
+    loadStats.lastUtilisation = 0;
+}
+
+void SPKTVOne::recordLoad(uint64_t startUs, uint64_t sleptOnStart)
+{
+    uint64_t elapsed = timeUs() - startUs;
+    uint64_t slept = sleptUs - sleptOnStart;
+    
+    loadStats.commands++;
+    loadStats.elapsedUs += elapsed;
+    loadStats.sleptUs += slept;
+    loadStats.lastUtilisation = (elapsed > 0) ? (int)(100 - (slept * 100) / elapsed) : 0;
+}
+
+void SPKTVOne::rxInterrupt()
+{
+    // Producer end of the receive buffer. On the host this is called after poll() says the port is readable.
+    while (serial->readable())
+    {
+        char c = serial->getc();
+        int next = (rxTail + 1) % rxBufferLength;
+        if (next != rxHead)
+        {
+            rxBuffer[rxTail] = c;
+            rxTail = next;
+        }
+        else
+        {
+            rxOverflow++;
+        }
+    }
+}
+
+int SPKTVOne::rxGetc()
+{
+    if (rxHead == rxTail) return -1;
+    
+    char c = rxBuffer[rxHead];
+    rxHead = (rxHead + 1) % rxBufferLength;
+    
+    return c;
+}
+
+void SPKTVOne::rxPoll()
+{
+    // On the host there's no interrupt filling the buffer, so pull in whatever the port has for us now
+#if defined(SPK_TVONE_POSIX)
+    rxInterrupt();
+#endif
+}
+
+void SPKTVOne::rxFlush()
+{
+    rxPoll();
+    rxHead = rxTail;
+}
+
+void SPKTVOne::wakeInterrupt()
+{
+    // Nothing to do, the interrupt itself is what wakes the core from sleep
+}
+
+bool SPKTVOne::waitFor(uint64_t deadlineUs, bool forRx)
+{
+    // Returns when there's a received byte to read (if forRx), or the deadline has passed. Sleeps rather than spins in between.
+    while (true)
+    {
+        uint64_t now = timeUs();
+        
+        if (forRx && rxHead != rxTail) return true;
+        if (now >= deadlineUs) return false;
+        
+        uint64_t wait = deadlineUs - now;
+        
+#if defined(SPK_TVONE_POSIX)
+        // No interrupts on the host, so block in poll() and then do what the RX interrupt would have done
+        serial->waitReadable(wait);
+        rxInterrupt();
+#else
+        // Interrupts stay masked between checking the buffer and sleeping, so a byte arriving in between can't be missed. 
+        // WFI still wakes on a pending interrupt, which is then serviced once unmasked.
+        wakeTimeout.attach_us(this, &SPKTVOne::wakeInterrupt, (wait > 0x7FFFFFFF) ? 0x7FFFFFFF : (uint32_t)wait);
+        __disable_irq();
+        if (!(forRx && rxHead != rxTail)) sleep();
+        __enable_irq();
+        wakeTimeout.detach();
+#endif
+        
+        sleptUs += timeUs() - now;
+    }
+}
+
+void SPKTVOne::timebaseSample()
+{
+    // Wraps are only seen when the ticker is read, so make sure it's read at least once per wrap even when idle.
+    timeUs();
+}
+
+bool SPKTVOne::queueCommand(commandPriority priority, uint8_t channel, uint8_t window, int32_t func, int32_t payload, bool supersedable)
+{
+    queuedCommand command = {channel, window, func, payload, writeVerified, periodsType()};
+    
+    return queueCommands(priority, &command, 1, supersedable);
+}
+
+bool SPKTVOne::queueCommands(commandPriority priority, const queuedCommand *commands, int count, bool supersedable)
+{
+    return queueGroup(priority, commands, count, supersedable, NULL);
+}
+
+bool SPKTVOne::queueGroup(commandPriority priority, const queuedCommand *commands, int count, bool supersedable, uint32_t *position)
+{
+    if (priority < priorityInteractive || priority > priorityBulk || count < 1 || count > commandQueueLength) return false;
+    
+    for (int i = 0; i < count; i++)
+    {
+        if (kTV1FunctionWriteError(commands[i].channel, commands[i].window, commands[i].func, commands[i].payload)) return false;
+    }
+    
+    // TASK: Replace the newest waiting group for this window, if this one writes everything it does
+    // Otherwise a full queue would refuse the newest values while holding stale ones for the consumer to drop.
+    // The whole group goes in one step, so its members run in the order given here rather than folded into older ones.
+    
+    uint32_t covered = 0;
+    int coveredCount = supersedable ? queueLockCovered(priority, commands, count, covered) : 0;
+    
+    if (coveredCount == count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            commandQueue[priority][(covered + i) % commandQueueLength].command = commands[i];
+        }
+        queueUnlock(priority, covered, count);
+        queueCoalesced[priority] += count;
+        if (position) *position = covered;
+        
+#if defined(SPK_TVONE_POSIX)
+        workerWake.notify();
+#endif
+        return true;
+    }
+    
+    uint64_t now = timeUs();
+    
+    // TASK: Claim count slots by moving the tail on, so the whole group goes in or none of it does
+    // Each slot's sequence says whose turn it is: equal to a position when free for it, one past once published for the consumer.
+    // Producers may be other threads or interrupt handlers, and never wait on one another or the serial link.
+    
+    uint32_t tail = queueTail[priority].load(std::memory_order_relaxed);
+    while (true)
+    {
+        // The consumer frees slots in order, so if the last slot we'd need is free then all of them are
+        uint32_t last = tail + count - 1;
+        int32_t lag = (int32_t)(commandQueue[priority][last % commandQueueLength].sequence.load(std::memory_order_acquire) - last);
+        
+        if (lag < 0)
+        {
+            if (coveredCount) queueUnlock(priority, covered, coveredCount);
+            queueDropped[priority] += count;
+            return false;
+        }
+        
+        if (lag == 0 && queueTail[priority].compare_exchange_weak(tail, tail + count, std::memory_order_relaxed)) break;
+        
+        if (lag > 0) tail = queueTail[priority].load(std::memory_order_relaxed);
+        queueContended[priority]++;
+    }
+    
+    // TASK: Fill, then publish last to first so the consumer never sees the start of a group without the rest
+    
+    for (int i = 0; i < count; i++)
+    {
+        queueEntry &entry = commandQueue[priority][(tail + i) % commandQueueLength];
+        entry.command = commands[i];
+        entry.queuedAt = now;
+        entry.groupFirst = (i == 0);
+        entry.groupWithNext = (i < count - 1);
+        entry.supersedable = supersedable;
+        entry.cancelled = false;
+    }
+    queueUnlock(priority, tail, count);
+    if (position) *position = tail;
+    
+    // A covered group too small to take this one in place is held until this one is in, then skipped when its turn comes
+    if (coveredCount)
+    {
+        for (int i = 0; i < coveredCount; i++)
+        {
+            commandQueue[priority][(covered + i) % commandQueueLength].cancelled = true;
+        }
+        queueUnlock(priority, covered, coveredCount);
+        queueCoalesced[priority] += coveredCount;
+    }
+    
+#if defined(SPK_TVONE_POSIX)
+    workerWake.notify();
+#endif
+    
+    return true;
+}
+
+bool SPKTVOne::queuePublished(int priority, uint32_t position)
+{
+    return commandQueue[priority][position % commandQueueLength].sequence.load(std::memory_order_acquire) == position + 1;
+}
+
+static bool commandCovered(const SPKTVOne::queuedCommand *commands, int count, const SPKTVOne::queuedCommand &command)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (commands[i].func == command.func && commands[i].channel == command.channel && commands[i].window == command.window) return true;
+    }
+    return false;
+}
+
+int SPKTVOne::queueLockCovered(int priority, const queuedCommand *commands, int count, uint32_t &first)
+{
+    // TASK: Find the newest waiting group for this channel and window, locking each entry by stepping its sequence back before reading it
+    // Failing to lock means the consumer is taking it or another producer is filling or replacing it, so queue afresh instead of waiting.
+    // Entries older than a group for this window can't be replaced without reordering, so the first one found decides.
+    
+    uint32_t head = queueHead[priority].load(std::memory_order_relaxed);
+    uint32_t tail = queueTail[priority].load(std::memory_order_relaxed);
+    
+    for (uint32_t i = tail; i != head; )
+    {
+        i--;
+        queueEntry &entry = commandQueue[priority][i % commandQueueLength];
+        uint32_t published = i + 1;
+        if (!entry.sequence.compare_exchange_strong(published, i, std::memory_order_acquire)) return 0;
+        
+        bool found = entry.groupFirst && !entry.cancelled && entry.command.channel == commands[0].channel && entry.command.window == commands[0].window;
+        if (!found)
+        {
+            entry.sequence.store(i + 1, std::memory_order_release);
+            continue;
+        }
+        
+        // TASK: Lock the rest of the group, checking this one writes everything it does
+        // The consumer can't start on a group while we hold its first entry, so the rest are waiting too.
+        int locked = 1;
+        bool covered = entry.supersedable && commandCovered(commands, count, entry.command);
+        while (covered && commandQueue[priority][(i + locked - 1) % commandQueueLength].groupWithNext)
+        {
+            queueEntry &member = commandQueue[priority][(i + locked) % commandQueueLength];
+            published = i + locked + 1;
+            if (!member.sequence.compare_exchange_strong(published, i + locked, std::memory_order_acquire))
+            {
+                covered = false;
+                break;
+            }
+            locked++;
+            covered = commandCovered(commands, count, member.command);
+        }
+        
+        if (!covered || locked > count)
+        {
+            queueUnlock(priority, i, locked);
+            return 0;
+        }
+        
+        first = i;
+        return locked;
+    }
+    
+    return 0;
+}
+
+void SPKTVOne::queueUnlock(int priority, uint32_t first, int count)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        commandQueue[priority][(first + i) % commandQueueLength].sequence.store(first + i + 1, std::memory_order_release);
+    }
+}
+
+int SPKTVOne::processQueue(commandPriority lowestPriority)
+{
+    // Never split a group in progress, and don't recurse from the commands we send
+    if (processingQueue || commandGroupDepth > 0) return 0;
+    
+    processingQueue = true;
+    
+    int sentCount = 0;
+    int groupPriority = -1;
+    
+    while (true)
+    {
+        // TASK: Pick the next command. Continue a group if we're in one, otherwise highest priority first.
+        int priority = groupPriority;
+        if (priority == -1)
+        {
+            for (int i = priorityInteractive; i <= lowestPriority; i++)
+            {
+                if (queuePublished(i, queueHead[i].load(std::memory_order_relaxed))) 
+                {
+                    priority = i;
+                    break;
+                }
+            }
+        }
+        if (priority == -1) break;
+        
+        // TASK: Keep the line clear for a scheduled command, starting nothing (or no group) that won't be done by then
+        uint32_t head = queueHead[priority].load(std::memory_order_relaxed);
+        
+        if (holdLineAtUs && groupPriority == -1)
+        {
+            uint64_t doneAt = 0;
+            for (uint32_t i = head; queuePublished(priority, i); i++)
+            {
+                queueEntry &pending = commandQueue[priority][i % commandQueueLength];
+                uint64_t periodUs = (uint64_t)effectivePeriods(pending.command.periods).minimumMs * 1000;
+                uint64_t latencyUs = commandLatencyUs(pending.command.func);
+                
+                if (doneAt == 0) doneAt = (lastCommandSentUs + periodUs > timeUs()) ? lastCommandSentUs + periodUs : timeUs();
+                if (!pending.cancelled) doneAt += (latencyUs > periodUs) ? latencyUs : periodUs;
+                if (!pending.groupWithNext) break;
+            }
+            if (doneAt > holdLineAtUs) break;
+        }
+        
+        // TASK: Take the entry, handing its slot back to producers for the next lap
+        // A producer may hold it for the few instructions it takes to replace it, so lock it before copying.
+        queueEntry &slot = commandQueue[priority][head % commandQueueLength];
+        uint32_t published = head + 1;
+        while (!slot.sequence.compare_exchange_weak(published, head, std::memory_order_acquire)) published = head + 1;
+        
+        queuedCommand command = slot.command;
+        uint64_t queuedAt = slot.queuedAt;
+        bool groupWithNext = slot.groupWithNext;
+        bool supersedable = slot.supersedable;
+        bool cancelled = slot.cancelled;
+        slot.sequence.store(head + commandQueueLength, std::memory_order_release);
+        queueHead[priority].store(head + 1, std::memory_order_relaxed);
+        head++;
+        
+        groupPriority = groupWithNext ? priority : -1;
+        
+        // A group that replaced this one has already counted it as superseded
+        if (cancelled) continue;
+        
+        // TASK: Drop this command if the app has since queued a newer value for the same thing
+        if (supersedable)
+        {
+            bool superseded = false;
+            for (uint32_t i = head; queuePublished(priority, i); i++)
+            {
+                queueEntry &later = commandQueue[priority][i % commandQueueLength];
+                bool newer = !later.cancelled && later.supersedable && later.command.func == command.func && later.command.channel == command.channel && later.command.window == command.window;
+                
+                // A producer may have locked it to replace it while we read, in which case what we read can't be trusted
+                if (!queuePublished(priority, i)) break;
+                if (newer)
+                {
+                    superseded = true;
+                    break;
+                }
+            }
+            if (superseded)
+            {
+                queueStats[priority].superseded++;
+                continue;
+            }
+        }
+        
+        // TASK: Send, and record how long it waited
+        int delayMs = (timeUs() - queuedAt) / 1000;
+        
+        bool ok = this->command(command.channel, command.window, command.func, command.payload, command.mode, command.periods);
+        
+        queueStats[priority].sent++;
+        if (!ok) queueStats[priority].failed++;
+        
+        if (!ok) invalidateCachesFor(command);
+        queueStats[priority].totalDelayMs += delayMs;
+        if (delayMs > queueStats[priority].maxDelayMs) queueStats[priority].maxDelayMs = delayMs;
+        
+        sentCount++;
+    }
+    
+    processingQueue = false;
+    
+    return sentCount;
+}
+
+#if defined(SPK_TVONE_POSIX)
+bool SPKTVOne::startWorker()
+{
+    if (workerRunning) return false;
+    
+    workerRunning = true;
+    workerThread = std::thread(&SPKTVOne::workerLoop, this);
+    
+    return true;
+}
+
+void SPKTVOne::stopWorker()
+{
+    if (!workerRunning) return;
+    
+    workerRunning = false;
+    workerWake.notify();
+    workerThread.join();
+}
+
+void SPKTVOne::workerLoop()
+{
+    // Queue until empty, then sleep until a producer queues more. The timeout only guards against the unforeseen.
+    while (workerRunning)
+    {
+        if (processQueue() == 0) workerWake.wait(100000);
+    }
+}
+#endif
+
+int SPKTVOne::queuedCount(commandPriority priority)
+{
+    return queueTail[priority].load(std::memory_order_relaxed) - queueHead[priority].load(std::memory_order_relaxed);
+}
+
+SPKTVOne::queueStatsType SPKTVOne::getQueueStats(commandPriority priority)
+{
+    queueStatsType stats = queueStats[priority];
+    stats.dropped = queueDropped[priority];
+    stats.contended = queueContended[priority];
+    stats.superseded += queueCoalesced[priority];
+    
+    return stats;
+}
+
+void SPKTVOne::resetQueueStats()
+{
+    for (int i = 0; i < priorityCount; i++)
+    {
+        queueStats[i].sent = 0;
+        queueStats[i].failed = 0;
+        queueStats[i].dropped = 0;
+        queueStats[i].contended = 0;
+        queueStats[i].superseded = 0;
+        queueStats[i].maxDelayMs = 0;
+        queueStats[i].totalDelayMs = 0;
+        queueDropped[i] = 0;
+        queueContended[i] = 0;
+        queueCoalesced[i] = 0;
+    }
+}
+
+void SPKTVOne::beginCommandGroup()
+{
+    commandGroupDepth++;
+}
+
+void SPKTVOne::endCommandGroup()
+{
+    if (commandGroupDepth > 0) commandGroupDepth--;
+}
+
+int SPKTVOne::setKeyer(const keyerType &keyer, uint8_t window, commandPriority priority)
+{
+    // Order matches keyerFunctions
+    int32_t values[keyerFunctionCount] = 
+    {
+        keyer.enable,
+        keyer.minY, keyer.minU, keyer.minV,
+        keyer.maxY, keyer.maxU, keyer.maxV,
+        keyer.softnessY, keyer.softnessU, keyer.softnessV,
+        keyer.invertY, keyer.invertU, keyer.invertV,
+        keyer.swap
+    };
+    
+    // Only windows A and B are cached, anything else always gets the full set
+    int cacheIndex = (window == kTV1WindowIDA || window == kTV1WindowIDB) ? window - kTV1WindowIDA : -1;
+    bool diff = (cacheIndex != -1) && keyerValid[cacheIndex];
+    
+    queuedCommand commands[keyerFunctionCount] = {};
+    int count = 0;
+    
+    for (int i = 0; i < keyerFunctionCount; i++)
+    {
+        if (diff && keyerApplied[cacheIndex][i] == values[i]) continue;
+        
+        commands[count].channel = 0;
+        commands[count].window = window;
+        commands[count].func = keyerFunctions[i];
+        commands[count].payload = values[i];
+        commands[count].mode = writeFast;
+        count++;
+    }
+    
+    if (count == 0) return 0;
+    
+    for (int i = 0; i < count; i++)
+    {
+        if (kTV1FunctionWriteError(commands[i].channel, commands[i].window, commands[i].func, commands[i].payload)) return queueInvalid;
+    }
+    
+    if (!queueCommands(priority, commands, count)) return queueFull;
+    
+    if (cacheIndex != -1)
+    {
+        for (int i = 0; i < keyerFunctionCount; i++) keyerApplied[cacheIndex][i] = values[i];
+        keyerValid[cacheIndex] = true;
+    }
+    
+    if (debug) debug->printf("TVOne keyer for window %c: %i of %i settings changed \r\n", window, count, keyerFunctionCount);
+    
+    return count;
+}
+
+void SPKTVOne::invalidateKeyer()
+{
+    keyerValid[0] = false;
+    keyerValid[1] = false;
+}
+
+static void addWindowWrite(SPKTVOne::queuedCommand *commands, int &count, uint8_t window, int32_t func, const SPKTVOne::windowGeometryType &geometry, 
+                           const SPKTVOne::windowGeometryType *from, int SPKTVOne::windowGeometryType::*field, const SPKTVOne::queuedCommand *replacing, int replacingCount)
+{
+    commands[count].channel = 0;
+    commands[count].window = window;
+    commands[count].func = func;
+    commands[count].payload = geometry.*field;
+    
+    // Written if it differs from where we start, or if the group we're replacing writes it
+    if (from && geometry.*field == from->*field && !commandCovered(replacing, replacingCount, commands[count])) return;
+    
+    commands[count].mode = SPKTVOne::writeFast;
+    count++;
+}
+
+SPKTVOne::windowGeometryType SPKTVOne::windowGeometryForRect(int x, int y, int width, int height, int outputWidth, int outputHeight)
+{
+    // Place the whole source, unzoomed and uncropped, into the rect using shrink. 
+    // Shrink keeps the source aspect, so the level is set by whichever side of the rect is the tighter fit.
+    // Shrink position is a percentage of the travel left over once shrunk.
+    windowGeometryType geometry = {100, 50, 50, 0, 0, 0, 0, 100, 50, 50};
+    
+    if (outputWidth <= 0 || outputHeight <= 0) return geometry;
+    
+    int shrinkH = width * 100 / outputWidth;
+    int shrinkV = height * 100 / outputHeight;
+    int shrink = (shrinkH < shrinkV) ? shrinkH : shrinkV;
+    if (shrink < 10)  shrink = 10;
+    if (shrink > 100) shrink = 100;
+    
+    int travelH = outputWidth - outputWidth * shrink / 100;
+    int travelV = outputHeight - outputHeight * shrink / 100;
+    
+    geometry.shrink = shrink;
+    geometry.shrinkPosH = (travelH > 0) ? x * 100 / travelH : 50;
+    geometry.shrinkPosV = (travelV > 0) ? y * 100 / travelV : 50;
+    if (geometry.shrinkPosH < 0)   geometry.shrinkPosH = 0;
+    if (geometry.shrinkPosH > 100) geometry.shrinkPosH = 100;
+    if (geometry.shrinkPosV < 0)   geometry.shrinkPosV = 0;
+    if (geometry.shrinkPosV > 100) geometry.shrinkPosV = 100;
+    
+    return geometry;
+}
+
+int SPKTVOne::setWindowGeometry(const windowGeometryType &geometry, uint8_t window, commandPriority priority)
+{
+    int cacheIndex = (window == kTV1WindowIDA || window == kTV1WindowIDB) ? window - kTV1WindowIDA : -1;
+    bool diff = (cacheIndex != -1) && geometryValid[cacheIndex];
+    const windowGeometryType *applied = diff ? &geometryApplied[cacheIndex] : NULL;
+    
+    // TASK: If our last group for this window is still waiting, this one will replace it, so work from where that one started
+    // It also writes everything that one did, so it covers it in the queue, and still lands right if that one is sent first.
+    bool replacing = diff && geometryWaiting[cacheIndex] && geometryWaitingPriority[cacheIndex] == priority && queuePublished(priority, geometryWaitingAt[cacheIndex]);
+    const windowGeometryType *from = replacing ? &geometryBase[cacheIndex] : applied;
+    int replacingCount = replacing ? geometryWaitingCount[cacheIndex] : 0;
+    const queuedCommand *replacingWrites = geometryWaitingWrites[cacheIndex < 0 ? 0 : cacheIndex];
+    
+    // TASK: Work out write order.
+    // Pan is relative to zoom, and shrink position relative to the travel left by shrink.
+    // When growing, size goes first and the position lands in the new travel. When shrinking, move first then size into place.
+    bool zoomFirst = !from || geometry.zoom >= from->zoom;
+    bool shrinkFirst = !from || geometry.shrink >= from->shrink;
+    
+    queuedCommand commands[10] = {};
+    int count = 0;
+    
+    if (zoomFirst)    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsZoomLevel, geometry, from, &windowGeometryType::zoom, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsZoomPanH, geometry, from, &windowGeometryType::panH, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsZoomPanV, geometry, from, &windowGeometryType::panV, replacingWrites, replacingCount);
+    if (!zoomFirst)   addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsZoomLevel, geometry, from, &windowGeometryType::zoom, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsCropH, geometry, from, &windowGeometryType::cropH, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsCropV, geometry, from, &windowGeometryType::cropV, replacingWrites, replacingCount);
+    if (shrinkFirst)  addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsShrinkLevel, geometry, from, &windowGeometryType::shrink, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsShrinkPosH, geometry, from, &windowGeometryType::shrinkPosH, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsShrinkPosV, geometry, from, &windowGeometryType::shrinkPosV, replacingWrites, replacingCount);
+    if (!shrinkFirst) addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsShrinkLevel, geometry, from, &windowGeometryType::shrink, replacingWrites, replacingCount);
+    
+    // Out shift is independent of the rest, so goes last as a plain move
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsOutShiftH, geometry, from, &windowGeometryType::shiftH, replacingWrites, replacingCount);
+    addWindowWrite(commands, count, window, kTV1FunctionAdjustWindowsOutShiftV, geometry, from, &windowGeometryType::shiftV, replacingWrites, replacingCount);
+    
+    if (count == 0) return 0;
+    
+    for (int i = 0; i < count; i++)
+    {
+        if (kTV1FunctionWriteError(commands[i].channel, commands[i].window, commands[i].func, commands[i].payload)) return queueInvalid;
+    }
+    
+    // Supersedable, so if the app is moving the window faster than we can send, the waiting group takes the new position in place
+    uint32_t position = 0;
+    if (!queueGroup(priority, commands, count, true, &position)) return queueFull;
+    
+    if (cacheIndex != -1)
+    {
+        if (!replacing) geometryBase[cacheIndex] = geometryApplied[cacheIndex];
+        geometryWaiting[cacheIndex] = diff;
+        geometryWaitingPriority[cacheIndex] = priority;
+        geometryWaitingAt[cacheIndex] = position;
+        geometryWaitingCount[cacheIndex] = count;
+        for (int i = 0; i < count; i++) geometryWaitingWrites[cacheIndex][i] = commands[i];
+        geometryApplied[cacheIndex] = geometry;
+        geometryValid[cacheIndex] = true;
+    }
+    
+    return count;
+}
+
+void SPKTVOne::invalidateWindowGeometry()
+{
+    geometryValid[0] = false;
+    geometryValid[1] = false;
+    geometryWaiting[0] = false;
+    geometryWaiting[1] = false;
+    geometryWaitingCount[0] = 0;
+    geometryWaitingCount[1] = 0;
+}
+
+void SPKTVOne::invalidateCachesFor(const queuedCommand &command)
+{
+    if (command.window != kTV1WindowIDA && command.window != kTV1WindowIDB) return;
+    
+    int cacheIndex = command.window - kTV1WindowIDA;
+    
+    // If a write didn't take, we no longer know what that window is set to
+    for (int i = 0; i < keyerFunctionCount; i++)
+    {
+        if (command.func == keyerFunctions[i]) keyerValid[cacheIndex] = false;
+    }
+    
+    switch (command.func)
+    {
+        case kTV1FunctionAdjustWindowsZoomLevel:
+        case kTV1FunctionAdjustWindowsZoomPanH:
+        case kTV1FunctionAdjustWindowsZoomPanV:
+        case kTV1FunctionAdjustWindowsCropH:
+        case kTV1FunctionAdjustWindowsCropV:
+        case kTV1FunctionAdjustWindowsOutShiftH:
+        case kTV1FunctionAdjustWindowsOutShiftV:
+        case kTV1FunctionAdjustWindowsShrinkLevel:
+        case kTV1FunctionAdjustWindowsShrinkPosH:
+        case kTV1FunctionAdjustWindowsShrinkPosV:
+            geometryValid[cacheIndex] = false;
+            break;
+    }
+}
+
+SPKTVOne::stateEntry* SPKTVOne::stateFor(uint8_t channel, uint8_t window, int32_t func, bool add)
+{
+    // State that depends on the resolution being adjusted would need that in the key too, so isn't cached
+    if (!kTV1FunctionHasFlag(func, kTV1FunctionFlagCacheable) || kTV1FunctionHasFlag(func, kTV1FunctionFlagImageToAdjust)) return NULL;
+    
+    uint32_t key = (uint32_t)channel << 24 | (uint32_t)window << 16 | (func & 0xFFFF);
+    int slot = (key * 2654435761u) >> 25;
+    
+    for (int i = 0; i < stateCacheLength; i++)
+    {
+        stateEntry &entry = stateCache[(slot + i) & (stateCacheLength - 1)];
+        if (entry.state != stateEmpty && entry.key == key) return &entry;
+        if (entry.state == stateEmpty)
+        {
+            if (!add) return NULL;
+            entry.key = key;
+            entry.state = stateUnknown;
+            return &entry;
+        }
+    }
+    
+    // Full, so this one goes uncached
+    return NULL;
+}
+
+void SPKTVOne::recordState(uint8_t channel, uint8_t window, int32_t func, int32_t payload)
+{
+    stateEntry *entry = stateFor(channel, window, func, true);
+    if (!entry) return;
+    
+    if (entry->state == stateKnown && entry->payload == payload) return;
+    
+    entry->payload = payload;
+    entry->state = stateKnown;
+    markStateDirty();
+}
+
+void SPKTVOne::forgetState(uint8_t channel, uint8_t window, int32_t func)
+{
+    stateEntry *entry = stateFor(channel, window, func, false);
+    if (!entry || entry->state != stateKnown) return;
+    
+    entry->state = stateUnknown;
+    markStateDirty();
+}
+
+bool SPKTVOne::cachedValue(uint8_t channel, uint8_t window, int32_t func, int32_t &payload)
+{
+    stateEntry *entry = stateFor(channel, window, func, false);
+    if (!entry || entry->state != stateKnown) return false;
+    
+    payload = entry->payload;
+    return true;
+}
+
+void SPKTVOne::invalidateStateCache()
+{
+    // Slots stay claimed, as the same functions will be back
+    for (int i = 0; i < stateCacheLength; i++)
+    {
+        if (stateCache[i].state == stateKnown)
+        {
+            stateCache[i].state = stateUnknown;
+            markStateDirty();
+        }
+    }
+}
+
+// TASK: Warm start image. Little-endian on both mbed and host, so written and read as is.
+// "TV1S", format, boot count, entry count, software version, board type; then key and payload per known entry; then the FNV-1a of all before.
+
+static const char stateImageMagic[4] = {'T', 'V', '1', 'S'};
+static const uint8_t stateImageFormat = 2;
+
+struct stateImageHeader {char magic[4]; uint8_t format; uint8_t boots; uint16_t count; int32_t version; int32_t boardType;};
+struct stateImageEntry {uint32_t key; int32_t payload;};
+
+void SPKTVOne::markStateDirty()
+{
+    if (!stateDirty) stateDirtySinceUs = timeUs();
+    stateDirty = true;
+}
+
+void SPKTVOne::setStatePath(const char *path, int batchMillis)
 {
-    commandTimeoutPeriod = millis;
+    snprintf(statePath, statePathLength, "%s", path ? path : "");
+    stateBatchMillis = batchMillis;
 }
 
-void SPKTVOne::setCommandMinimumPeriod(int millis)
+bool SPKTVOne::saveStateIfDue()
 {
-    commandMinimumPeriod = millis;
+    if (!stateDirty || !statePath[0]) return false;
+    if (timeUs() - stateDirtySinceUs < (uint64_t)stateBatchMillis * 1000) return false;
+    
+    return saveState();
 }
 
-void SPKTVOne::increaseCommandPeriods(int millis)
+bool SPKTVOne::saveState()
 {
-    commandTimeoutPeriod += millis;
-    commandMinimumPeriod += millis;
+    if (!statePath[0]) return false;
     
-    if (debug) debug->printf("Command periods increased; minimum: %i, timeout: %i", commandMinimumPeriod, commandTimeoutPeriod);
+    stateImageHeader header;
+    memcpy(header.magic, stateImageMagic, sizeof(header.magic));
+    header.format = stateImageFormat;
+    header.boots = stateBoots;
+    header.count = 0;
+    header.version = processor.version;
+    header.boardType = processor.boardType;
+    
+    stateImageEntry entries[stateCacheLength];
+    for (int i = 0; i < stateCacheLength; i++)
+    {
+        if (stateCache[i].state != stateKnown) continue;
+        entries[header.count].key = stateCache[i].key;
+        entries[header.count].payload = stateCache[i].payload;
+        header.count++;
+    }
+    
+    uint32_t hash = chunkHash((const char *)entries, header.count * sizeof(stateImageEntry), chunkHash((const char *)&header, sizeof(header)));
+    
+    FILE *file = fopen(statePath, "wb");
+    if (!file)
+    {
+        if (debug) debug->printf("TVOne could not save state to %s \r\n", statePath);
+        return false;
+    }
+    
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(entries, sizeof(stateImageEntry), header.count, file) == header.count &&
+              fwrite(&hash, sizeof(hash), 1, file) == 1;
+    ok = (fclose(file) == 0) && ok;
+    
+    if (ok) stateDirty = false;
+    
+    if (debug) debug->printf("TVOne state %s, %i values \r\n", ok ? "saved" : "save failed", header.count);
+    
+    return ok;
 }
 
-void SPKTVOne::resetCommandPeriods()
+SPKTVOne::restoreResultType SPKTVOne::restoreState(int sampleCount)
 {
-    commandTimeoutPeriod = kTV1CommandTimeoutMillis;
-    commandMinimumPeriod = kTV1CommandMinimumMillis;
+    // TASK: Load the image, if there is one and it's intact
+    
+    stateImageHeader header;
+    stateImageEntry entries[stateCacheLength];
+    uint32_t hash = 0;
+    
+    FILE *file = statePath[0] ? fopen(statePath, "rb") : NULL;
+    if (!file) return restoreNoImage;
+    
+    bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+              memcmp(header.magic, stateImageMagic, sizeof(header.magic)) == 0 &&
+              header.format == stateImageFormat &&
+              header.count <= stateCacheLength &&
+              fread(entries, sizeof(stateImageEntry), header.count, file) == header.count &&
+              fread(&hash, sizeof(hash), 1, file) == 1;
+    fclose(file);
+    
+    if (ok)
+    {
+        ok = (hash == chunkHash((const char *)entries, header.count * sizeof(stateImageEntry), chunkHash((const char *)&header, sizeof(header))));
+    }
+    
+    if (!ok)
+    {
+        if (debug) debug->printf("TVOne state image at %s is damaged \r\n", statePath);
+        return restoreNoImage;
+    }
+    
+    // The image counts boots, so the sample moves on each time even if nothing else varies
+    stateBoots = header.boots + 1;
+    
+    // TASK: Check it's the same unit on the same firmware
+    
+    int32_t version, boardType;
+    uint64_t readStartUs = timeUs();
+    bool answered = readCommand(0, kTV1WindowIDA, kTV1FunctionReadSoftwareVersion, version);
+    uint64_t readMidUs = timeUs();
+    answered = answered && readCommand(0, kTV1WindowIDA, kTV1FunctionReadBoardType, boardType);
+    uint64_t readEndUs = timeUs();
+    
+    if (!answered)
+    {
+        if (debug) debug->printf("TVOne state not restored, unit did not answer \r\n");
+        return restoreFailed;
+    }
+    processor.version = version;
+    processor.boardType = boardType;
+    
+    bool agrees = (version == header.version && boardType == header.boardType);
+    
+    // TASK: Read back a random sample. Picked by partial shuffle, so no value is read twice.
+    
+    int sampled = 0;
+    if (agrees)
+    {
+        // Start from where the last boot's sample left off, so successive boots cover different values whatever the shuffle does
+        uint8_t order[stateCacheLength];
+        for (int i = 0; i < header.count; i++) order[i] = (i + stateBoots * sampleCount) % header.count;
+        
+        // The clock alone is near enough the same at every boot, so fold in the boot count and the low bits of the two ack latencies,
+        // which the unit and the serial link jitter. Left apart from rand(), which the app may have seeded for itself.
+        uint32_t random = (uint32_t)stateBoots * 2654435761u;
+        random ^= (uint32_t)(readMidUs - readStartUs) << 8 ^ (uint32_t)(readEndUs - readMidUs) << 20 ^ (uint32_t)readEndUs;
+        random |= 1;
+        
+        for (sampled = 0; sampled < sampleCount && sampled < header.count && agrees; sampled++)
+        {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            
+            int pick = sampled + random % (header.count - sampled);
+            uint8_t swap = order[sampled];
+            order[sampled] = order[pick];
+            order[pick] = swap;
+            
+            const stateImageEntry &entry = entries[order[sampled]];
+            int32_t payload;
+            agrees = readCommand(entry.key >> 24, (entry.key >> 16) & 0xFF, entry.key & 0xFFFF, payload) && payload == entry.payload;
+        }
+    }
+    
+    if (agrees)
+    {
+        for (int i = 0; i < header.count; i++)
+        {
+            const stateImageEntry &entry = entries[i];
+            recordState(entry.key >> 24, (entry.key >> 16) & 0xFF, entry.key & 0xFFFF, entry.payload);
+        }
+        
+        // The cache now is the image, but the boot count has moved on, so save with the next batch
+        markStateDirty();
+        
+        if (debug) debug->printf("TVOne state restored, %i values checked by %i reads \r\n", header.count, sampled);
+        return restoreSampled;
+    }
+    
+    // TASK: Something has drifted, so read back everything the image had
+    
+    if (debug) debug->printf("TVOne state image %s, reading back all %i values \r\n", (version == header.version && boardType == header.boardType) ? "has drifted" : "is for another unit", header.count);
+    
+    bool allRead = true;
+    for (int i = 0; i < header.count; i++)
+    {
+        const stateImageEntry &entry = entries[i];
+        int32_t payload;
+        if (!readCommand(entry.key >> 24, (entry.key >> 16) & 0xFF, entry.key & 0xFFFF, payload)) allRead = false;
+    }
+    
+    // Saved straight away, or the next reset would sample the same out of date image
+    saveState();
+    
+    return allRead ? restoreFullSync : restoreFailed;
 }
 
-int SPKTVOne::getCommandTimeoutPeriod()
+bool SPKTVOne::loadPreset(int preset, const queuedCommand *contents, int count)
 {
-    return commandTimeoutPeriod;
+    // Load goes back to 0 once done, so its ack can't echo what was sent
+    bool ok = command(0, kTV1WindowIDA, kTV1FunctionPreset, preset) &&
+              command(0, kTV1WindowIDA, kTV1FunctionPresetLoad, 1, writeFast);
+    
+    // Everything might have changed, whether or not the load took
+    invalidateKeyer();
+    invalidateWindowGeometry();
+    invalidateStateCache();
+    
+    if (!ok) return false;
+    
+    // TASK: Wait for the unit to finish, which is when Load reads back as 0
+    int32_t loading = 1;
+    uint64_t giveUpAt = timeUs() + 2000000;
+    while (loading != 0 && timeUs() < giveUpAt)
+    {
+        if (!readCommand(0, kTV1WindowIDA, kTV1FunctionPresetLoad, loading)) loading = 1;
+    }
+    
+    if (loading != 0)
+    {
+        if (debug) debug->printf("TVOne preset %i load did not finish \r\n", preset);
+        return false;
+    }
+    
+    recordState(0, kTV1WindowIDA, kTV1FunctionPreset, preset);
+    for (int i = 0; i < count; i++) recordState(contents[i].channel, contents[i].window, contents[i].func, contents[i].payload);
+    
+    return true;
 }
 
-int SPKTVOne::millisSinceLastCommandSent()
+bool SPKTVOne::storePreset(int preset)
 {
-    return timer.read_ms();
+    return command(0, kTV1WindowIDA, kTV1FunctionPreset, preset) &&
+           command(0, kTV1WindowIDA, kTV1FunctionPresetStore, 1, writeFast);
 }
 
 bool SPKTVOne::setMatroxResolutions(bool digitalEdition) 
@@ -250,7 +2079,12 @@ bool SPKTVOne::setMatroxResolutions(bool digitalEdition)
   // TODO: Any other resolutions that have different timings between analogue and digital editions of the matrox boxes.
   // ok = ok && set1920x480(kTV1ResolutionTripleHeadVGAp60);
   // ok = ok && set1600x600(kTV1ResolutionDualHeadSVGAp60);
+#if defined(kTV1FirmwareSPKDF)
   ok = ok && set2048x768(kTV1ResolutionDualHeadXGAp60, digitalEdition);
+#else
+  ok = false;
+  if (debug) debug->printf("Matrox resolutions need SPK firmware \r\n");
+#endif
   
   lock = lock && command(0, kTV1WindowIDA, kTV1FunctionAdjustFrontPanelLock, unlocked);
   
@@ -293,30 +2127,27 @@ bool SPKTVOne::setResolution(int resolution, int edidSlot)
 {
     bool ok;
     
-    int minPeriodOnEntry = commandMinimumPeriod;
-    int outPeriodOnEntry = commandTimeoutPeriod;
+    // Retries back off with longer periods, passed per call so nothing else sees them
+    periodsType periods = periodsType();
     
     for (int i=0; i < 3; i++)
     {
-        ok = command(0, kTV1WindowIDA, kTV1FunctionAdjustOutputsOutputResolution, resolution);
+        ok = command(0, kTV1WindowIDA, kTV1FunctionAdjustOutputsOutputResolution, resolution, writeVerified, periods);
         
         if (ok) break;
-        else    increaseCommandPeriods(500);
+        else    periods = increasedPeriods(periods, 500);
     }                
-    commandMinimumPeriod = minPeriodOnEntry;
-    commandTimeoutPeriod = outPeriodOnEntry;
     if (!ok) return ok;
 
+    periods = periodsType();
     for (int i=0; i < 3; i++)
     {                
-        ok =    command(kTV1SourceRGB1, kTV1WindowIDA, kTV1FunctionAdjustSourceEDID, edidSlot);
-        ok = ok && command(kTV1SourceRGB2, kTV1WindowIDA, kTV1FunctionAdjustSourceEDID, edidSlot);
+        ok =    command(kTV1SourceRGB1, kTV1WindowIDA, kTV1FunctionAdjustSourceEDID, edidSlot, writeVerified, periods);
+        ok = ok && command(kTV1SourceRGB2, kTV1WindowIDA, kTV1FunctionAdjustSourceEDID, edidSlot, writeVerified, periods);
         
         if (ok) break;
-        else    increaseCommandPeriods(500);
+        else    periods = increasedPeriods(periods, 500);
     }                
-    commandMinimumPeriod = minPeriodOnEntry;
-    commandTimeoutPeriod = outPeriodOnEntry;
     
     return ok;
 }
@@ -325,18 +2156,17 @@ bool SPKTVOne::setHDCPOn(bool state)
 {
     bool ok;
     
-    int minPeriodOnEntry = commandMinimumPeriod;
-    int outPeriodOnEntry = commandTimeoutPeriod;
+    periodsType periods = periodsType();
       
     // HDCP can sometimes take a little time to settle down
     for (int i=0; i < 3; i++)
     {
         // Turn HDCP off on the output
-        ok =       command(0, kTV1WindowIDA, kTV1FunctionAdjustOutputsHDCPRequired, state);
+        ok =       command(0, kTV1WindowIDA, kTV1FunctionAdjustOutputsHDCPRequired, state, writeVerified, periods);
         
         // Likewise on inputs A and B
-        ok = ok && command(kTV1SourceRGB1, kTV1WindowIDA, kTV1FunctionAdjustSourceHDCPAdvertize, state);
-        ok = ok && command(kTV1SourceRGB2, kTV1WindowIDA, kTV1FunctionAdjustSourceHDCPAdvertize, state);
+        ok = ok && command(kTV1SourceRGB1, kTV1WindowIDA, kTV1FunctionAdjustSourceHDCPAdvertize, state, writeVerified, periods);
+        ok = ok && command(kTV1SourceRGB2, kTV1WindowIDA, kTV1FunctionAdjustSourceHDCPAdvertize, state, writeVerified, periods);
 
 // This verify code is accurate but too misleading for D-Fuser use - eg. actual HDCP state requires source / output connection.      
 //        // Now verify whats actually going on. 
@@ -361,10 +2191,8 @@ bool SPKTVOne::setHDCPOn(bool state)
 //        ok = ok && (payload == state);
         
         if (ok) break;
-        else    increaseCommandPeriods(500);
+        else    periods = increasedPeriods(periods, 500);
     }
-    commandMinimumPeriod = minPeriodOnEntry;
-    commandTimeoutPeriod = outPeriodOnEntry;
   
     return ok;
 }
@@ -373,11 +2201,15 @@ bool SPKTVOne::getResolutionParams(int resStoreNumber, int &horizpx, int &vertpx
 {
     bool ok;
     
+    beginCommandGroup();
+    
     ok = command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionImageToAdjust, resStoreNumber);
     
     ok = ok && readCommand(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionActiveH, horizpx);
     ok = ok && readCommand(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionActiveV, vertpx);
     
+    endCommandGroup();
+    
     return ok;
 }
 
@@ -481,10 +2313,140 @@ bool SPKTVOne::setAspect(aspectType aspect)
     return ok;
 }
 
+bool SPKTVOne::changeFormat(const formatType &format, formatChangeType *result)
+{
+    formatChangeType change = {};
+    uint64_t startUs = timeUs();
+    uint32_t framesAtStart = framesSent;
+    
+    // TASK: Decide each source's aspect correction, from geometry in the table where it's there
+    
+    int32_t aspectFor[2] = {format.aspect, format.aspect};
+    if (format.aspect == aspectSPKFill)
+    {
+        aspectFor[0] = aspectFor[1] = aspectHFill;
+        
+        int outputH = 0, outputV = 0;
+        const SPKTVOneResolution *output = kTV1ResolutionDescriptor(format.resolution);
+        if (output)
+        {
+            outputH = output->width;
+            outputV = output->height;
+        }
+        else
+        {
+            getResolutionParams(format.resolution, outputH, outputV);
+        }
+        
+        for (int w = 0; w < 2 && outputH > 0 && outputV > 0; w++)
+        {
+            uint8_t window = w ? kTV1WindowIDB : kTV1WindowIDA;
+            
+            int32_t source = -1;
+            if (!cachedValue(0, window, kTV1FunctionAdjustWindowsWindowSource, source) &&
+                !readCommand(0, window, kTV1FunctionAdjustWindowsWindowSource, source)) continue;
+            if (source != kTV1SourceRGB1 && source != kTV1SourceRGB2) continue;
+            
+            // What the source is sending can change at any time, so this one is always read. 0 is no signal.
+            int32_t sourceResolution = -1;
+            if (!readCommand(0, window, kTV1FunctionAdjustWindowsSourceResolution, sourceResolution) || sourceResolution <= 0) continue;
+            
+            int inputH = 0, inputV = 0;
+            const SPKTVOneResolution *input = kTV1ResolutionDescriptor(sourceResolution);
+            if (input)
+            {
+                inputH = input->width;
+                inputV = input->height;
+            }
+            else
+            {
+                getResolutionParams(sourceResolution, inputH, inputV);
+            }
+            if (inputH <= 0 || inputV <= 0) continue;
+            
+            // Wider output than source means fill across, ie. output aspect > source aspect, compared without dividing
+            aspectFor[source == kTV1SourceRGB1 ? 0 : 1] = ((int64_t)outputH * inputV > (int64_t)inputH * outputV) ? aspectHFill : aspectVFill;
+        }
+    }
+    
+    // Counted from the frames, as getResolutionParams selects the resolution to adjust as well as reading it
+    change.reads = framesSent - framesAtStart;
+    
+    // TASK: Plan the writes, in order, dropping what's already set
+    
+    struct planStep {uint8_t channel; int32_t func; int32_t payload; bool resyncsOutput; bool verified;};
+    const planStep plan[] = 
+    {
+        {0,              kTV1FunctionAdjustOutputsOutputResolution, format.resolution, true,  true},
+        {0,              kTV1FunctionAdjustOutputsHDCPRequired,     format.hdcp,       true,  true},
+        {kTV1SourceRGB1, kTV1FunctionAdjustSourceEDID,              format.edidSlot,   false, true},
+        {kTV1SourceRGB2, kTV1FunctionAdjustSourceEDID,              format.edidSlot,   false, true},
+        {kTV1SourceRGB1, kTV1FunctionAdjustSourceHDCPAdvertize,     format.hdcp,       false, false},
+        {kTV1SourceRGB2, kTV1FunctionAdjustSourceHDCPAdvertize,     format.hdcp,       false, false},
+        {kTV1SourceRGB1, kTV1FunctionAdjustSourceAspectCorrect,     aspectFor[0],      false, false},
+        {kTV1SourceRGB2, kTV1FunctionAdjustSourceAspectCorrect,     aspectFor[1],      false, false},
+    };
+    const int planLength = sizeof(plan) / sizeof(plan[0]);
+    change.planned = planLength;
+    
+    // TASK: Run it
+    
+    bool ok = true;
+    uint64_t blankStartUs = 0, blankEndUs = 0;
+    
+    beginCommandGroup();
+    for (int i = 0; i < planLength && ok; i++)
+    {
+        const planStep &step = plan[i];
+        
+        int32_t current;
+        if (cachedValue(step.channel, kTV1WindowIDA, step.func, current) && current == step.payload)
+        {
+            change.skipped++;
+            continue;
+        }
+        
+        uint64_t sendUs = timeUs();
+        
+        // Whatever resyncs the output is verified, so the blanking measured ends with the unit having taken it. 
+        // EDID too, as a slot that didn't take only shows when a source next connects.
+        ok = command(step.channel, kTV1WindowIDA, step.func, step.payload, step.verified ? writeVerified : writeFast);
+        change.sent++;
+        
+        periodsType periods = periodsType();
+        for (int retry = 0; !ok && retry < 2; retry++)
+        {
+            periods = increasedPeriods(periods, 500);
+            ok = command(step.channel, kTV1WindowIDA, step.func, step.payload, writeVerified, periods);
+            change.sent++;
+            change.retried++;
+        }
+        
+        if (step.resyncsOutput)
+        {
+            if (!blankStartUs) blankStartUs = sendUs;
+            blankEndUs = timeUs();
+        }
+    }
+    endCommandGroup();
+    
+    change.totalMs = (timeUs() - startUs) / 1000;
+    change.blankingMs = (blankEndUs - blankStartUs) / 1000;
+    
+    if (debug) debug->printf("TVOne format change %s: %i of %i writes sent, %i retried, %i reads, %ims, output blanked for %ims \r\n", 
+                             ok ? "done" : "failed", change.planned - change.skipped, change.planned, change.retried, change.reads, change.totalMs, change.blankingMs);
+    
+    if (result) *result = change;
+    
+    return ok;
+}
+
 bool SPKTVOne::set1920x480(int resStoreNumber) 
 {
   bool ok;
 
+  beginCommandGroup();
+
   ok = command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionImageToAdjust, resStoreNumber);
 
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionInterlaced, 0);
@@ -499,6 +2461,8 @@ bool SPKTVOne::set1920x480(int resStoreNumber)
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncH, 192);
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncV, 30); 
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncPolarity, 0);
+
+  endCommandGroup();
   
   return ok;
 }
@@ -507,6 +2471,8 @@ bool SPKTVOne::set1600x600(int resStoreNumber)
 {
   bool ok;
 
+  beginCommandGroup();
+
   ok = command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionImageToAdjust, resStoreNumber);
 
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionInterlaced, 0);
@@ -521,6 +2487,8 @@ bool SPKTVOne::set1600x600(int resStoreNumber)
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncH, 160);
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncV, 13); 
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncPolarity, 0);
+
+  endCommandGroup();
     
   return ok;
 }
@@ -529,6 +2497,8 @@ bool SPKTVOne::set2048x768(int resStoreNumber, bool de)
 {
   bool ok;
   
+  beginCommandGroup();
+
   ok = command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionImageToAdjust, resStoreNumber);
 
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionInterlaced, 0);
@@ -543,6 +2513,8 @@ bool SPKTVOne::set2048x768(int resStoreNumber, bool de)
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncH, de ? 368 : 64);
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncV, de ? 24 : 15); 
   ok = ok && command(0, kTV1WindowIDA, kTV1FunctionAdjustResolutionSyncPolarity, 3);
+
+  endCommandGroup();
     
   return ok;
 }
@@ -579,14 +2551,239 @@ SPKTVOne::processorType SPKTVOne::getProcessorType()
     return processor;
 }
 
-void SPKTVOne::timerCheck() {
-    // timers are based on 32-bit int microsecond counters, so can only time up to a maximum of 2^31-1 microseconds i.e. 30 minutes.
-    // this method is called once a minute, and resets the timer if we've been idle for 25mins.
-    if (timer.read_ms() > 1000*60*25) 
+#if defined(SPK_TVONE_POSIX)
+int SPKTVOne::discoverUnits(discoveredUnitType units[], int maxUnits, const char *portGlob, int baud, int timeoutMillis)
+{
+    static const int identityCount = 3;
+    static const int32_t identityFunctions[identityCount] = {kTV1FunctionReadSoftwareVersion, kTV1FunctionReadProductType, kTV1FunctionReadBoardType};
+    static const uint64_t discoverySliceUs = 1000;
+    
+    struct probeType
+    {
+        Serial *serial;
+        bool done;
+        bool resent;
+        uint64_t deadlineUs;
+        int ack[kTV1FrameLength];
+        int ackPos;
+        bool skipToCR;
+        bool answered[identityCount];
+    };
+    
+    char frames[identityCount][kTV1ReadFrameLength];
+    for (int i = 0; i < identityCount; i++) kTV1EncodeReadFrame(frames[i], 0, kTV1WindowIDA, identityFunctions[i]);
+    
+    // TASK: Open every port and send each all the reads without waiting, so the units all work on them at once
+    
+    glob_t matches;
+    int portCount = 0;
+    if (glob(portGlob, GLOB_BRACE, NULL, &matches) == 0)
+    {
+        portCount = (matches.gl_pathc < (size_t)maxUnits) ? (int)matches.gl_pathc : maxUnits;
+    }
+    
+    probeType *probes = new probeType[portCount];
+    Serial **waiting = new Serial*[portCount];
+    
+    uint64_t startUs = spkPosixTimeUs();
+    for (int i = 0; i < portCount; i++)
+    {
+        discoveredUnitType &unit = units[i];
+        snprintf(unit.port, discoveryPortLength, "%s", matches.gl_pathv[i]);
+        unit.found = false;
+        unit.processor.version = -1;
+        unit.processor.productType = -1;
+        unit.processor.boardType = -1;
+        unit.answerMillis = -1;
+        
+        probeType &probe = probes[i];
+        memset(&probe, 0, sizeof(probe));
+        probe.serial = new Serial(unit.port, NC);
+        probe.deadlineUs = startUs + (uint64_t)timeoutMillis * 1000;
+        probe.done = probe.serial->fd() < 0;
+        if (probe.done) continue;
+        
+        // Anything left over, eg. acks to an earlier discovery's reads, would be taken as this one's
+        probe.serial->baud(baud);
+        tcflush(probe.serial->fd(), TCIFLUSH);
+        for (int f = 0; f < identityCount; f++)
+        {
+            for (int c = 0; c < kTV1ReadFrameLength; c++) probe.serial->putc(frames[f][c]);
+        }
+    }
+    globfree(&matches);
+    
+    // TASK: Take acks as they come from any port, framed as sendFrame does
+    
+    while (true)
+    {
+        int waitingCount = 0;
+        uint64_t nextDeadlineUs = 0;
+        for (int i = 0; i < portCount; i++)
+        {
+            if (probes[i].done) continue;
+            waiting[waitingCount++] = probes[i].serial;
+            if (nextDeadlineUs == 0 || probes[i].deadlineUs < nextDeadlineUs) nextDeadlineUs = probes[i].deadlineUs;
+        }
+        if (waitingCount == 0) break;
+        
+        // Ports are waited on in chunks of as many as one wait takes. With more than one chunk, each gets a slice in turn 
+        // rather than the whole wait, so a chunk whose acks have arrived isn't left until another's deadline.
+        uint64_t now = spkPosixTimeUs();
+        for (int chunk = 0; chunk < waitingCount && nextDeadlineUs > now; chunk += Serial::maxWaitSerials)
+        {
+            int chunkCount = (waitingCount - chunk < Serial::maxWaitSerials) ? waitingCount - chunk : Serial::maxWaitSerials;
+            uint64_t waitUs = nextDeadlineUs - now;
+            if (waitingCount > Serial::maxWaitSerials && waitUs > discoverySliceUs) waitUs = discoverySliceUs;
+            
+            if (Serial::waitReadable(waiting + chunk, chunkCount, waitUs)) break;
+            now = spkPosixTimeUs();
+        }
+        now = spkPosixTimeUs();
+        
+        for (int i = 0; i < portCount; i++)
+        {
+            probeType &probe = probes[i];
+            discoveredUnitType &unit = units[i];
+            if (probe.done) continue;
+            
+            while (probe.serial->readable())
+            {
+                int c = probe.serial->getc();
+                
+                if (probe.skipToCR)
+                {
+                    if (c == '\r') probe.skipToCR = false;
+                    continue;
+                }
+                if (probe.ackPos == 0 && c != 'F') continue;
+                
+                probe.ack[probe.ackPos++] = c;
+                
+                bool ended = (c == '\r');
+                if (!ended && probe.ackPos < kTV1FrameLength) continue;
+                
+                bool framed = ended && probe.ackPos == kTV1FrameLength && probe.ack[1] == '4';
+                probe.skipToCR = !ended;
+                probe.ackPos = 0;
+                if (!framed) continue;
+                
+                for (int f = 0; f < identityCount; f++)
+                {
+                    if (probe.answered[f] || !ackMatchesFrame(probe.ack, frames[f])) continue;
+                    
+                    int32_t payload = ackPayload(probe.ack, identityFunctions[f]);
+                    if (f == 0) unit.processor.version = payload;
+                    if (f == 1) unit.processor.productType = payload;
+                    if (f == 2) unit.processor.boardType = payload;
+                    probe.answered[f] = true;
+                    
+                    // Something's there, so from now on it gets as long as any command would
+                    if (!unit.found)
+                    {
+                        unit.found = true;
+                        unit.answerMillis = (now - startUs) / 1000;
+                    }
+                    probe.deadlineUs = now + (uint64_t)kTV1CommandTimeoutMillis * 1000;
+                }
+            }
+            
+            bool complete = probe.answered[0] && probe.answered[1] && probe.answered[2];
+            if (complete)
+            {
+                probe.done = true;
+            }
+            else if (now >= probe.deadlineUs)
+            {
+                // A unit may drop reads that arrive while it's busy with the last, so it gets one more go at whatever it missed
+                if (unit.found && !probe.resent)
+                {
+                    for (int f = 0; f < identityCount; f++)
+                    {
+                        if (probe.answered[f]) continue;
+                        for (int c = 0; c < kTV1ReadFrameLength; c++) probe.serial->putc(frames[f][c]);
+                    }
+                    probe.resent = true;
+                    probe.deadlineUs = now + (uint64_t)kTV1CommandTimeoutMillis * 1000;
+                }
+                else
+                {
+                    probe.done = true;
+                }
+            }
+        }
+    }
+    
+    for (int i = 0; i < portCount; i++) delete probes[i].serial;
+    delete [] probes;
+    delete [] waiting;
+    
+    return portCount;
+}
+#endif
+
+bool SPKTVOne::runCue(const uint8_t *show, int cueIndex)
+{
+    int frameCount = 0;
+    const char *frames = kTV1ShowCueFrames(show, cueIndex, frameCount);
+    
+    if (!frames)
+    {
+        if (debug) debug->printf("No cue %i in show \r\n", cueIndex);
+        return false;
+    }
+    
+    if (debug) debug->printf("Run cue %i with %i frames \r\n", cueIndex, frameCount);
+    
+    // Cues can write anything, so the keyer and geometry diffs can't trust what they last applied
+    invalidateKeyer();
+    invalidateWindowGeometry();
+    invalidateStateCache();
+    
+    // TASK: Send each frame as compiled, checking the ack echoes its payload characters back
+    // Output resolution changes, and the EDID writes that follow them, can catch the unit busy switching, so get setResolution's retries.
+    
+    bool success = true;
+    
+    for (int i = 0; i < frameCount && success; i++)
+    {
+        const char *frame = frames + i * kTV1FrameLength;
+        int32_t func = kTV1FrameFunction(frame);
+        int attempts = (func == kTV1FunctionAdjustOutputsOutputResolution || func == kTV1FunctionAdjustSourceEDID) ? 3 : 1;
+        periodsType periods = periodsType();
+        
+        for (int attempt = 0; attempt < attempts; attempt++)
+        {
+            int ackBuff[standardAckLength] = {0};
+            
+            success = sendFrame(frame, kTV1FrameLength, ackBuff, standardAckLength, false, periods);
+            
+            for (int j = kTV1FramePayloadOffset; success && j < kTV1FramePayloadOffset + 6; j++)
+            {
+                if (toupper(ackBuff[j]) != frame[j]) success = false;
+            }
+            
+            if (success || attempt == attempts - 1) break;
+            periods = increasedPeriods(periods, 500);
+        }
+        
+        if (!success && debug) debug->printf("Cue %i failed at frame %i: %.19s \r\n", cueIndex, i, frame);
+    }
+    
+    return success;
+}
+
+bool SPKTVOne::runCue(const uint8_t *show, const char *cueName)
+{
+    int cueIndex = kTV1ShowCueNamed(show, cueName);
+    
+    if (cueIndex == -1)
     {
-        if (debug) debug->printf("TVOne Timer reset at %ims", timer.read_ms());
-        timer.reset();
+        if (debug) debug->printf("No cue named %s in show \r\n", cueName);
+        return false;
     }
+    
+    return runCue(show, cueIndex);
 }
 
 bool SPKTVOne::uploadEDID(FILE *file, int edidSlotIndex)
@@ -605,45 +2802,128 @@ bool SPKTVOne::uploadEDID(FILE *file, int edidSlotIndex)
     return success;
 }
 
-bool SPKTVOne::uploadImage(FILE *file, int sisIndex)
+bool SPKTVOne::uploadImage(FILE *file, int sisIndex, bool differential)
 {
     bool success;
     
     int imageDataLength = 0;
     
+    fseek(file, 0, SEEK_SET);
     while (fgetc(file) != EOF) imageDataLength++ ;
     
     if (debug) debug->printf("Upload Image with length %i to index %i \r\n", imageDataLength, sisIndex);
     
-    success = uploadFile(0x00, file, imageDataLength, sisIndex);
+    if (!differential || sisIndex < 0 || sisIndex >= imageManifestSlots)
+    {
+        success = uploadFile(0x00, file, imageDataLength, sisIndex);
+        
+        // A full upload we didn't hash leaves the slot's manifest stale
+        if (sisIndex >= 0 && sisIndex < imageManifestSlots)
+        {
+            free(imageManifests[sisIndex].hashes);
+            imageManifests[sisIndex].hashes = NULL;
+        }
+        
+        return success;
+    }
+    
+    // TASK: Hash the new image as it goes up, sending only the chunks that differ from the slot's manifest
+    
+    imageManifestType &manifest = imageManifests[sisIndex];
+    
+    int chunkCount = (imageDataLength + 31) / 32;
+    uint32_t *hashes = (uint32_t*)malloc((chunkCount > 0 ? chunkCount : 1) * sizeof(uint32_t));
+    
+    const uint32_t *previousHashes = (hashes && manifest.hashes && manifest.dataLength == imageDataLength) ? manifest.hashes : NULL;
+    
+    if (debug && !previousHashes) debug->printf("No manifest for index %i, uploading all chunks \r\n", sisIndex);
+    
+    success = uploadFile(0x00, file, imageDataLength, sisIndex, hashes, previousHashes);
+    
+    if (!success && previousHashes)
+    {
+        // The unit's copy may not be what we think it is, so don't trust any of it
+        if (debug) debug->printf("Differential upload failed, uploading all chunks \r\n");
+        
+        uploadStatsType failedStats = uploadStats;
+        success = uploadFile(0x00, file, imageDataLength, sisIndex, hashes);
+        uploadStats.elapsedMs += failedStats.elapsedMs;
+        uploadStats.savedMs = 0;
+    }
+    
+    free(manifest.hashes);
+    manifest.hashes = NULL;
+    
+    if (success && hashes)
+    {
+        manifest.hashes = hashes;
+        manifest.dataLength = imageDataLength;
+    }
+    else
+    {
+        free(hashes);
+    }
+    
+    if (debug) debug->printf("Sent %i of %i chunks, saved %ims \r\n", uploadStats.chunksSent, uploadStats.chunks, uploadStats.savedMs);
     
     return success;
 }
 
-bool SPKTVOne::uploadFile(char instruction, FILE* file, int dataLength, int index)
+SPKTVOne::uploadStatsType SPKTVOne::getLastUploadStats()
+{
+    return uploadStats;
+}
+
+void SPKTVOne::invalidateImageManifests()
+{
+    for (int i = 0; i < imageManifestSlots; i++)
+    {
+        free(imageManifests[i].hashes);
+        imageManifests[i].hashes = NULL;
+        imageManifests[i].dataLength = 0;
+    }
+}
+
+uint32_t SPKTVOne::chunkHash(const char *data, int length, uint32_t hash)
+{
+    // FNV-1a, cheap enough to run on every chunk as it goes past. Pass the last hash to carry on across several blocks.
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool SPKTVOne::uploadFile(char instruction, FILE* file, int dataLength, int index, uint32_t *hashes, const uint32_t *previousHashes)
 {
     // TASK: Upload Data
 
-    // Lets be conservative with timings
-    setCommandMinimumPeriod(100);
-    setCommandTimeoutPeriod(300);
+    // Lets be conservative with timings, for the upload only
+    const periodsType periods = {100, 300};
 
     // This command is reverse engineered. It implements an 'S' command, not the documented 'F'. 
     
     bool success = false;
 
-    int dataChunkSize = 32;
-    int ackLength = 4;
-    char goodAck[] = {0x53, 0x02, 0x40, 0x95};
+    const int dataChunkSize = 32;
+    const int ackLength = 4;
+    char goodAck[] = {0x53, 0x02, 0x40, (char)0x95};
     
     fseek(file, 0, SEEK_SET);
     
+    uint64_t uploadStartUs = timeUs();
+    
+    uploadStats.chunks = 0;
+    uploadStats.chunksSent = 0;
+    uploadStats.differential = (previousHashes != NULL);
+    
     for (int i=0; i<dataLength; i=i+dataChunkSize)
     {
         int dataRemaining = dataLength - i;
         int actualDataChunkSize = (dataRemaining < dataChunkSize) ? dataRemaining : dataChunkSize;
     
-        int commandLength = 8+dataChunkSize+1;
+        const int commandLength = 8+dataChunkSize+1;
         char command[commandLength];
 
         command[0] = 0x53;
@@ -665,6 +2945,23 @@ bool SPKTVOne::uploadFile(char instruction, FILE* file, int dataLength, int inde
         }
 
         command[8+actualDataChunkSize] = 0x3F;
+        
+        int chunk = i / dataChunkSize;
+        uploadStats.chunks++;
+        
+        if (hashes)
+        {
+            hashes[chunk] = chunkHash(command+8, actualDataChunkSize);
+            
+            // Unchanged chunks can be skipped, but the last is always sent as it's the one that completes the image
+            bool lastChunk = (i + dataChunkSize >= dataLength);
+            if (previousHashes && previousHashes[chunk] == hashes[chunk] && !lastChunk)
+            {
+                success = true;
+                continue;
+            }
+        }
+        uploadStats.chunksSent++;
 
         if (debug)
         {
@@ -673,22 +2970,30 @@ bool SPKTVOne::uploadFile(char instruction, FILE* file, int dataLength, int inde
             debug->printf("\r\n");
         }
 
-        while (serial->readable() || timer.read_ms() < commandMinimumPeriod) 
-        {
-           if (serial->readable()) serial->getc();
-        }
+        // Chunk boundaries are the only place an upload can yield, so let queued operator commands through
+        processQueue(priorityNormal);
+
+        uint64_t startUs = timeUs();
+        uint64_t sleptOnStart = sleptUs;
+
+        uint64_t readyAt = lastCommandSentUs + (uint64_t)periods.minimumMs * 1000;
+        waitFor(readyAt, false);
+        finishFastAck();
+        rxFlush();
  
         for (int k=0; k < commandLength; k++) serial->putc(command[k]);
         
-        timer.reset();
+        lastCommandSentUs = timeUs();
+        uint64_t timeoutAt = lastCommandSentUs + (uint64_t)periods.timeoutMs * 1000;
         
         char ackBuffer[4];
         int  ackPos = 0;
-        while (timer.read_ms() < commandTimeoutPeriod) 
+        while (ackPos < ackLength && waitFor(timeoutAt, true)) 
         {
-            if (serial->readable()) ackBuffer[ackPos++] = serial->getc();
-            if (ackPos == 4) break;
+            ackBuffer[ackPos++] = rxGetc();
         }
+        
+        recordLoad(startUs, sleptOnStart);
 
         if (memcmp(ackBuffer, goodAck, ackLength) == 0) 
         {
@@ -707,7 +3012,10 @@ bool SPKTVOne::uploadFile(char instruction, FILE* file, int dataLength, int inde
         }
     }
     
-    resetCommandPeriods();
+    // Saved time is what the skipped chunks would have cost at the rate the sent ones went
+    uploadStats.elapsedMs = (timeUs() - uploadStartUs) / 1000;
+    int chunksSkipped = uploadStats.chunks - uploadStats.chunksSent;
+    uploadStats.savedMs = (uploadStats.chunksSent > 0) ? (uploadStats.elapsedMs * chunksSkipped) / uploadStats.chunksSent : 0;
     
     return success;
 }
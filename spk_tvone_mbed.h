@@ -23,23 +23,81 @@
 #ifndef SPKTVOne_mBed_h
 #define SPKTVOne_mBed_h
 
+#include <atomic>
+
 #include "spk_tvone.h"
+#include "spk_tvone_functions.h"
+#include "spk_tvone_show.h"
+
+#if defined(SPK_TVONE_POSIX)
+#include "spk_tvone_posix.h"
+#include <thread>
+#else
 #include "mbed.h"
+#endif
 
 class SPKTVOne
 {
   public:
     SPKTVOne(PinName txPin, PinName rxPin, PinName signWritePin = NC, PinName signErrorPin = NC, Serial *debugSerial = NULL);
+    ~SPKTVOne();
     
     enum commandType {writeCommandType = 0, readCommandType = 1};
     static const int standardAckLength = 20;
+    static const int fastAckLength = kTV1FrameFunctionOffset + 4;
+    
+    // Fast writes return as soon as the ack shows success for their function, and don't wait for or check the echoed payload. 
+    // For continuous controls (fades, volume, pan) where a lost value is overwritten a few ms later anyway.
+    // Every Nth fast write is verified lazily, from the rest of its ack, when the next command goes out.
+    enum writeMode {writeVerified = 0, writeFast = 1};
     
-    bool command(uint8_t channel, uint8_t window, int32_t func, int32_t payload);
-    bool readCommand(uint8_t channel, uint8_t window, int32_t func, int32_t &payload);
+    // Per-call overrides of the command periods, eg. longer for a resolution change. 0 leaves that period at the port's setting.
+    struct periodsType {int minimumMs; int timeoutMs;};
+    
+    bool command(uint8_t channel, uint8_t window, int32_t func, int32_t payload, writeMode mode = writeVerified, periodsType periods = periodsType());
+    bool readCommand(uint8_t channel, uint8_t window, int32_t func, int32_t &payload, periodsType periods = periodsType());
+    
+    // Writes are checked against the function table in spk_tvone_functions.h and rejected without being sent if invalid.
+    // These check at compile time what they can, eg. set<kTV1FunctionAdjustWindowsZoomLevel, 150>(0, kTV1WindowIDA)
+    template <int32_t func, int32_t payload> bool set(uint8_t channel, uint8_t window)
+    {
+        static_assert(kTV1FunctionIsWritable(func), "TVOne function is read only");
+        static_assert(kTV1FunctionInRange(func, payload), "TVOne payload is out of range for function");
+        return command(channel, window, func, payload);
+    }
+    template <int32_t func> bool set(uint8_t channel, uint8_t window, int32_t payload)
+    {
+        static_assert(kTV1FunctionIsWritable(func), "TVOne function is read only");
+        return command(channel, window, func, payload);
+    }
     
     struct processorType {int version; int productType; int boardType;};
     processorType getProcessorType();
     
+#if defined(SPK_TVONE_POSIX)
+    // Finds which ports have units on them, and what each is, eg. at startup. Every port matching the glob is opened at once
+    // and sent all three identification reads back to back, so discovery takes about as long as one unit takes to answer,
+    // however many ports there are. A port that says nothing within timeoutMillis is given up on; one that answers gets
+    // the command timeout for the rest, with any read it missed sent again. Fills units with every port tried, found or not, and returns how many that is.
+    static const int discoveryPortLength = 64;
+    struct discoveredUnitType {char port[discoveryPortLength]; bool found; processorType processor; int answerMillis;};
+    static int discoverUnits(discoveredUnitType units[], int maxUnits, const char *portGlob = "/dev/tty{USB,ACM}*", int baud = kTV1BaudDefault, int timeoutMillis = kTV1CommandTimeoutMillis);
+#endif
+    
+    // Acks are framed on their CR, so line noise or a partial frame costs that one command rather than every one after it.
+    // After linkDownThreshold failures in a row the link is down, and each command first probes the unit with a quick version read.
+    // When it answers again the version and board type are re-read, and if they differ the unit counts as changed.
+    // On recovering, the keyer and window geometry last applied are queued again and the resync handler is called, if set,
+    // for the app to restore anything else. This may be from the worker thread. checkLink() probes on demand, eg. when idle.
+    enum linkStateType {linkUp, linkDown};
+    static const int linkDownThreshold = 3;
+    struct linkStatsType {int framingErrors; int staleAcks; int linkDowns; int recoveries; int identityChanges; int lastRecoveryMs; int totalRecoveryMs;};
+    linkStateType getLinkState();
+    bool checkLink();
+    void setResyncHandler(void (*handler)(void *context, bool identityChanged), void *context = NULL);
+    linkStatsType getLinkStats();
+    void resetLinkStats();
+    
     int  getResolution(int device = 0);
     int  getEDID();
     bool setResolution(int resolution, int edidSlot);
@@ -48,24 +106,253 @@ class SPKTVOne
     enum aspectType { aspectFit = 1, aspectHFill = 2, aspectVFill = 3, aspect1to1 = 4, aspectSPKFill }; 
     aspectType getAspect();
     bool setAspect(aspectType aspect);
+    
+    // Changes show format in one go, as setResolution, setHDCPOn and setAspect would together. The plan is worked out first:
+    // anything the state cache shows as already set is dropped, and SPK fill takes output and source geometry from the resolution
+    // table rather than reading it back. The output resolution and HDCP requirement, which make the output resync, go back to back
+    // so the output blanks once. EDID slots follow verified, as setResolution has them, then the other source settings as fast writes.
+    // Any write that fails is retried verified, with longer periods. Reads are every frame sent to work out the plan.
+    // Blanking is measured from sending the first write that resyncs the output to the ack of the last, as near as we can see to it.
+    struct formatType {int resolution; int edidSlot; bool hdcp; aspectType aspect;};
+    struct formatChangeType {int planned; int skipped; int sent; int retried; int reads; int totalMs; int blankingMs;};
+    bool changeFormat(const formatType &format, formatChangeType *result = NULL);
 
     bool uploadEDID(FILE* file, int edidSlotIndex);
-    bool uploadImage(FILE* file, int sisIndex);
+    bool uploadImage(FILE* file, int sisIndex, bool differential = false);
+    
+    // A differential upload hashes each 32 byte chunk and only sends those that differ from what was last uploaded to that slot.
+    // Without a manifest for the slot, or if the unit rejects a chunk, it falls back to a full upload.
+    struct uploadStatsType {int chunks; int chunksSent; bool differential; int elapsedMs; int savedMs;};
+    uploadStatsType getLastUploadStats();
+    void invalidateImageManifests();
+    
+    // Runs a cue from a show compiled with tools/spk_tvone_showc, streaming its frames as they are with no per-command formatting.
+    // The show can be a const array in flash or a mapped file, check it once with kTV1ShowIsValid before running cues from it.
+    // Stops at the first frame the unit doesn't acknowledge with the payload it was sent.
+    bool runCue(const uint8_t *show, int cueIndex);
+    bool runCue(const uint8_t *show, const char *cueName);
+    
+    // SPK firmware only, as the dual head resolutions it sets up aren't in stock or v415 firmware. Elsewhere returns false.
     bool setMatroxResolutions(bool digitalEdition = true);
     
+    struct fastWriteStatsType {int writes; int verified; int mismatches; int incomplete;};
+    void setFastWriteVerifyInterval(int interval);
+    fastWriteStatsType getFastWriteStats();
+    void resetFastWriteStats();
+    
     void setCommandTimeoutPeriod(int millis);
     int  getCommandTimeoutPeriod();
     void setCommandMinimumPeriod(int millis);
     void increaseCommandPeriods(int millis);
     void resetCommandPeriods();
+    
+    // Finds the fastest rate the unit answers on, trying the last one found first then working down from 230400.
+    // Pass a file path, one per unit, to remember the rate between runs. Returns the rate, or 0 if the unit didn't answer on any.
+    int  negotiateBaud(const char *persistPath = NULL);
+    void setBaud(int baud);
+    int  getBaud();
+    
+    // Each full ack's latency split into time on the wire, from the rate and frame lengths, and the rest, which is the unit.
+    // If wire time dominates a faster rate will help, if unit time dominates it won't.
+    struct wireStatsType {int commands; int lastWireUs; int lastUnitUs; int64_t totalWireUs; int64_t totalUnitUs;};
+    wireStatsType getWireStats();
+    void resetWireStats();
 
     int  millisSinceLastCommandSent();
+    
+    // Monotonic microseconds since power on. Wraps after half a million years.
+    uint64_t timeUs();
+    
+    // Sends a write so it takes effect at deadlineUs on the timeUs() clock, eg. a take on a musical cue. Blocks until done.
+    // It's sent early by the function's measured send to ack latency, and queued commands only run beforehand if they'll be clear by then.
+    // Error is when the ack arrived versus the deadline, late counts sends that couldn't go when planned.
+    struct timingStatsType {int scheduled; int late; int failed; int lastErrorUs; int maxAbsErrorUs; int64_t totalAbsErrorUs;};
+    bool commandAt(uint64_t deadlineUs, uint8_t channel, uint8_t window, int32_t func, int32_t payload);
+    uint32_t commandLatencyUs(int32_t func);
+    timingStatsType getTimingStats();
+    void resetTimingStats();
+    
+    // Waits sleep the core until a byte arrives or the deadline passes, these measure how much of each command was spent awake.
+    struct loadStatsType {int commands; uint64_t elapsedUs; uint64_t sleptUs; int lastUtilisation;};
+    loadStatsType getLoadStats();
+    void resetLoadStats();
+    
+    // Queued commands are sent in priority order whenever the queue is processed: explicitly via processQueue, 
+    // before every blocking command and between the chunks of a file upload. 
+    // Queueing is lock-free and safe from interrupts and other threads, so front panel, network and sequencer handlers can all 
+    // queue without waiting on each other or the serial link. Only one context, the port's owner, may process the queue.
+    enum commandPriority {priorityInteractive = 0, priorityNormal = 1, priorityBulk = 2};
+    static const int priorityCount = 3;
+    static const int commandQueueLength = 32;
+    
+    struct queuedCommand {uint8_t channel; uint8_t window; int32_t func; int32_t payload; writeMode mode; periodsType periods;};
+    struct queueStatsType {int sent; int failed; int dropped; int contended; int superseded; int maxDelayMs; int totalDelayMs;};
+    
+    // A supersedable group replaces the newest waiting group for the same channel and window in place, if it writes everything that one does,
+    // so an app sending faster than the link fills no slots and always has its latest values sent, in the order it queued them.
+    bool queueCommand(commandPriority priority, uint8_t channel, uint8_t window, int32_t func, int32_t payload, bool supersedable = false);
+    bool queueCommands(commandPriority priority, const queuedCommand *commands, int count, bool supersedable = false);
+    int  processQueue(commandPriority lowestPriority = priorityBulk);
+    int  queuedCount(commandPriority priority);
+    queueStatsType getQueueStats(commandPriority priority);
+    void resetQueueStats();
+    
+#if defined(SPK_TVONE_POSIX)
+    // Hands the port to a worker thread that processes the queue as commands arrive. 
+    // While it runs, other threads must only queue, not call anything that sends.
+    bool startWorker();
+    void stopWorker();
+#endif
+    
+    // Commands issued between begin and end are never split by queued commands, eg. ImageToAdjust and its parameters.
+    void beginCommandGroup();
+    void endCommandGroup();
+    
+    // Sends one write to each of several units so they all take effect together, eg. a cut across a multi-projector blend.
+    // Frames are encoded up front, each unit's queue is held clear, and the sends are released interleaved byte by byte,
+    // each unit's send brought forward by its measured latency. takeAtUs of 0 means as soon as every unit can make it.
+    // Skew is the spread of the ack times across the units that acked, error is the furthest any was from the target.
+    static const int maxSyncUnits = 8;
+    struct syncResultType {int acked; int skewUs; int maxErrorUs; uint64_t targetUs;};
+    static bool commandSynchronised(SPKTVOne *const units[], const queuedCommand commands[], int count, uint64_t takeAtUs = 0, syncResultType *result = NULL);
+    
+    // Keyer settings are diffed against what was last applied to that window, and only the changes are queued as one group.
+    // Returns the number of writes queued, or why none were: queueFull is worth retrying, queueInvalid (a setting out of range) isn't.
+    enum queueRefusalType {queueFull = -1, queueInvalid = -2};
+    struct keyerType {bool enable; int minY; int minU; int minV; int maxY; int maxU; int maxV; int softnessY; int softnessU; int softnessV; bool invertY; bool invertU; bool invertV; bool swap;};
+    int  setKeyer(const keyerType &keyer, uint8_t window = kTV1WindowIDA, commandPriority priority = priorityInteractive);
+    void invalidateKeyer();
+    
+    // Window geometry is likewise diffed per window, and the changes queued as one supersedable group. Returns as setKeyer.
+    // Writes are ordered so intermediate states stay between the old and new geometry, eg. zoom before pan when zooming in.
+    // Zoom: 100 - 1000, Pan, Crop, Shrink Level and Position: 0 - 100, Shift: -4096 - 4096
+    struct windowGeometryType {int zoom; int panH; int panV; int cropH; int cropV; int shiftH; int shiftV; int shrink; int shrinkPosH; int shrinkPosV;};
+    static windowGeometryType windowGeometryForRect(int x, int y, int width, int height, int outputWidth, int outputHeight);
+    int  setWindowGeometry(const windowGeometryType &geometry, uint8_t window = kTV1WindowIDA, commandPriority priority = priorityInteractive);
+    void invalidateWindowGeometry();
+    
+    // Cacheable functions as last written or read, so callers can skip writes that wouldn't change anything.
+    // Cleared when the unit may have changed behind our back: a cue, a preset load, or the link recovering.
+    bool cachedValue(uint8_t channel, uint8_t window, int32_t func, int32_t &payload);
+    void invalidateStateCache();
+    
+    // Warm start. With a path set, eg. on the mbed's LocalFileSystem, the state cache can be saved there with the unit's identity and a checksum.
+    // Saves are batched to spare the flash: call saveStateIfDue() from the main loop, and it writes once batchMillis have passed
+    // since the first unsaved change. After a reset, restoreState() reads the identity and a random sample of the saved values back from the unit.
+    // If they agree, the cache is taken as saved. If not, every saved value is read back instead, and the image saved again.
+    // The image counts boots, which moves the sample on each time, so a restore marks the state for saving with the next batch.
+    // A sample catches a unit that was reset or re-programmed, not reliably a single setting changed from the front panel.
+    enum restoreResultType {restoreNoImage, restoreSampled, restoreFullSync, restoreFailed};
+    static const int statePathLength = 64;
+    void setStatePath(const char *path, int batchMillis = 5000);
+    bool saveStateIfDue();
+    bool saveState();
+    restoreResultType restoreState(int sampleCount = 4);
+    
+    // Presets are 1 - 10. Loading waits until the unit has finished, then what it's known to contain seeds the state cache.
+    bool loadPreset(int preset, const queuedCommand *contents = NULL, int count = 0);
+    bool storePreset(int preset);
      
   private:
     struct processorType processor;
     
-    bool command(commandType readWrite, int* ackBuffer, int ackLength, uint8_t channel, uint8_t window, int32_t func, int32_t payload);
-    bool uploadFile(char command, FILE* file, int dataLength, int index);
+    // Positions count up forever, and wrap cleanly as commandQueueLength divides 2^32
+    struct queueEntry {queuedCommand command; uint64_t queuedAt; bool groupFirst; bool groupWithNext; bool supersedable; bool cancelled; std::atomic<uint32_t> sequence;};
+    queueEntry commandQueue[priorityCount][commandQueueLength];
+    std::atomic<uint32_t> queueHead[priorityCount];
+    std::atomic<uint32_t> queueTail[priorityCount];
+    queueStatsType queueStats[priorityCount];
+    std::atomic<int> queueDropped[priorityCount];
+    std::atomic<int> queueContended[priorityCount];
+    std::atomic<int> queueCoalesced[priorityCount];
+    bool queuePublished(int priority, uint32_t position);
+    bool queueGroup(commandPriority priority, const queuedCommand *commands, int count, bool supersedable, uint32_t *position);
+    int  queueLockCovered(int priority, const queuedCommand *commands, int count, uint32_t &first);
+    void queueUnlock(int priority, uint32_t first, int count);
+    int  commandGroupDepth;
+    bool processingQueue;
+    
+#if defined(SPK_TVONE_POSIX)
+    std::thread workerThread;
+    std::atomic<bool> workerRunning;
+    WakeSignal workerWake;
+    void workerLoop();
+#endif
+    
+    static const int keyerFunctionCount = 14;
+    static const int32_t keyerFunctions[keyerFunctionCount];
+    int32_t keyerApplied[2][keyerFunctionCount];
+    bool keyerValid[2];
+    
+    windowGeometryType geometryApplied[2];
+    bool geometryValid[2];
+    
+    // Where the last group queued for each window started from, what it writes and where it sits, so while waiting the next can replace it
+    windowGeometryType geometryBase[2];
+    bool geometryWaiting[2];
+    commandPriority geometryWaitingPriority[2];
+    uint32_t geometryWaitingAt[2];
+    queuedCommand geometryWaitingWrites[2][10];
+    int geometryWaitingCount[2];
+    
+    void invalidateCachesFor(const queuedCommand &command);
+    
+    // Open addressed on (channel, window, func). Forgotten entries keep their slot, so probes past them still work.
+    static const int stateCacheLength = 128;
+    enum stateEntryState {stateEmpty, stateKnown, stateUnknown};
+    struct stateEntry {uint32_t key; int32_t payload; uint8_t state;};
+    stateEntry stateCache[stateCacheLength];
+    stateEntry* stateFor(uint8_t channel, uint8_t window, int32_t func, bool add);
+    void recordState(uint8_t channel, uint8_t window, int32_t func, int32_t payload);
+    void forgetState(uint8_t channel, uint8_t window, int32_t func);
+    
+    char     statePath[statePathLength];
+    int      stateBatchMillis;
+    bool     stateDirty;
+    uint64_t stateDirtySinceUs;
+    uint8_t  stateBoots;
+    void     markStateDirty();
+    
+    bool command(commandType readWrite, int* ackBuffer, int ackLength, uint8_t channel, uint8_t window, int32_t func, int32_t payload, bool fast = false, periodsType periods = periodsType());
+    bool sendFrame(const char *frame, int frameLength, int* ackBuffer, int ackLength, bool fast, periodsType periods = periodsType());
+    periodsType effectivePeriods(periodsType periods);
+    periodsType increasedPeriods(periodsType periods, int millis);
+    static int32_t ackPayload(const int *ackBuffer, int32_t func);
+    static bool ackMatchesFrame(const int *ackBuffer, const char *frame);
+    
+    // Acks are assembled a character at a time, by sendFrame and commandSynchronised alike
+    enum ackProgressType {ackPartial, ackWhole, ackResynced};
+    struct ackFramerType {int pos; bool skipToCR;};
+    ackProgressType frameAck(ackFramerType &framer, int c, int *ackBuffer, int ackLength, const char *frame);
+    
+    linkStateType linkState;
+    int  linkFailures;
+    uint64_t linkFailedAtUs;
+    bool linkProbing;
+    bool linkResyncing;
+    linkStatsType linkStats;
+    void (*resyncHandler)(void *context, bool identityChanged);
+    void *resyncContext;
+    bool probeLink();
+    void recordLinkResult(bool success);
+    void resyncState(bool identityChanged);
+    
+    int  fastAck[standardAckLength];
+    int  fastAckPos;
+    bool fastAckPending;
+    bool fastAckVerify;
+    queuedCommand fastAckCommand;
+    int  fastWriteVerifyInterval;
+    fastWriteStatsType fastWriteStats;
+    void finishFastAck();
+    
+    static const int imageManifestSlots = 8;
+    struct imageManifestType {int dataLength; uint32_t *hashes;};
+    imageManifestType imageManifests[imageManifestSlots];
+    uploadStatsType uploadStats;
+    static uint32_t chunkHash(const char *data, int length, uint32_t hash = 2166136261u);
+    
+    bool uploadFile(char command, FILE* file, int dataLength, int index, uint32_t *hashes = NULL, const uint32_t *previousHashes = NULL);
     
     bool getResolutionParams(int resStoreNumber, int &horizpx, int &vertpx);
     
@@ -79,9 +366,46 @@ class SPKTVOne
     int commandTimeoutPeriod;
     int commandMinimumPeriod;
     
-    Timer timer;
-    Ticker timerCheckTicker;
-    void timerCheck();
+    static const int baudLadder[];
+    static const int baudLadderLength;
+    int  baudRate;
+    bool baudAnswers(int baud);
+    wireStatsType wireStats;
+    
+    // The hardware us ticker wraps every ~71 mins, we extend it to 64 bits by counting wraps.
+    uint32_t timebaseLow;
+    uint32_t timebaseHigh;
+    Ticker timebaseTicker;
+    void timebaseSample();
+    
+    uint64_t lastCommandSentUs;
+    uint32_t framesSent;
+    
+    uint64_t lastAckLatencyUs;
+    uint32_t latencyEstimateUs[kTV1FunctionCount + 1]; // Last is for functions not in the table
+    uint32_t latencyOverallUs;
+    uint64_t holdLineAtUs;
+    timingStatsType timingStats;
+    void recordLatency(int32_t func, uint32_t latencyUs);
+    
+    static const int rxBufferLength = 64;
+    volatile char rxBuffer[rxBufferLength];
+    volatile int  rxHead;
+    volatile int  rxTail;
+    volatile int  rxOverflow;
+    void rxInterrupt();
+    int  rxGetc();
+    void rxPoll();
+    void rxFlush();
+    
+    Timeout wakeTimeout;
+    void wakeInterrupt();
+    bool waitFor(uint64_t deadlineUs, bool forRx);
+    static void waitForAny(SPKTVOne *const units[], int count, uint64_t deadlineUs);
+    
+    uint64_t sleptUs;
+    loadStatsType loadStats;
+    void recordLoad(uint64_t startUs, uint64_t sleptOnStart);
     
     DigitalOut *writeDO;
     DigitalOut *errorDO;
@@ -0,0 +1,557 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Host stand-ins for the parts of mbed that SPKTVOne uses, so the same code runs on Linux / POSIX
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#if defined(SPK_TVONE_POSIX)
+
+#include "spk_tvone_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+uint64_t spkPosixTimeUs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+const uint8_t* spkPosixMapFile(const char *path, size_t &length)
+{
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    
+    struct stat info;
+    void *mapped = MAP_FAILED;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+    {
+        length = info.st_size;
+        mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0);
+    }
+    close(file);
+    
+    return (mapped == MAP_FAILED) ? NULL : (const uint8_t*)mapped;
+}
+
+bool spkTraceFrameComplete(const char *frame, int length)
+{
+    if (length < 1) return false;
+    if (frame[0] == 'F') return frame[length - 1] == '\r' || length >= 20;
+    if (frame[0] == 'S') return length >= 41;
+    
+    return true;
+}
+
+static void traceWriteVarint(FILE *file, uint64_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        fputc(byte | (value ? 0x80 : 0), file);
+    }
+    while (value);
+}
+
+static bool traceReadVarint(FILE *file, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+struct traceExchange
+{
+    std::string frame;
+    uint64_t sentUs;
+    std::vector<uint64_t> replyOffsetsUs;
+    std::vector<std::string> replies;
+};
+
+struct traceReply
+{
+    uint64_t dueUs;
+    std::string bytes;
+};
+
+struct Serial::traceState
+{
+    // Recording
+    FILE *file;
+    uint64_t lastRecordUs;
+    char txFrame[64];
+    int  txLength;
+    char rxRun[64];
+    int  rxLength;
+    uint64_t rxRunUs;
+    uint64_t rxLastUs;
+    
+    // Replay, the unit side of a socket pair, run on its own thread
+    std::vector<traceExchange> exchanges;
+    int unit;
+    std::atomic<bool> running;
+    std::thread thread;
+    int frames, matched, skipped, diverged, sooner, beyond;
+    
+    traceState() : file(NULL), lastRecordUs(0), txLength(0), rxLength(0), rxRunUs(0), rxLastUs(0), unit(-1), running(false),
+                   frames(0), matched(0), skipped(0), diverged(0), sooner(0), beyond(0) {}
+    
+    void writeRecord(char kind, uint64_t timeUs, const char *data, int length)
+    {
+        fputc(kind, file);
+        traceWriteVarint(file, timeUs - lastRecordUs);
+        traceWriteVarint(file, length);
+        fwrite(data, 1, length, file);
+        lastRecordUs = timeUs;
+    }
+    
+    void flushReceived()
+    {
+        if (rxLength) writeRecord('R', rxRunUs, rxRun, rxLength);
+        rxLength = 0;
+    }
+    
+    // Bytes read within 100us of each other are one run, at the time of the first
+    void recordReceived(char c)
+    {
+        uint64_t now = spkPosixTimeUs();
+        if (rxLength && (now - rxLastUs > 100 || rxLength == sizeof(rxRun))) flushReceived();
+        if (!rxLength) rxRunUs = now;
+        rxRun[rxLength++] = c;
+        rxLastUs = now;
+    }
+    
+    void recordSent(char c)
+    {
+        txFrame[txLength++] = c;
+        if (!spkTraceFrameComplete(txFrame, txLength) && txLength < (int)sizeof(txFrame)) return;
+        
+        flushReceived();
+        writeRecord('T', spkPosixTimeUs(), txFrame, txLength);
+        txLength = 0;
+    }
+    
+    bool load(const char *path)
+    {
+        FILE *in = fopen(path, "rb");
+        if (!in) return false;
+        
+        char header[8];
+        bool ok = fread(header, 1, 8, in) == 8 && memcmp(header, "TV1T", 4) == 0 && header[4] == kTV1TraceVersion;
+        
+        uint64_t timeUs = 0;
+        int kind;
+        while (ok && (kind = fgetc(in)) != EOF)
+        {
+            uint64_t deltaUs, length;
+            if (!traceReadVarint(in, deltaUs) || !traceReadVarint(in, length) || length > 4096) { ok = false; break; }
+            
+            std::string bytes(length, 0);
+            if (fread(&bytes[0], 1, length, in) != length) { ok = false; break; }
+            timeUs += deltaUs;
+            
+            // Replies are timed from the frame sent before them, anything before the first frame is dropped
+            if (kind == 'T')
+            {
+                traceExchange exchange;
+                exchange.frame = bytes;
+                exchange.sentUs = timeUs;
+                exchanges.push_back(exchange);
+            }
+            else if (kind == 'R' && !exchanges.empty())
+            {
+                exchanges.back().replyOffsetsUs.push_back(timeUs - exchanges.back().sentUs);
+                exchanges.back().replies.push_back(bytes);
+            }
+        }
+        
+        fclose(in);
+        return ok;
+    }
+    
+    void replay()
+    {
+        std::string frame;
+        std::vector<traceReply> due;
+        size_t next = 0;
+        size_t last = (size_t)-1;
+        uint64_t lastSentUs = 0;
+        
+        while (running)
+        {
+            // Sleep until the next reply is due or the library sends something
+            uint64_t now = spkPosixTimeUs();
+            int waitMs = 50;
+            for (size_t i = 0; i < due.size(); i++)
+            {
+                int untilMs = (due[i].dueUs > now) ? (int)((due[i].dueUs - now + 999) / 1000) : 0;
+                if (untilMs < waitMs) waitMs = untilMs;
+            }
+            
+            struct pollfd pfd = {unit, POLLIN, 0};
+            if (poll(&pfd, 1, waitMs) > 0)
+            {
+                char c;
+                while (read(unit, &c, 1) == 1)
+                {
+                    frame.push_back(c);
+                    if (spkTraceFrameComplete(frame.data(), frame.size())) 
+                    {
+                        answer(frame, next, last, lastSentUs, due);
+                        frame.clear();
+                    }
+                }
+            }
+            
+            now = spkPosixTimeUs();
+            for (size_t i = 0; i < due.size(); )
+            {
+                if (due[i].dueUs > now) { i++; continue; }
+                if (::write(unit, due[i].bytes.data(), due[i].bytes.size()) < 0) {}
+                due.erase(due.begin() + i);
+            }
+        }
+    }
+    
+    void answer(const std::string &frame, size_t &next, size_t &last, uint64_t &lastSentUs, std::vector<traceReply> &due)
+    {
+        uint64_t now = spkPosixTimeUs();
+        frames++;
+        
+        if (next >= exchanges.size())
+        {
+            beyond++;
+            return;
+        }
+        
+        // TASK: Find this frame in the recording, looking a little ahead in case the library now skips or reorders some
+        size_t found = next;
+        while (found < exchanges.size() && found < next + 32 && exchanges[found].frame != frame) found++;
+        
+        if (found < exchanges.size() && exchanges[found].frame == frame)
+        {
+            matched++;
+            skipped += found - next;
+            next = found;
+        }
+        else diverged++;
+        
+        if (last != (size_t)-1 && next == last + 1 && now - lastSentUs + 1000 < exchanges[next].sentUs - exchanges[last].sentUs) sooner++;
+        
+        for (size_t i = 0; i < exchanges[next].replies.size(); i++)
+        {
+            traceReply reply = {now + exchanges[next].replyOffsetsUs[i], exchanges[next].replies[i]};
+            due.push_back(reply);
+        }
+        
+        last = next++;
+        lastSentUs = now;
+    }
+};
+
+Serial::Serial(PinName tx, PinName rx)
+{
+    trace = NULL;
+    handle = -1;
+    
+    // TASK: Replay stands a recorded trace in for the unit, on the far side of a socket pair
+    if (tx && strncmp(tx, "replay:", 7) == 0)
+    {
+        trace = new traceState;
+        int pair[2];
+        if (!trace->load(tx + 7) || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+        {
+            fprintf(stderr, "Serial: could not replay %s\n", tx + 7);
+            return;
+        }
+        
+        handle = pair[0];
+        trace->unit = pair[1];
+        fcntl(handle, F_SETFL, O_NONBLOCK);
+        fcntl(trace->unit, F_SETFL, O_NONBLOCK);
+        trace->running = true;
+        trace->thread = std::thread(&traceState::replay, trace);
+        return;
+    }
+    
+    // TASK: Record opens the device as normal, after the @
+    std::string recordPath;
+    if (tx && strncmp(tx, "record:", 7) == 0)
+    {
+        const char *at = strchr(tx, '@');
+        if (!at)
+        {
+            fprintf(stderr, "Serial: record needs record:<trace>@<device>\n");
+            return;
+        }
+        
+        trace = new traceState;
+        recordPath.assign(tx + 7, at - (tx + 7));
+        trace->file = fopen(recordPath.c_str(), "wb");
+        if (!trace->file) fprintf(stderr, "Serial: could not record to %s: %s\n", recordPath.c_str(), strerror(errno));
+        else
+        {
+            const char header[8] = {'T', 'V', '1', 'T', kTV1TraceVersion, 0, 0, 0};
+            fwrite(header, 1, sizeof(header), trace->file);
+            trace->lastRecordUs = spkPosixTimeUs();
+        }
+        tx = at + 1;
+    }
+    
+    // tx is the device path, rx is unused as it's the same device
+    handle = tx ? open(tx, O_RDWR | O_NOCTTY | O_NONBLOCK) : -1;
+    
+    if (tx && handle < 0) fprintf(stderr, "Serial: could not open %s: %s\n", tx, strerror(errno));
+    
+    if (handle >= 0 && isatty(handle))
+    {
+        struct termios options;
+        tcgetattr(handle, &options);
+        cfmakeraw(&options);
+        options.c_cflag |= CLOCAL | CREAD;
+        options.c_cc[VMIN] = 0;
+        options.c_cc[VTIME] = 0;
+        tcsetattr(handle, TCSANOW, &options);
+    }
+}
+
+Serial::~Serial()
+{
+    if (trace && trace->running)
+    {
+        trace->running = false;
+        trace->thread.join();
+        close(trace->unit);
+        
+        fprintf(stderr, "Serial: replayed %i frames, %i matched, %i skipped, %i diverged, %i sooner than recorded, %i beyond the trace\n",
+                trace->frames, trace->matched, trace->skipped, trace->diverged, trace->sooner, trace->beyond);
+    }
+    if (trace && trace->file)
+    {
+        trace->flushReceived();
+        fclose(trace->file);
+    }
+    delete trace;
+    
+    if (handle >= 0) close(handle);
+}
+
+void Serial::baud(int rate)
+{
+    if (handle < 0 || !isatty(handle)) return;
+    
+    speed_t speed;
+    switch (rate)
+    {
+        case 9600:   speed = B9600;   break;
+        case 19200:  speed = B19200;  break;
+        case 38400:  speed = B38400;  break;
+        case 57600:  speed = B57600;  break;
+        case 115200: speed = B115200; break;
+        case 230400: speed = B230400; break;
+        default:
+            fprintf(stderr, "Serial: unsupported baud rate %i\n", rate);
+            return;
+    }
+    
+    struct termios options;
+    tcgetattr(handle, &options);
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    tcsetattr(handle, TCSANOW, &options);
+}
+
+int Serial::readable()
+{
+    if (handle < 0) return 0;
+    
+    struct pollfd pfd = {handle, POLLIN, 0};
+    
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+int Serial::writeable()
+{
+    if (handle < 0) return 0;
+    
+    struct pollfd pfd = {handle, POLLOUT, 0};
+    
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT);
+}
+
+int Serial::getc()
+{
+    unsigned char c;
+    
+    if (handle < 0 || read(handle, &c, 1) != 1) return -1;
+    
+    if (trace && trace->file) trace->recordReceived(c);
+    
+    return c;
+}
+
+int Serial::putc(int c)
+{
+    char byte = c;
+    
+    return write(&byte, 1) ? c : -1;
+}
+
+int Serial::printf(const char* format, ...)
+{
+    char buffer[256];
+    
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    
+    if (length < 0) return length;
+    if (length >= (int)sizeof(buffer)) length = sizeof(buffer) - 1;
+    
+    return write(buffer, length) ? length : -1;
+}
+
+bool Serial::waitReadable(uint64_t timeoutUs)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeoutUs / 1000000;
+    timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+    
+    if (handle < 0)
+    {
+        nanosleep(&timeout, NULL);
+        return false;
+    }
+    
+    struct pollfd pfd = {handle, POLLIN, 0};
+    
+    return ppoll(&pfd, 1, &timeout, NULL) > 0 && (pfd.revents & POLLIN);
+}
+
+bool Serial::waitReadable(Serial *const *serials, int count, uint64_t timeoutUs)
+{
+    if (count < 1 || count > maxWaitSerials) return false;
+    
+    struct timespec timeout;
+    timeout.tv_sec = timeoutUs / 1000000;
+    timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+    
+    struct pollfd pfds[maxWaitSerials];
+    for (int i = 0; i < count; i++)
+    {
+        pfds[i].fd = serials[i]->handle;
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    
+    return ppoll(pfds, count, &timeout, NULL) > 0;
+}
+
+int Serial::fd()
+{
+    return handle;
+}
+
+bool Serial::write(const char *data, int length)
+{
+    if (handle < 0) return false;
+    
+    if (trace && trace->file)
+    {
+        for (int i = 0; i < length; i++) trace->recordSent(data[i]);
+    }
+    
+    // Non-blocking descriptor, so wait for room rather than drop bytes
+    while (length > 0)
+    {
+        ssize_t written = ::write(handle, data, length);
+        if (written > 0)
+        {
+            data += written;
+            length -= written;
+        }
+        else if (written < 0 && errno == EAGAIN)
+        {
+            struct pollfd pfd = {handle, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+        }
+        else if (written < 0 && errno != EINTR)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+WakeSignal::WakeSignal()
+{
+    handle = eventfd(0, EFD_NONBLOCK);
+}
+
+WakeSignal::~WakeSignal()
+{
+    if (handle >= 0) close(handle);
+}
+
+void WakeSignal::notify()
+{
+    uint64_t one = 1;
+    if (write(handle, &one, sizeof(one))) {}
+}
+
+bool WakeSignal::wait(uint64_t timeoutUs)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeoutUs / 1000000;
+    timeout.tv_nsec = (timeoutUs % 1000000) * 1000;
+    
+    struct pollfd pfd = {handle, POLLIN, 0};
+    bool notified = ppoll(&pfd, 1, &timeout, NULL) > 0;
+    
+    uint64_t count;
+    if (notified && read(handle, &count, sizeof(count))) {}
+    
+    return notified;
+}
+
+#endif
@@ -0,0 +1,129 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Host stand-ins for the parts of mbed that SPKTVOne uses, so the same code runs on Linux / POSIX
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// To build for a host, define SPK_TVONE_POSIX and compile this alongside spk_tvone_mbed.cpp, eg.
+// g++ -DSPK_TVONE_POSIX -c spk_tvone_mbed.cpp spk_tvone_posix.cpp
+// Pins become device paths, so SPKTVOne tvOne("/dev/ttyUSB0", NC) talks to a unit on a USB serial adaptor.
+// There are no interrupts: where the mbed build sleeps until the RX interrupt fires, the host blocks in poll().
+//
+// Two more forms of path record and replay the unit's timing, for benchmarking library changes without the hardware:
+// "record:<trace>@<device>" talks to the device as normal, writing each frame sent and each run of bytes received, timestamped, to the trace.
+// "replay:<trace>" has the trace stand in for the unit. Each frame sent gets the bytes that followed it in the recording, after
+// the same delay, so latencies, garbled or missing acks all recur. A frame that differs from the recording is matched to the next
+// recorded frame like it, else answered as if it were the next one. Counts of both, and of frames sent sooner after the last than
+// they were in the recording, are printed when the Serial closes. Sooner means outside what the unit was seen to cope with.
+
+#ifndef SPKTVOne_Posix_h
+#define SPKTVOne_Posix_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef const char* PinName;
+#define NC ((PinName)0)
+
+uint64_t spkPosixTimeUs();
+inline uint32_t us_ticker_read() { return (uint32_t)spkPosixTimeUs(); }
+
+// Maps a file read-only, eg. a compiled show for SPKTVOne::runCue. Returns NULL on failure, stays mapped until exit.
+const uint8_t* spkPosixMapFile(const char *path, size_t &length);
+
+inline void __disable_irq() {}
+inline void __enable_irq() {}
+inline uint32_t __get_PRIMASK() { return 0; }
+inline void __set_PRIMASK(uint32_t primask) {}
+
+class Serial
+{
+  public:
+    enum IrqType {RxIrq = 0, TxIrq = 1};
+    
+    Serial(PinName tx, PinName rx);
+    ~Serial();
+    
+    void baud(int rate);
+    int  readable();
+    int  writeable();
+    int  getc();
+    int  putc(int c);
+    int  printf(const char* format, ...);
+    
+    template<typename T> void attach(T *tptr, void (T::*mptr)(void), IrqType type = RxIrq) {}
+    bool waitReadable(uint64_t timeoutUs);
+    
+    // Waits on up to maxWaitSerials ports at once, eg. every unit in a synchronised take. Callers with more wait in chunks.
+    static const int maxWaitSerials = 8;
+    static bool waitReadable(Serial *const *serials, int count, uint64_t timeoutUs);
+    int  fd();
+    
+  private:
+    int handle;
+    bool write(const char *data, int length);
+    
+    struct traceState;
+    traceState *trace;
+};
+
+// Trace files are "TV1T", a version byte and three reserved, then records to the end: a kind byte, 'T' for a frame sent or
+// 'R' for bytes received, microseconds since the previous record and the byte count as LEB128 varints, then the bytes.
+// A frame is an F command to its CR, a 41 byte S upload chunk, or any other single byte.
+#define kTV1TraceVersion    1
+bool spkTraceFrameComplete(const char *frame, int length);
+
+// Wakes a thread waiting on it. notify never blocks, and notifies before a wait aren't lost.
+class WakeSignal
+{
+  public:
+    WakeSignal();
+    ~WakeSignal();
+    
+    void notify();
+    bool wait(uint64_t timeoutUs);
+    
+  private:
+    int handle;
+};
+
+class DigitalOut
+{
+  public:
+    DigitalOut(PinName pin) : value(0) {}
+    DigitalOut& operator= (int v) { value = v; return *this; }
+    operator int() { return value; }
+    
+  private:
+    int value;
+};
+
+class Ticker
+{
+  public:
+    template<typename T> void attach(T *tptr, void (T::*mptr)(void), float t) {}
+    template<typename T> void attach_us(T *tptr, void (T::*mptr)(void), uint32_t t) {}
+    void detach() {}
+};
+
+class Timeout : public Ticker {};
+
+#endif
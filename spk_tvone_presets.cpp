@@ -0,0 +1,227 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Preset recall: chooses between loading a hardware preset and writing settings directly, by measured cost
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "spk_tvone_presets.h"
+
+SPKTVOnePresets::SPKTVOnePresets(SPKTVOne *tvOneUnit, Serial *debugSerial)
+{
+    tvOne = tvOneUnit;
+    debug = debugSerial;
+    
+    for (int i = 0; i < presetCount; i++) forgetPreset(i + 1);
+    
+    // Guesses until measured. Loads are assumed slow, so presets only win at first when they save a lot of writes.
+    presetLoadCostUs = 10 * kTV1CommandMinimumMillis * 1000;
+    writeCostUs = kTV1CommandMinimumMillis * 1000;
+    
+    resetRecallStats();
+}
+
+void SPKTVOnePresets::setPresetContents(int preset, const SPKTVOne::queuedCommand *settings, int count)
+{
+    if (preset < 1 || preset > presetCount) return;
+    
+    presetType &contents = presets[preset - 1];
+    
+    // Anything beyond what fits is dropped, and then just won't be counted on when planning
+    contents.count = (count < presetSettingsLength) ? count : presetSettingsLength;
+    for (int i = 0; i < contents.count; i++)
+    {
+        contents.settings[i].channel = settings[i].channel;
+        contents.settings[i].window = settings[i].window;
+        contents.settings[i].func = settings[i].func;
+        contents.settings[i].payload = settings[i].payload;
+    }
+    contents.known = true;
+}
+
+bool SPKTVOnePresets::storePreset(int preset, const SPKTVOne::queuedCommand *look, int count)
+{
+    if (preset < 1 || preset > presetCount) return false;
+    
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++)
+    {
+        ok = tvOne->command(look[i].channel, look[i].window, look[i].func, look[i].payload);
+    }
+    
+    ok = ok && tvOne->storePreset(preset);
+    
+    if (ok) setPresetContents(preset, look, count);
+    else    forgetPreset(preset);
+    
+    return ok;
+}
+
+bool SPKTVOnePresets::learnPreset(int preset, const SPKTVOne::queuedCommand *settings, int count)
+{
+    if (preset < 1 || preset > presetCount || count > presetSettingsLength) return false;
+    
+    uint64_t startUs = tvOne->timeUs();
+    if (!tvOne->loadPreset(preset)) return false;
+    presetLoadCostUs = tvOne->timeUs() - startUs;
+    
+    // TASK: Read back each setting asked about, which is what the preset holds for it
+    SPKTVOne::queuedCommand learnt[presetSettingsLength] = {};
+    for (int i = 0; i < count; i++)
+    {
+        learnt[i] = settings[i];
+        if (!tvOne->readCommand(settings[i].channel, settings[i].window, settings[i].func, learnt[i].payload))
+        {
+            forgetPreset(preset);
+            return false;
+        }
+    }
+    
+    setPresetContents(preset, learnt, count);
+    
+    return true;
+}
+
+void SPKTVOnePresets::forgetPreset(int preset)
+{
+    if (preset < 1 || preset > presetCount) return;
+    
+    presets[preset - 1].known = false;
+    presets[preset - 1].count = 0;
+}
+
+bool SPKTVOnePresets::needsWrite(const presetType *preset, const SPKTVOne::queuedCommand &setting)
+{
+    // After a load, what the preset is known to set. Otherwise, what the state cache knows is set now.
+    if (preset)
+    {
+        for (int i = 0; i < preset->count; i++)
+        {
+            const settingType &held = preset->settings[i];
+            if (held.channel == setting.channel && held.window == setting.window && held.func == setting.func) return held.payload != setting.payload;
+        }
+        return true;
+    }
+    
+    int32_t current;
+    return !tvOne->cachedValue(setting.channel, setting.window, setting.func, current) || current != setting.payload;
+}
+
+int SPKTVOnePresets::patchCount(const presetType *preset, const SPKTVOne::queuedCommand *look, int count)
+{
+    int writes = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (needsWrite(preset, look[i])) writes++;
+    }
+    return writes;
+}
+
+bool SPKTVOnePresets::recall(const SPKTVOne::queuedCommand *look, int count)
+{
+    // TASK: Cost each plan, writing directly and via each known preset
+    
+    int bestPreset = 0;
+    uint64_t bestCostUs = (uint64_t)patchCount(NULL, look, count) * writeCostUs;
+    
+    for (int i = 0; i < presetCount; i++)
+    {
+        if (!presets[i].known) continue;
+        
+        int writes = patchCount(&presets[i], look, count);
+        uint64_t costUs = presetLoadCostUs + (uint64_t)writes * writeCostUs;
+        if (costUs < bestCostUs)
+        {
+            bestPreset = i + 1;
+            bestCostUs = costUs;
+        }
+    }
+    
+    // TASK: Run it, learning costs as we go
+    
+    uint64_t startUs = tvOne->timeUs();
+    bool ok = true;
+    
+    if (bestPreset)
+    {
+        presetType &preset = presets[bestPreset - 1];
+        SPKTVOne::queuedCommand contents[presetSettingsLength] = {};
+        for (int i = 0; i < preset.count; i++)
+        {
+            contents[i].channel = preset.settings[i].channel;
+            contents[i].window = preset.settings[i].window;
+            contents[i].func = preset.settings[i].func;
+            contents[i].payload = preset.settings[i].payload;
+        }
+        
+        ok = tvOne->loadPreset(bestPreset, contents, preset.count);
+        
+        uint32_t loadUs = tvOne->timeUs() - startUs;
+        presetLoadCostUs = presetLoadCostUs + ((int32_t)loadUs - (int32_t)presetLoadCostUs) / 4;
+        recallStats.presetLoads++;
+    }
+    
+    // Having loaded, the state cache holds the preset's contents, so patching is the same as writing directly
+    uint64_t writesStartUs = tvOne->timeUs();
+    int written = 0;
+    for (int i = 0; i < count && ok; i++)
+    {
+        if (!needsWrite(NULL, look[i])) continue;
+        
+        ok = tvOne->command(look[i].channel, look[i].window, look[i].func, look[i].payload);
+        written++;
+    }
+    
+    if (written)
+    {
+        uint32_t perWriteUs = (tvOne->timeUs() - writesStartUs) / written;
+        writeCostUs = writeCostUs + ((int32_t)perWriteUs - (int32_t)writeCostUs) / 4;
+    }
+    
+    // TASK: Log predicted versus actual
+    
+    int actualMs = (tvOne->timeUs() - startUs) / 1000;
+    int predictedMs = bestCostUs / 1000;
+    
+    recallStats.recalls++;
+    recallStats.writes += written;
+    recallStats.lastPreset = bestPreset;
+    recallStats.lastPredictedMs = predictedMs;
+    recallStats.lastActualMs = actualMs;
+    recallStats.totalAbsErrorMs += (actualMs > predictedMs) ? actualMs - predictedMs : predictedMs - actualMs;
+    recallStats.presetLoadMs = presetLoadCostUs / 1000;
+    recallStats.writeMs = writeCostUs / 1000;
+    
+    if (debug)
+    {
+        if (bestPreset) debug->printf("TVOne recall of %i settings: preset %i then %i writes, predicted %ims, took %ims%s \r\n", count, bestPreset, written, predictedMs, actualMs, ok ? "" : ", failed");
+        else            debug->printf("TVOne recall of %i settings: %i writes, predicted %ims, took %ims%s \r\n", count, written, predictedMs, actualMs, ok ? "" : ", failed");
+    }
+    
+    return ok;
+}
+
+SPKTVOnePresets::recallStatsType SPKTVOnePresets::getRecallStats()
+{
+    return recallStats;
+}
+
+void SPKTVOnePresets::resetRecallStats()
+{
+    memset(&recallStats, 0, sizeof(recallStats));
+}
@@ -0,0 +1,72 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Preset recall: chooses between loading a hardware preset and writing settings directly, by measured cost
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// A look is a list of settings, as queued commands. Recalling one compares two kinds of plan:
+// - write whatever the state cache doesn't already show as set
+// - load the hardware preset closest to the look, then write whatever that preset doesn't set the same
+// and runs whichever is predicted cheapest. Presets are candidates once their contents are known: set, stored from a look, or learnt by
+// loading and reading back. Costs start from the command periods, and learn from every load and write.
+// Predicted and actual recall times are logged to debug and kept in the stats.
+
+#ifndef SPKTVOne_Presets_h
+#define SPKTVOne_Presets_h
+
+#include "spk_tvone_mbed.h"
+
+class SPKTVOnePresets
+{
+  public:
+    SPKTVOnePresets(SPKTVOne *tvOne, Serial *debugSerial = NULL);
+    
+    static const int presetCount = 10;
+    static const int presetSettingsLength = 32;
+    
+    void setPresetContents(int preset, const SPKTVOne::queuedCommand *settings, int count);
+    bool storePreset(int preset, const SPKTVOne::queuedCommand *look, int count);
+    bool learnPreset(int preset, const SPKTVOne::queuedCommand *settings, int count);
+    void forgetPreset(int preset);
+    
+    bool recall(const SPKTVOne::queuedCommand *look, int count);
+    
+    // Preset 0 means the last recall wrote directly
+    struct recallStatsType {int recalls; int presetLoads; int writes; int lastPreset; int lastPredictedMs; int lastActualMs; int totalAbsErrorMs; int presetLoadMs; int writeMs;};
+    recallStatsType getRecallStats();
+    void resetRecallStats();
+    
+  private:
+    // Compact, as there's a full set per preset
+    struct settingType {uint8_t channel; uint8_t window; uint16_t func; int32_t payload;};
+    struct presetType {bool known; int count; settingType settings[presetSettingsLength];};
+    presetType presets[presetCount];
+    
+    uint32_t presetLoadCostUs;
+    uint32_t writeCostUs;
+    
+    int  patchCount(const presetType *preset, const SPKTVOne::queuedCommand *look, int count);
+    bool needsWrite(const presetType *preset, const SPKTVOne::queuedCommand &setting);
+    
+    SPKTVOne *tvOne;
+    Serial *debug;
+    recallStatsType recallStats;
+};
+
+#endif
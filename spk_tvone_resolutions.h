@@ -0,0 +1,140 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Resolution table: number, name and size of the kTV1Resolution presets, for text front-ends and layout maths
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SPKTVOne_Resolutions_h
+#define SPKTVOne_Resolutions_h
+
+#include <string.h>
+
+#include "spk_tvone.h"
+
+// Resolution numbers depend on the firmware selected in spk_tvone.h, so this table follows its branches. Some numbers are shared
+// between names on some firmware (eg. 1080p60 and WUXGAp85 on v415), so lookup by number only answers when exactly one entry has it.
+
+struct SPKTVOneResolution
+{
+    int number;
+    int width;
+    int height;
+    const char *name;
+};
+
+constexpr SPKTVOneResolution kTV1Resolutions[] = 
+{
+    {kTV1ResolutionVGA, 640, 480, "VGA"},
+    {kTV1ResolutionNTSC, 720, 480, "NTSC"},
+    {kTV1ResolutionPAL, 720, 576, "PAL"},
+    {kTV1ResolutionSVGA, 800, 600, "SVGA"},
+    {kTV1ResolutionXGAp5994, 1024, 768, "XGAp5994"},
+    {kTV1ResolutionXGAp60, 1024, 768, "XGAp60"},
+    {kTV1ResolutionXGAp75, 1024, 768, "XGAp75"},
+    {kTV1Resolution720p2398, 1280, 720, "720p2398"},
+    {kTV1Resolution720p24, 1280, 720, "720p24"},
+    {kTV1Resolution720p25, 1280, 720, "720p25"},
+    {kTV1Resolution720p2997, 1280, 720, "720p2997"},
+    {kTV1Resolution720p30, 1280, 720, "720p30"},
+    {kTV1Resolution720p50, 1280, 720, "720p50"},
+    {kTV1Resolution720p5994, 1280, 720, "720p5994"},
+    {kTV1Resolution720p60, 1280, 720, "720p60"},
+    {kTV1ResolutionWXGA5by3p60, 1280, 768, "WXGA5by3p60"},
+    {kTV1ResolutionWXGA5by3p75, 1280, 768, "WXGA5by3p75"},
+    {kTV1ResolutionWXGA16by10p60, 1280, 800, "WXGA16by10p60"},
+    {kTV1ResolutionWXGA16by10p75, 1280, 800, "WXGA16by10p75"},
+    {kTV1ResolutionSGAp60, 1280, 1024, "SGAp60"},
+    {kTV1ResolutionSGAp75, 1280, 1024, "SGAp75"},
+    {kTV1ResolutionWSXGAp60, 1440, 900, "WSXGAp60"},
+#if defined kTV1Firmware415
+    {kTV1ResolutionUXGAp60, 1600, 1200, "UXGAp60"},
+    {kTV1ResolutionUXGAp75, 1600, 1200, "UXGAp75"},
+    {kTV1ResolutionUXGAp85, 1600, 1200, "UXGAp85"},
+    {kTV1ResolutionWSXGAPLUSp60, 1680, 1050, "WSXGAPLUSp60"},
+    {kTV1Resolution1080p60, 1920, 1080, "1080p60"},
+    {kTV1Resolution1080p75, 1920, 1080, "1080p75"},
+    {kTV1ResolutionWUXGAp60, 1920, 1200, "WUXGAp60"},
+    {kTV1ResolutionWUXGAp75, 1920, 1200, "WUXGAp75"},
+    {kTV1ResolutionWUXGAp85, 1920, 1200, "WUXGAp85"},
+#elif defined kTV1FirmwareSPKDF
+    {kTV1ResolutionUXGAp60, 1600, 1200, "UXGAp60"},
+    {kTV1ResolutionUXGAp75, 1600, 1200, "UXGAp75"},
+    {kTV1ResolutionUXGAp85, 1600, 1200, "UXGAp85"},
+    {kTV1ResolutionWSXGAPLUSp60, 1680, 1050, "WSXGAPLUSp60"},
+    {kTV1Resolution1080p2398, 1920, 1080, "1080p2398"},
+    {kTV1Resolution1080p24, 1920, 1080, "1080p24"},
+    {kTV1Resolution1080p25, 1920, 1080, "1080p25"},
+    {kTV1Resolution1080p2997, 1920, 1080, "1080p2997"},
+    {kTV1Resolution1080p30, 1920, 1080, "1080p30"},
+    {kTV1Resolution1080p50, 1920, 1080, "1080p50"},
+    {kTV1Resolution1080p5996, 1920, 1080, "1080p5996"},
+    {kTV1Resolution1080p60, 1920, 1080, "1080p60"},
+    {kTV1Resolution1080p75, 1920, 1080, "1080p75"},
+    {kTV1ResolutionWUXGAp60, 1920, 1200, "WUXGAp60"},
+    {kTV1ResolutionWUXGAp75, 1920, 1200, "WUXGAp75"},
+    {kTV1ResolutionWUXGAp85, 1920, 1200, "WUXGAp85"},
+    {kTV1ResolutionDualHeadSVGAp60, 1600, 600, "DualHeadSVGAp60"},
+    {kTV1ResolutionDualHeadXGAp60, 2048, 768, "DualHeadXGAp60"},
+    {kTV1ResolutionTripleHeadVGAp60, 1920, 480, "TripleHeadVGAp60"},
+#else
+    {kTV1Resolution1080p2398, 1920, 1080, "1080p2398"},
+    {kTV1Resolution1080p24, 1920, 1080, "1080p24"},
+    {kTV1Resolution1080p25, 1920, 1080, "1080p25"},
+    {kTV1Resolution1080p2997, 1920, 1080, "1080p2997"},
+    {kTV1Resolution1080p30, 1920, 1080, "1080p30"},
+    {kTV1Resolution1080p50, 1920, 1080, "1080p50"},
+    {kTV1Resolution1080p5996, 1920, 1080, "1080p5996"},
+    {kTV1Resolution1080p60, 1920, 1080, "1080p60"},
+    {kTV1Resolution1080p75, 1920, 1080, "1080p75"},
+    {kTV1ResolutionWUXGAp60, 1920, 1200, "WUXGAp60"},
+    {kTV1ResolutionWUXGAp75, 1920, 1200, "WUXGAp75"},
+    {kTV1ResolutionWUXGAp85, 1920, 1200, "WUXGAp85"},
+#endif
+    {kTV1Resolution2Kp60, 2048, 1080, "2Kp60"},
+    {kTV1ResolutionDoubleWXGA, 2880, 900, "DoubleWXGA"}
+};
+
+constexpr int kTV1ResolutionCount = sizeof(kTV1Resolutions) / sizeof(kTV1Resolutions[0]);
+
+// NULL for a number this firmware doesn't list, or lists under two names, so the caller reads the geometry from the unit instead
+inline const SPKTVOneResolution* kTV1ResolutionDescriptor(int number)
+{
+    const SPKTVOneResolution *found = NULL;
+    for (int i = 0; i < kTV1ResolutionCount; i++)
+    {
+        if (kTV1Resolutions[i].number != number) continue;
+        if (found) return NULL;
+        found = &kTV1Resolutions[i];
+    }
+    
+    return found;
+}
+
+// Takes the name without the kTV1Resolution prefix, eg. "1080p60"
+inline const SPKTVOneResolution* kTV1ResolutionNamed(const char *name)
+{
+    for (int i = 0; i < kTV1ResolutionCount; i++)
+    {
+        if (strcmp(kTV1Resolutions[i].name, name) == 0) return &kTV1Resolutions[i];
+    }
+    
+    return NULL;
+}
+
+#endif
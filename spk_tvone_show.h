@@ -0,0 +1,168 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Show format: cues compiled ahead of time into the exact frames the unit is sent
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SPKTVOne_Show_h
+#define SPKTVOne_Show_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// A write command goes over RS232 as 20 characters of ASCII: F, eight bytes as hex, their checksum as hex, then CR.
+// The bytes are: command, channel, window, function (2), payload (3)
+
+#define kTV1FrameLength                 20
+#define kTV1FrameFunctionOffset         7       // Where the 4 hex characters of the function sit, in reads, writes and their acks
+#define kTV1FramePayloadOffset          11      // Where the 6 hex characters of the payload sit, in both the frame and its ack
+#define kTV1ReadFrameLength             14      // A read is the same without the payload
+
+inline void kTV1EncodeWriteFrame(char *frame, uint8_t channel, uint8_t window, int32_t func, int32_t payload)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    
+    uint8_t cmd[9];
+    cmd[0] = 0 << 7 | 1 << 2;
+    cmd[1] = channel;
+    cmd[2] = window;
+    cmd[3] = func >> 8;
+    cmd[4] = func & 0xFF;
+    cmd[5] = (payload >> 16) & 0xFF;
+    cmd[6] = (payload >> 8) & 0xFF;
+    cmd[7] = payload & 0xFF;
+    cmd[8] = 0;
+    for (int i = 0; i < 8; i++) cmd[8] += cmd[i];
+    
+    frame[0] = 'F';
+    for (int i = 0; i < 9; i++)
+    {
+        frame[1 + i*2] = hex[cmd[i] >> 4];
+        frame[2 + i*2] = hex[cmd[i] & 0xF];
+    }
+    frame[19] = '\r';
+}
+
+inline int32_t kTV1FrameFunction(const char *frame)
+{
+    int32_t func = 0;
+    for (int i = kTV1FrameFunctionOffset; i < kTV1FrameFunctionOffset + 4; i++)
+    {
+        char c = frame[i];
+        func = (func << 4) | ((c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0);
+    }
+    
+    return func;
+}
+
+inline int kTV1EncodeReadFrame(char *frame, uint8_t channel, uint8_t window, int32_t func)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    
+    uint8_t cmd[6];
+    cmd[0] = 1 << 7 | 1 << 2;
+    cmd[1] = channel;
+    cmd[2] = window;
+    cmd[3] = func >> 8;
+    cmd[4] = func & 0xFF;
+    cmd[5] = 0;
+    for (int i = 0; i < 5; i++) cmd[5] += cmd[i];
+    
+    frame[0] = 'F';
+    for (int i = 0; i < 6; i++)
+    {
+        frame[1 + i*2] = hex[cmd[i] >> 4];
+        frame[2 + i*2] = hex[cmd[i] & 0xF];
+    }
+    frame[13] = '\r';
+    
+    return kTV1ReadFrameLength;
+}
+
+// A compiled show is one block of bytes, little-endian throughout, so it can sit in flash as a const array or be mapped from a file.
+//
+// Header, 8 bytes:     "TV1S", version, 0, cue count (2)
+// Cue table, 24 bytes per cue: first frame (4), frame count (2), 0, 0, name (16, NUL padded)
+// Frames, 20 bytes each, as sent
+
+#define kTV1ShowVersion                 1
+#define kTV1ShowHeaderLength            8
+#define kTV1ShowCueLength               24
+#define kTV1ShowCueNameLength           16
+
+inline uint32_t kTV1ShowRead(const uint8_t *bytes, int length)
+{
+    uint32_t value = 0;
+    for (int i = length - 1; i >= 0; i--) value = (value << 8) | bytes[i];
+    return value;
+}
+
+inline void kTV1ShowWrite(uint8_t *bytes, uint32_t value, int length)
+{
+    for (int i = 0; i < length; i++) bytes[i] = (value >> (8*i)) & 0xFF;
+}
+
+inline int kTV1ShowCueCount(const uint8_t *show)
+{
+    return kTV1ShowRead(show + 6, 2);
+}
+
+// Checks the header and that every cue's frames lie within the show. Do this once when a show is loaded, not per cue.
+inline bool kTV1ShowIsValid(const uint8_t *show, size_t length)
+{
+    if (length < kTV1ShowHeaderLength || memcmp(show, "TV1S", 4) != 0 || show[4] != kTV1ShowVersion) return false;
+    
+    size_t framesStart = kTV1ShowHeaderLength + (size_t)kTV1ShowCueCount(show) * kTV1ShowCueLength;
+    if (framesStart > length) return false;
+    
+    for (int i = 0; i < kTV1ShowCueCount(show); i++)
+    {
+        const uint8_t *cue = show + kTV1ShowHeaderLength + i * kTV1ShowCueLength;
+        size_t end = framesStart + ((size_t)kTV1ShowRead(cue, 4) + kTV1ShowRead(cue + 4, 2)) * kTV1FrameLength;
+        if (end > length) return false;
+    }
+    
+    return true;
+}
+
+// Returns the cue's first frame and sets frameCount, or NULL if there's no such cue
+inline const char* kTV1ShowCueFrames(const uint8_t *show, int cueIndex, int &frameCount)
+{
+    if (cueIndex < 0 || cueIndex >= kTV1ShowCueCount(show)) return NULL;
+    
+    const uint8_t *cue = show + kTV1ShowHeaderLength + cueIndex * kTV1ShowCueLength;
+    const uint8_t *frames = show + kTV1ShowHeaderLength + kTV1ShowCueCount(show) * kTV1ShowCueLength;
+    
+    frameCount = kTV1ShowRead(cue + 4, 2);
+    return (const char*)(frames + kTV1ShowRead(cue, 4) * kTV1FrameLength);
+}
+
+inline int kTV1ShowCueNamed(const uint8_t *show, const char *name)
+{
+    for (int i = 0; i < kTV1ShowCueCount(show); i++)
+    {
+        const char *cueName = (const char*)(show + kTV1ShowHeaderLength + i * kTV1ShowCueLength + 8);
+        if (strncmp(cueName, name, kTV1ShowCueNameLength) == 0) return i;
+    }
+    
+    return -1;
+}
+
+#endif
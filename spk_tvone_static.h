@@ -0,0 +1,334 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Header-only, allocation-free variant of SPKTVOne, configured at compile time
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// SPKTVOneStatic<Transport, Config> is the core of SPKTVOne for deployments that know their setup at build time.
+// Everything is sized by Config, so there's no heap and no variable length arrays. The transport is a member, not allocated.
+// Sign pins and debug output are only compiled in when Config asks for them. Periods and lengths are constants, not members.
+// There's no queue, keyer or geometry cache, and waits poll the transport rather than sleeping, eg.
+//
+// struct RigConfig : SPKTVOneStaticConfig { static const int minimumMs = 20; static const bool signPins = true; };
+// SPKTVOneStatic<Serial, RigConfig> tvOne(p9, p10, LED3, LED4);
+
+#ifndef SPKTVOne_Static_h
+#define SPKTVOne_Static_h
+
+#include <ctype.h>
+#include <stdio.h>
+
+#include "spk_tvone.h"
+#include "spk_tvone_functions.h"
+#include "spk_tvone_show.h"
+
+#if defined(SPK_TVONE_POSIX)
+#include "spk_tvone_posix.h"
+#else
+#include "mbed.h"
+#endif
+
+// Derive from this and hide whatever differs
+struct SPKTVOneStaticConfig
+{
+    static const int  baud = kTV1BaudDefault;
+    static const int  minimumMs = kTV1CommandMinimumMillis;
+    static const int  timeoutMs = kTV1CommandTimeoutMillis;
+    static const int  ackLength = kTV1FrameLength;
+    static const int  uploadMinimumMs = 100;
+    static const int  uploadTimeoutMs = 300;
+    static const int  uploadChunkSize = 32;
+    static const int  uploadAckLength = 4;
+    static const bool signPins = false;
+    static const bool debug = false;
+};
+
+template <bool enabled> struct SPKTVOneStaticPins
+{
+    SPKTVOneStaticPins(PinName writePin, PinName errorPin) : writeDO(writePin), errorDO(errorPin) {}
+    void signWrite(int value) { writeDO = value; }
+    void signError(int value) { errorDO = value; }
+    DigitalOut writeDO;
+    DigitalOut errorDO;
+};
+
+template <> struct SPKTVOneStaticPins<false>
+{
+    SPKTVOneStaticPins(PinName, PinName) {}
+    void signWrite(int) {}
+    void signError(int) {}
+};
+
+template <bool enabled> struct SPKTVOneStaticDebug
+{
+    SPKTVOneStaticDebug(Serial *debugSerial) : serial(debugSerial) {}
+    template <typename... Args> void printf(const char *format, Args... args) { if (serial) serial->printf(format, args...); }
+    Serial *serial;
+};
+
+template <> struct SPKTVOneStaticDebug<false>
+{
+    SPKTVOneStaticDebug(Serial *) {}
+    template <typename... Args> void printf(const char *, Args...) {}
+};
+
+template <typename Transport, typename Config = SPKTVOneStaticConfig>
+class SPKTVOneStatic
+{
+    static_assert(Config::ackLength == kTV1FrameLength, "TVOne acks are a full frame");
+    static_assert(Config::uploadChunkSize > 0 && Config::uploadChunkSize <= 249, "TVOne upload chunk must fit the length byte");
+    
+  public:
+    SPKTVOneStatic(PinName txPin, PinName rxPin, PinName signWritePin = NC, PinName signErrorPin = NC, Serial *debugSerial = NULL)
+        : serial(txPin, rxPin), pins(signWritePin, signErrorPin), debug(debugSerial)
+    {
+        serial.baud(Config::baud);
+        lastCommandSentUs = us_ticker_read() - Config::timeoutMs * 1000;
+    }
+    
+    bool command(uint8_t channel, uint8_t window, int32_t func, int32_t payload)
+    {
+        const char *error = kTV1FunctionWriteError(channel, window, func, payload);
+        if (error)
+        {
+            debug.printf("TVOne command rejected, %s. Channel: %#x, Window: %#x, Function: %#x Payload: %i \r\n", error, channel, window, func, payload);
+            return false;
+        }
+        
+        char frame[kTV1FrameLength];
+        kTV1EncodeWriteFrame(frame, channel, window, func, payload);
+        
+        return sendFrame(frame, kTV1FrameLength);
+    }
+    
+    bool readCommand(uint8_t channel, uint8_t window, int32_t func, int32_t &payload)
+    {
+        char frame[kTV1ReadFrameLength];
+        kTV1EncodeReadFrame(frame, channel, window, func);
+        
+        if (!sendFrame(frame, kTV1ReadFrameLength)) return false;
+        
+        // The payload comes back as 24 bits, so restore the sign for functions that take negative values
+        payload = 0;
+        for (int i = kTV1FramePayloadOffset; i < kTV1FramePayloadOffset + 6; i++) payload = (payload << 4) | hexValue(ack[i]);
+        
+        const SPKTVOneFunction *descriptor = kTV1FunctionDescriptor(func);
+        if (descriptor && descriptor->minimum < 0 && (payload & 0x800000)) payload -= 0x1000000;
+        
+        return true;
+    }
+    
+    template <int32_t func, int32_t payload> bool set(uint8_t channel, uint8_t window)
+    {
+        static_assert(kTV1FunctionIsWritable(func), "TVOne function is read only");
+        static_assert(kTV1FunctionInRange(func, payload), "TVOne payload is out of range for function");
+        return command(channel, window, func, payload);
+    }
+    template <int32_t func> bool set(uint8_t channel, uint8_t window, int32_t payload)
+    {
+        static_assert(kTV1FunctionIsWritable(func), "TVOne function is read only");
+        return command(channel, window, func, payload);
+    }
+    
+    // As SPKTVOne::runCue, stopping at the first frame not acknowledged with the payload it was sent
+    bool runCue(const uint8_t *show, int cueIndex)
+    {
+        int frameCount = 0;
+        const char *frames = kTV1ShowCueFrames(show, cueIndex, frameCount);
+        if (!frames) return false;
+        
+        for (int i = 0; i < frameCount; i++)
+        {
+            const char *frame = frames + i * kTV1FrameLength;
+            
+            // Resolution changes and their EDID writes get SPKTVOne::setResolution's retries, each allowing 500ms more
+            int32_t func = kTV1FrameFunction(frame);
+            int attempts = (func == kTV1FunctionAdjustOutputsOutputResolution || func == kTV1FunctionAdjustSourceEDID) ? 3 : 1;
+            
+            bool success = false;
+            for (int attempt = 0; attempt < attempts && !success; attempt++)
+            {
+                success = sendFrame(frame, kTV1FrameLength, attempt * 500);
+                
+                for (int j = kTV1FramePayloadOffset; success && j < kTV1FramePayloadOffset + 6; j++)
+                {
+                    if (toupper(ack[j]) != frame[j]) success = false;
+                }
+            }
+            if (!success) return false;
+        }
+        
+        return true;
+    }
+    
+    bool uploadEDID(FILE *file, int edidSlotIndex)
+    {
+        return uploadFile(0x07, file, 256, edidSlotIndex);
+    }
+    
+    bool uploadImage(FILE *file, int sisIndex)
+    {
+        fseek(file, 0, SEEK_END);
+        int imageDataLength = (int)ftell(file);
+        
+        debug.printf("Upload Image with length %i to index %i \r\n", imageDataLength, sisIndex);
+        
+        return uploadFile(0x00, file, imageDataLength, sisIndex);
+    }
+    
+    int millisSinceLastCommandSent()
+    {
+        return (us_ticker_read() - lastCommandSentUs) / 1000;
+    }
+    
+  private:
+    Transport serial;
+    SPKTVOneStaticPins<Config::signPins> pins;
+    SPKTVOneStaticDebug<Config::debug> debug;
+    
+    // 32 bit microseconds. Only ever compared as time elapsed since, unsigned, which holds across a wrap however long the link sat idle.
+    uint32_t lastCommandSentUs;
+    char ack[Config::ackLength];
+    
+    static int hexValue(char c)
+    {
+        return (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0;
+    }
+    
+    static bool within(uint32_t sinceUs, uint32_t periodUs)
+    {
+        return (uint32_t)(us_ticker_read() - sinceUs) < periodUs;
+    }
+    
+    void prepare(int minimumMs)
+    {
+        pins.signWrite(1);
+        while (within(lastCommandSentUs, minimumMs * 1000u)) {}
+        while (serial.readable()) serial.getc();
+    }
+    
+    void finish(bool success)
+    {
+        pins.signWrite(0);
+        pins.signError(success ? 0 : 1);
+    }
+    
+    // As SPKTVOne::sendFrame: framed on CR, so a short or stale ack is dropped and listening goes on for ours
+    bool sendFrame(const char *frame, int frameLength, int extraMs = 0)
+    {
+        prepare(Config::minimumMs + extraMs);
+        
+        for (int i = 0; i < frameLength; i++) serial.putc(frame[i]);
+        lastCommandSentUs = us_ticker_read();
+        
+        uint32_t timeoutUs = (Config::timeoutMs + extraMs) * 1000u;
+        int  ackPos = 0;
+        bool skipToCR = false;
+        bool success = false;
+        
+        while (!success && within(lastCommandSentUs, timeoutUs))
+        {
+            if (!serial.readable()) continue;
+            char c = serial.getc();
+            
+            if (skipToCR)
+            {
+                if (c == '\r') skipToCR = false;
+                continue;
+            }
+            if (ackPos == 0 && c != 'F') continue;
+            
+            ack[ackPos++] = c;
+            
+            bool ended = (c == '\r');
+            if (!ended && ackPos < Config::ackLength) continue;
+            
+            success = ended && ackPos == Config::ackLength && ack[1] == '4';
+            for (int i = kTV1FrameFunctionOffset; success && i < kTV1FrameFunctionOffset + 4; i++)
+            {
+                if (toupper(ack[i]) != toupper(frame[i])) success = false;
+            }
+            skipToCR = !ended;
+            ackPos = 0;
+        }
+        
+        finish(success);
+        
+        if (!success) debug.printf("TVOne serial error. Frame: %.*s \r\n", frameLength - 1, frame);
+        
+        return success;
+    }
+    
+    // The reverse engineered 'S' command, see SPKTVOne::uploadFile. The chunk buffer is sized by Config, not the stack.
+    bool uploadFile(char instruction, FILE *file, int dataLength, int index)
+    {
+        static const char goodAck[Config::uploadAckLength] = {0x53, 0x02, 0x40, (char)0x95};
+        char command[8 + Config::uploadChunkSize + 1];
+        
+        fseek(file, 0, SEEK_SET);
+        
+        for (int i = 0; i < dataLength; i += Config::uploadChunkSize)
+        {
+            int chunkSize = (dataLength - i < Config::uploadChunkSize) ? dataLength - i : Config::uploadChunkSize;
+            int chunk = i / Config::uploadChunkSize;
+            
+            command[0] = 0x53;
+            command[1] = 6 + chunkSize + 1;
+            command[2] = 0x22;
+            command[3] = instruction;
+            command[4] = index;
+            command[5] = 0;
+            command[6] = chunk & 0xFF;
+            command[7] = (chunk >> 8) & 0xFF;
+            
+            for (int j = 0; j < chunkSize; j++)
+            {
+                int data = fgetc(file);
+                command[8 + j] = (data == EOF) ? 0 : data;
+            }
+            command[8 + chunkSize] = 0x3F;
+            
+            prepare(Config::uploadMinimumMs);
+            
+            // Always the full buffer, as SPKTVOne sends, whatever the chunk's length
+            for (int k = 0; k < (int)sizeof(command); k++) serial.putc(command[k]);
+            lastCommandSentUs = us_ticker_read();
+            
+            char uploadAck[Config::uploadAckLength];
+            int  ackPos = 0;
+            while (ackPos < Config::uploadAckLength && within(lastCommandSentUs, Config::uploadTimeoutMs * 1000u))
+            {
+                if (serial.readable()) uploadAck[ackPos++] = serial.getc();
+            }
+            
+            bool success = (ackPos == Config::uploadAckLength) && memcmp(uploadAck, goodAck, Config::uploadAckLength) == 0;
+            finish(success);
+            
+            if (!success)
+            {
+                debug.printf("Data Part write failed at chunk %i \r\n", chunk);
+                return false;
+            }
+        }
+        
+        return true;
+    }
+};
+
+#endif
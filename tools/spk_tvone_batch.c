@@ -0,0 +1,135 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Batch: checks the C interface end to end, a batch across two units completed through the eventfd
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool in C, so it sees only spk_tvone_c.h as a C app would, built with SPK_TVONE_POSIX defined so an mbed build skips it, eg.
+// cc -std=c99 -DSPK_TVONE_POSIX -I. -c tools/spk_tvone_batch.c 
+// g++ -std=c++11 -pthread -DSPK_TVONE_POSIX -I. -o spk_tvone_batch spk_tvone_batch.o spk_tvone_mbed.cpp spk_tvone_posix.cpp spk_tvone_c.cpp
+//
+// spk_tvone_batch <port> <port>
+//
+// Submits a batch of verified and fast writes across both units, each read back at the end, and a record for a unit that 
+// wasn't opened. Then a second batch straight after, before the first has completed. Polls the completion fd, and reaps 
+// until both tags are back, checking every result is as expected. Run by make check, against stand-ins.
+
+#if defined(SPK_TVONE_POSIX)
+
+#include "spk_tvone_c.h"
+#include "spk_tvone.h"
+
+#include <poll.h>
+#include <stdio.h>
+
+#define kBatchWrites    8
+#define kBatchRecords   (kBatchWrites + 3)
+
+static void setRecord(SPKTVOneBatchRecord *record, uint32_t unit, uint16_t flags, int32_t func, int32_t payload)
+{
+    record->unit = unit;
+    record->channel = 0;
+    record->window = kTV1WindowIDA;
+    record->flags = flags;
+    record->func = func;
+    record->payload = payload;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <port> <port>\n", argv[0]);
+        return 2;
+    }
+    
+    const char *const ports[2] = {argv[1], argv[2]};
+    SPKTVOneHost *host = spkTVOneOpen(ports, 2);
+    if (!host)
+    {
+        fprintf(stderr, "couldn't open %s and %s\n", argv[1], argv[2]);
+        return 1;
+    }
+    
+    // Zoom on each unit, alternating verified and fast, each unit's last value read back, then one for a unit we don't have
+    SPKTVOneBatchRecord records[kBatchRecords];
+    SPKTVOneBatchResult results[kBatchRecords];
+    
+    for (int i = 0; i < kBatchWrites; i++)
+    {
+        setRecord(&records[i], i % 2, (i / 2 % 2) ? kSPKTVOneBatchFast : 0, kTV1FunctionAdjustWindowsZoomLevel, 100 + 10 * i);
+    }
+    setRecord(&records[kBatchWrites], 0, kSPKTVOneBatchRead, kTV1FunctionAdjustWindowsZoomLevel, 0);
+    setRecord(&records[kBatchWrites + 1], 1, kSPKTVOneBatchRead, kTV1FunctionAdjustWindowsZoomLevel, 0);
+    setRecord(&records[kBatchWrites + 2], 2, 0, kTV1FunctionAdjustWindowsZoomLevel, 100);
+    
+    SPKTVOneBatchRecord second;
+    SPKTVOneBatchResult secondResult;
+    setRecord(&second, 1, 0, kTV1FunctionAdjustWindowsZoomPanH, 25);
+    
+    if (spkTVOneSubmit(host, records, results, kBatchRecords, 1) != 0 || spkTVOneSubmit(host, &second, &secondResult, 1, 2) != 0)
+    {
+        fprintf(stderr, "submit refused\n");
+        spkTVOneClose(host);
+        return 1;
+    }
+    
+    // Reap as an event loop would, waking on the completion fd
+    struct pollfd completion = {spkTVOneCompletionFd(host), POLLIN, 0};
+    uint64_t tags[2] = {0, 0};
+    int reaped = 0;
+    
+    while (reaped < 2)
+    {
+        if (poll(&completion, 1, 5000) != 1)
+        {
+            fprintf(stderr, "timed out waiting for completion, %i batches reaped\n", reaped);
+            spkTVOneClose(host);
+            return 1;
+        }
+        reaped += spkTVOneReap(host, tags + reaped, 2 - reaped);
+    }
+    
+    spkTVOneClose(host);
+    
+    // Writes all acked, each unit reads back its last write, the record for unit 2 refused, and both tags back.
+    // Batches complete as their last unit finishes, so the second may beat the first.
+    int failed = 0;
+    for (int i = 0; i < kBatchWrites; i++)
+    {
+        if (results[i].ok != 1) failed++;
+    }
+    
+    int32_t readA = results[kBatchWrites].payload;
+    int32_t readB = results[kBatchWrites + 1].payload;
+    int32_t lastA = records[kBatchWrites - 2].payload;
+    int32_t lastB = records[kBatchWrites - 1].payload;
+    
+    int readsOk = results[kBatchWrites].ok == 1 && results[kBatchWrites + 1].ok == 1 && readA == lastA && readB == lastB;
+    int refusedOk = results[kBatchWrites + 2].ok == -1;
+    int tagsOk = ((tags[0] == 1 && tags[1] == 2) || (tags[0] == 2 && tags[1] == 1)) && secondResult.ok == 1;
+    
+    printf("batch:   %i writes, %i failed, read back %i and %i of %i and %i, unknown unit %s\n", 
+           kBatchWrites, failed, (int)readA, (int)readB, (int)lastA, (int)lastB, refusedOk ? "refused" : "not refused");
+    printf("reaped:  tags %llu, %llu\n", (unsigned long long)tags[0], (unsigned long long)tags[1]);
+    
+    return (failed == 0 && readsOk && refusedOk && tagsOk) ? 0 : 1;
+}
+
+#endif
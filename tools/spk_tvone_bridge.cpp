@@ -0,0 +1,360 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Bridge: takes OSC over UDP from lighting desks and media servers, and drives units through the library
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -pthread -DSPK_TVONE_POSIX -I. -o spk_tvone_bridge tools/spk_tvone_bridge.cpp spk_tvone_mbed.cpp spk_tvone_posix.cpp
+//
+// spk_tvone_bridge [-P udp port] [-m minimum period ms] [-s stats seconds] <port> [<port> ...]
+//
+// Each port is a unit, numbered from 0 in the order given. Messages, each with an optional int tag the reply echoes:
+//   /tv1/write  unit channel window function payload [tag]  ->  /tv1/ack   tag ok unit channel window function payload
+//   /tv1/read   unit channel window function [tag]          ->  /tv1/value tag ok unit channel window function payload
+// The function is its ID, or its name as kTV1FunctionNamed takes, eg. "AdjustWindowsZoomLevel". Bundles are unpacked in order.
+// Replies go back to the sender once the unit has acked, or failed.
+//
+// Each unit has its own thread, sending whatever arrived while it was busy with the last batch. Within a batch, writes to the
+// same state function and window coalesce so only the latest payload is sent, and everyone who asked for it gets that ack.
+// Triggers, and anything relative to the resolution being adjusted, are always sent as they came, and no write merges across them
+// or across a read of the same state.
+//
+// Load test against stand-ins, eg.
+// spk_tvone_standin -p /tmp/tv0 & spk_tvone_standin -p /tmp/tv1 & spk_tvone_bridge -s 1 /tmp/tv0 /tmp/tv1 & spk_tvone_bridgeload -u 2
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "spk_tvone_mbed.h"
+#include "spk_tvone_osc.h"
+
+struct pendingReply
+{
+    struct sockaddr_storage to;
+    socklen_t toLength;
+    int32_t tag;
+    uint64_t receivedNs;
+};
+
+struct pendingCommand
+{
+    bool read;
+    uint8_t channel;
+    uint8_t window;
+    int32_t func;
+    int32_t payload;
+    std::vector<pendingReply> replies;
+};
+
+struct unitType
+{
+    SPKTVOne *tvOne;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<pendingCommand> pending;
+    std::map<uint32_t, size_t> coalescable;     // Key to position in pending, for writes that can merge
+    std::thread thread;
+};
+
+struct statsType
+{
+    std::atomic<int> messagesIn;
+    std::atomic<int> commandsOut;
+    std::atomic<int> coalesced;
+    std::atomic<int> failed;
+    std::atomic<int> rejected;
+    std::mutex latencyLock;
+    int replies;
+    uint64_t totalLatencyNs;
+    uint64_t maxLatencyNs;
+};
+
+static int sock = -1;
+static std::atomic<bool> running(true);
+static statsType stats;
+
+static uint64_t timeNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void stop(int)
+{
+    running = false;
+}
+
+static void reply(const pendingReply &to, bool read, bool ok, int unit, const pendingCommand &command, int32_t payload)
+{
+    SPKOSCWriter writer;
+    writer.beginMessage(read ? "/tv1/value" : "/tv1/ack", "iiiiiii");
+    writer.addInt(to.tag);
+    writer.addInt(ok);
+    writer.addInt(unit);
+    writer.addInt(command.channel);
+    writer.addInt(command.window);
+    writer.addInt(command.func);
+    writer.addInt(payload);
+    
+    sendto(sock, writer.data, writer.length, 0, (const struct sockaddr*)&to.to, to.toLength);
+    
+    if (to.receivedNs)
+    {
+        uint64_t latency = timeNs() - to.receivedNs;
+        std::lock_guard<std::mutex> guard(stats.latencyLock);
+        stats.replies++;
+        stats.totalLatencyNs += latency;
+        if (latency > stats.maxLatencyNs) stats.maxLatencyNs = latency;
+    }
+}
+
+static void runUnit(unitType *unit, int index)
+{
+    while (running)
+    {
+        std::vector<pendingCommand> batch;
+        {
+            std::unique_lock<std::mutex> guard(unit->lock);
+            unit->wake.wait_for(guard, std::chrono::milliseconds(100), [unit] { return !unit->pending.empty() || !running; });
+            batch.swap(unit->pending);
+            unit->coalescable.clear();
+        }
+        
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+            pendingCommand &command = batch[i];
+            int32_t payload = command.payload;
+            
+            bool ok = command.read ? unit->tvOne->readCommand(command.channel, command.window, command.func, payload)
+                                   : unit->tvOne->command(command.channel, command.window, command.func, command.payload);
+            stats.commandsOut++;
+            if (!ok) stats.failed++;
+            
+            for (size_t j = 0; j < command.replies.size(); j++) reply(command.replies[j], command.read, ok, index, command, payload);
+        }
+    }
+}
+
+// Decodes one message and hands it to its unit. Anything malformed is dropped, anything for an unknown unit or function is refused.
+struct messageHandler
+{
+    std::vector<unitType*> *units;
+    struct sockaddr_storage from;
+    socklen_t fromLength;
+    uint64_t receivedNs;
+    
+    void operator()(SPKOSCMessage &message)
+    {
+        bool read = (strcmp(message.address, "/tv1/read") == 0);
+        if (!read && strcmp(message.address, "/tv1/write") != 0) return;
+        
+        stats.messagesIn++;
+        
+        int32_t unitIndex = 0, channel = 0, window = 0, func = -1, payload = 0, tag = 0;
+        const char *name = NULL;
+        
+        bool ok = spkOSCNextInt(message, unitIndex) && spkOSCNextInt(message, channel) && spkOSCNextInt(message, window);
+        if (ok && *message.types == 's') 
+        {
+            ok = spkOSCNextString(message, name);
+            const SPKTVOneFunction *descriptor = ok ? kTV1FunctionNamed(name) : NULL;
+            if (descriptor) func = descriptor->func;
+        }
+        else if (ok) ok = spkOSCNextInt(message, func);
+        if (ok && !read) ok = spkOSCNextInt(message, payload);
+        if (!ok) return;
+        if (*message.types == 'i') spkOSCNextInt(message, tag);
+        
+        pendingCommand command;
+        command.read = read;
+        command.channel = channel;
+        command.window = window;
+        command.func = func;
+        command.payload = payload;
+        
+        pendingReply to;
+        to.to = from;
+        to.toLength = fromLength;
+        to.tag = tag;
+        to.receivedNs = receivedNs;
+        
+        if (unitIndex < 0 || unitIndex >= (int)units->size() || func < 0)
+        {
+            stats.rejected++;
+            to.receivedNs = 0;
+            reply(to, read, false, unitIndex, command, payload);
+            return;
+        }
+        
+        unitType *unit = (*units)[unitIndex];
+        std::lock_guard<std::mutex> guard(unit->lock);
+        
+        // TASK: Coalesce state writes, keeping the first one's place in the batch
+        // Nothing merges across a read of the same key, or across any other write, which may be a trigger that acts on the state so far.
+        bool canCoalesce = !read && kTV1FunctionHasFlag(func, kTV1FunctionFlagCacheable) && 
+                           !kTV1FunctionHasFlag(func, kTV1FunctionFlagImageToAdjust) && !kTV1FunctionHasFlag(func, kTV1FunctionFlagTrigger);
+        uint32_t key = (uint32_t)channel << 24 | (uint32_t)window << 16 | (func & 0xFFFF);
+        
+        if (canCoalesce)
+        {
+            std::map<uint32_t, size_t>::iterator existing = unit->coalescable.find(key);
+            if (existing != unit->coalescable.end())
+            {
+                pendingCommand &merged = unit->pending[existing->second];
+                merged.payload = payload;
+                merged.replies.push_back(to);
+                stats.coalesced++;
+                return;
+            }
+            unit->coalescable[key] = unit->pending.size();
+        }
+        else if (read) unit->coalescable.erase(key);
+        else unit->coalescable.clear();
+        
+        command.replies.push_back(to);
+        unit->pending.push_back(command);
+        unit->wake.notify_one();
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    int udpPort = 7010;
+    int minimumMs = -1;
+    int statsSeconds = 0;
+    
+    int option;
+    while ((option = getopt(argc, argv, "P:m:s:")) != -1)
+    {
+        switch (option)
+        {
+            case 'P': udpPort = atoi(optarg); break;
+            case 'm': minimumMs = atoi(optarg); break;
+            case 's': statsSeconds = atoi(optarg); break;
+            default: optind = argc + 1;
+        }
+    }
+    
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-P udp port] [-m minimum period ms] [-s stats seconds] <port> [<port> ...]\n", argv[0]);
+        return 2;
+    }
+    
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(udpPort);
+    if (sock < 0 || bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        perror("bind");
+        return 1;
+    }
+    
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    std::vector<unitType*> units;
+    for (int i = optind; i < argc; i++)
+    {
+        unitType *unit = new unitType;
+        unit->tvOne = new SPKTVOne(argv[i], NC);
+        if (minimumMs >= 0) unit->tvOne->setCommandMinimumPeriod(minimumMs);
+        unit->thread = std::thread(runUnit, unit, (int)units.size());
+        units.push_back(unit);
+    }
+    
+    printf("Bridging %i units on UDP port %i\n", (int)units.size(), udpPort);
+    fflush(stdout);
+    
+    // TASK: Receive until stopped, reporting rates as we go
+    
+    messageHandler handler;
+    handler.units = &units;
+    
+    uint64_t statsAt = timeNs();
+    int lastIn = 0, lastOut = 0;
+    uint8_t packet[65536];
+    
+    while (running)
+    {
+        struct pollfd readable = {sock, POLLIN, 0};
+        if (poll(&readable, 1, 100) == 1)
+        {
+            handler.fromLength = sizeof(handler.from);
+            int length = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr*)&handler.from, &handler.fromLength);
+            handler.receivedNs = timeNs();
+            if (length > 0) spkOSCForEach(packet, length, handler);
+        }
+        
+        uint64_t now = timeNs();
+        if (statsSeconds && now - statsAt >= (uint64_t)statsSeconds * 1000000000)
+        {
+            double seconds = (now - statsAt) / 1e9;
+            int in = stats.messagesIn, out = stats.commandsOut;
+            
+            std::lock_guard<std::mutex> guard(stats.latencyLock);
+            printf("in %6.0f msg/s, out %5.0f cmd/s, coalesced %6i, failed %4i, refused %4i, latency mean %6.1fms max %6.1fms\n",
+                   (in - lastIn) / seconds, (out - lastOut) / seconds, (int)stats.coalesced, (int)stats.failed, (int)stats.rejected,
+                   stats.replies ? stats.totalLatencyNs / stats.replies / 1e6 : 0.0, stats.maxLatencyNs / 1e6);
+            fflush(stdout);
+            
+            stats.replies = 0;
+            stats.totalLatencyNs = 0;
+            stats.maxLatencyNs = 0;
+            lastIn = in;
+            lastOut = out;
+            statsAt = now;
+        }
+    }
+    
+    for (size_t i = 0; i < units.size(); i++)
+    {
+        units[i]->wake.notify_one();
+        units[i]->thread.join();
+        delete units[i]->tvOne;
+        delete units[i];
+    }
+    close(sock);
+    
+    return 0;
+}
+
+#endif
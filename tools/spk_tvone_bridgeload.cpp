@@ -0,0 +1,208 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Bridge load: drives spk_tvone_bridge with OSC writes at a set rate and measures the replies
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_bridgeload tools/spk_tvone_bridgeload.cpp
+//
+// spk_tvone_bridgeload [-a address] [-P udp port] [-u units] [-r messages/s] [-d seconds] [-k keys] [-b bundle size]
+//
+// Writes cycle through units and through k window settings on each, like a fader bank, so with few keys most coalesce.
+// Reports messages/s sent, acks/s back, how many were lost, and the send to ack latency.
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "spk_tvone_functions.h"
+#include "spk_tvone_osc.h"
+
+static uint64_t timeNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static const int32_t keyFunctions[] = 
+{
+    kTV1FunctionAdjustWindowsZoomLevel,
+    kTV1FunctionAdjustWindowsZoomPanH,
+    kTV1FunctionAdjustWindowsZoomPanV,
+    kTV1FunctionAdjustWindowsCropH,
+    kTV1FunctionAdjustWindowsCropV,
+    kTV1FunctionAdjustWindowsShrinkLevel,
+    kTV1FunctionAdjustWindowsShrinkPosH,
+    kTV1FunctionAdjustWindowsShrinkPosV
+};
+static const int keyFunctionCount = sizeof(keyFunctions) / sizeof(keyFunctions[0]);
+
+struct ackHandler
+{
+    std::vector<uint64_t> *sentNs;
+    std::vector<uint64_t> *latencies;
+    int failed;
+    
+    void operator()(SPKOSCMessage &message)
+    {
+        int32_t tag, ok;
+        if (strcmp(message.address, "/tv1/ack") != 0 || !spkOSCNextInt(message, tag) || !spkOSCNextInt(message, ok)) return;
+        if (tag < 0 || tag >= (int)sentNs->size() || (*sentNs)[tag] == 0) return;
+        
+        latencies->push_back(timeNs() - (*sentNs)[tag]);
+        (*sentNs)[tag] = 0;
+        if (!ok) failed++;
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    const char *host = "127.0.0.1";
+    int udpPort = 7010;
+    int units = 1;
+    int rate = 1000;
+    int seconds = 5;
+    int keys = 4;
+    int bundleSize = 1;
+    
+    int option;
+    while ((option = getopt(argc, argv, "a:P:u:r:d:k:b:")) != -1)
+    {
+        switch (option)
+        {
+            case 'a': host = optarg; break;
+            case 'P': udpPort = atoi(optarg); break;
+            case 'u': units = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'd': seconds = atoi(optarg); break;
+            case 'k': keys = atoi(optarg); break;
+            case 'b': bundleSize = atoi(optarg); break;
+            default: optind = argc + 1;
+        }
+    }
+    
+    if (optind != argc || units < 1 || rate < 1 || keys < 1 || keys > keyFunctionCount || bundleSize < 1 || bundleSize > 32)
+    {
+        fprintf(stderr, "usage: %s [-a address] [-P udp port] [-u units] [-r messages/s] [-d seconds] [-k keys, up to %i] [-b bundle size]\n", argv[0], keyFunctionCount);
+        return 2;
+    }
+    
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in bridge;
+    memset(&bridge, 0, sizeof(bridge));
+    bridge.sin_family = AF_INET;
+    bridge.sin_port = htons(udpPort);
+    if (sock < 0 || inet_pton(AF_INET, host, &bridge.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad address %s\n", host);
+        return 1;
+    }
+    
+    int total = rate * seconds;
+    std::vector<uint64_t> sentNs(total, 0);
+    std::vector<uint64_t> latencies;
+    latencies.reserve(total);
+    
+    ackHandler handler;
+    handler.sentNs = &sentNs;
+    handler.latencies = &latencies;
+    handler.failed = 0;
+    
+    // TASK: Send on schedule, reading acks in between, then give stragglers a second
+    
+    uint64_t start = timeNs();
+    uint64_t intervalNs = 1000000000ULL * bundleSize / rate;
+    uint8_t packet[2048];
+    int sent = 0;
+    
+    while (true)
+    {
+        uint64_t now = timeNs();
+        uint64_t nextSendNs = start + (uint64_t)(sent / bundleSize) * intervalNs;
+        bool sending = sent < total;
+        
+        if (!sending && now > start + (uint64_t)seconds * 1000000000 + 1000000000) break;
+        if (!sending && (int)latencies.size() == total) break;
+        
+        if (sending && now >= nextSendNs)
+        {
+            SPKOSCWriter writer;
+            if (bundleSize > 1) writer.beginBundle();
+            
+            for (int i = 0; i < bundleSize && sent < total; i++, sent++)
+            {
+                writer.beginMessage("/tv1/write", "iiiiii");
+                writer.addInt(sent % units);
+                writer.addInt(0);
+                writer.addInt(kTV1WindowIDA);
+                int32_t func = keyFunctions[(sent / units) % keys];
+                const SPKTVOneFunction *descriptor = kTV1FunctionDescriptor(func);
+                writer.addInt(func);
+                writer.addInt(descriptor ? descriptor->minimum + sent % (descriptor->maximum - descriptor->minimum + 1) : sent % 100);
+                writer.addInt(sent);
+                writer.endMessage();
+                sentNs[sent] = timeNs();
+            }
+            
+            sendto(sock, writer.data, writer.length, 0, (struct sockaddr*)&bridge, sizeof(bridge));
+            continue;
+        }
+        
+        int waitMs = sending ? (int)((nextSendNs > now) ? (nextSendNs - now) / 1000000 : 0) : 10;
+        struct pollfd readable = {sock, POLLIN, 0};
+        if (poll(&readable, 1, waitMs) == 1)
+        {
+            int length = recv(sock, packet, sizeof(packet), 0);
+            if (length > 0) spkOSCForEach(packet, length, handler);
+        }
+    }
+    
+    // TASK: Report
+    
+    double sendSeconds = seconds;
+    double elapsed = (timeNs() - start) / 1e9;
+    std::sort(latencies.begin(), latencies.end());
+    int acked = latencies.size();
+    
+    uint64_t totalNs = 0;
+    for (int i = 0; i < acked; i++) totalNs += latencies[i];
+    
+    printf("sent %i messages at %.0f msg/s to %i units, %i keys each, bundles of %i\n", total, total / sendSeconds, units, keys, bundleSize);
+    printf("acked %i (%.0f acks/s over %.2fs), %i failed, %i lost\n", acked, acked / elapsed, elapsed, handler.failed, total - acked);
+    if (acked)
+    {
+        printf("latency: mean %.1fms, median %.1fms, p99 %.1fms, max %.1fms\n", totalNs / acked / 1e6, 
+               latencies[acked / 2] / 1e6, latencies[(acked * 99) / 100] / 1e6, latencies[acked - 1] / 1e6);
+    }
+    
+    return (acked == total && handler.failed == 0) ? 0 : 1;
+}
+
+#endif
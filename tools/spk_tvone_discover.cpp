@@ -0,0 +1,85 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Discover: lists which serial ports have units on them, and what each is
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_discover tools/spk_tvone_discover.cpp spk_tvone_mbed.cpp spk_tvone_posix.cpp
+//
+// spk_tvone_discover [-b baud] [-t timeout ms] [port glob]
+//
+// Prints a line per port, with the unit's software version, product and board type if one answered. Try it against stand-ins, eg.
+// spk_tvone_standin -p /tmp/tv1a & spk_tvone_standin -l 40 -p /tmp/tv1b & spk_tvone_discover '/tmp/tv1*'
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "spk_tvone_mbed.h"
+
+int main(int argc, char *argv[])
+{
+    int baud = kTV1BaudDefault;
+    int timeoutMillis = kTV1CommandTimeoutMillis;
+    
+    int option;
+    while ((option = getopt(argc, argv, "b:t:")) != -1)
+    {
+        switch (option)
+        {
+            case 'b': baud = atoi(optarg); break;
+            case 't': timeoutMillis = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-b baud] [-t timeout ms] [port glob]\n", argv[0]);
+                return 2;
+        }
+    }
+    
+    const int maxUnits = 64;
+    SPKTVOne::discoveredUnitType units[maxUnits];
+    
+    const char *portGlob = (optind < argc) ? argv[optind] : "/dev/tty{USB,ACM}*";
+    
+    uint64_t startUs = spkPosixTimeUs();
+    int count = SPKTVOne::discoverUnits(units, maxUnits, portGlob, baud, timeoutMillis);
+    int tookMs = (spkPosixTimeUs() - startUs) / 1000;
+    
+    int found = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const SPKTVOne::discoveredUnitType &unit = units[i];
+        if (unit.found)
+        {
+            found++;
+            printf("%s: version %i, product %i, board %i, answered in %ims\n", unit.port, unit.processor.version, unit.processor.productType, unit.processor.boardType, unit.answerMillis);
+        }
+        else
+        {
+            printf("%s: no unit\n", unit.port);
+        }
+    }
+    printf("%i of %i ports have units, found in %ims\n", found, count, tookMs);
+    
+    return found ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,353 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Golden: pins the frames each method sends against a committed file, and budgets its wire bytes and time
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_golden tools/spk_tvone_golden.cpp spk_tvone_mbed.cpp spk_tvone_posix.cpp
+//
+// spk_tvone_golden [-c expected] [-o expected] [-l stand-in latency ms] [-b baud] <port>
+//
+// Runs each of the unit-level methods in turn on a fresh SPKTVOne, recording through "record:", and prints a line per method:
+// frames and bytes sent, bytes received, and time taken against its budget.
+// tools/spk_tvone_golden.txt holds every frame each method is expected to send, in hex. With -c, the frames are diffed against it 
+// one by one, and the frame and byte counts held to it as budgets. With -o, it's written afresh, to commit with a deliberate change.
+// The time budget is derived, not recorded: per frame, the method's send period or the stand-in's latency plus the wire time, 
+// whichever is longer, and one period over. Any difference or overrun fails, with exit status 1. Against a stand-in without -n, 
+// the frames are the same run to run; make golden runs the check, or by hand, eg.
+// spk_tvone_standin -l 5 -p /tmp/tv1 & spk_tvone_golden -l 5 -c tools/spk_tvone_golden.txt /tmp/tv1
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "spk_tvone_mbed.h"
+
+struct methodType
+{
+    const char *name;
+    int periodMs;       // The least the library leaves between sends, which paces a method against a stand-in more than its latency does
+    bool (*run)(SPKTVOne &tvOne, FILE *edid);
+};
+
+static const methodType methods[] =
+{
+    {"setResolution",        kTV1CommandMinimumMillis, [](SPKTVOne &tvOne, FILE *) { return tvOne.setResolution(kTV1Resolution1080p60, 1); }},
+    {"setHDCPOn",            kTV1CommandMinimumMillis, [](SPKTVOne &tvOne, FILE *) { return tvOne.setHDCPOn(true); }},
+    {"setAspect",            kTV1CommandMinimumMillis, [](SPKTVOne &tvOne, FILE *) { return tvOne.setAspect(SPKTVOne::aspectFit); }},
+    {"setAspectSPKFill",     kTV1CommandMinimumMillis, [](SPKTVOne &tvOne, FILE *) { return tvOne.setAspect(SPKTVOne::aspectSPKFill); }},
+    {"uploadEDID",           100,                      [](SPKTVOne &tvOne, FILE *edid) { rewind(edid); return tvOne.uploadEDID(edid, 1); }},
+    {"setMatroxResolutions", kTV1CommandMinimumMillis, [](SPKTVOne &tvOne, FILE *) { return tvOne.setMatroxResolutions(true); }},
+    {"changeFormat",         kTV1CommandMinimumMillis, [](SPKTVOne &tvOne, FILE *) { SPKTVOne::formatType format = {kTV1Resolution720p60, 2, false, SPKTVOne::aspectSPKFill}; return tvOne.changeFormat(format); }},
+};
+static const int methodCount = sizeof(methods) / sizeof(methods[0]);
+
+struct resultType
+{
+    std::string name;
+    std::vector<std::string> frames;
+    int sent;
+    int received;
+    int ok;
+};
+
+static bool readVarint(FILE *file, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Collects what the trace says went each way, one frame per write
+static bool readTrace(const char *path, resultType &result)
+{
+    FILE *file = fopen(path, "rb");
+    char header[8];
+    if (!file || fread(header, 1, 8, file) != 8 || memcmp(header, "TV1T", 4) != 0 || header[4] != kTV1TraceVersion)
+    {
+        if (file) fclose(file);
+        return false;
+    }
+    
+    result.frames.clear();
+    result.sent = result.received = 0;
+    
+    int kind;
+    while ((kind = fgetc(file)) != EOF)
+    {
+        uint64_t deltaUs, length;
+        if (!readVarint(file, deltaUs) || !readVarint(file, length) || length > 4096) break;
+        
+        std::string bytes(length, 0);
+        if (fread(&bytes[0], 1, length, file) != length) break;
+        
+        if (kind == 'T')
+        {
+            result.frames.push_back(bytes);
+            result.sent += length;
+        }
+        else if (kind == 'R')
+        {
+            result.received += length;
+        }
+    }
+    
+    fclose(file);
+    return true;
+}
+
+static std::string toHex(const std::string &bytes)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    
+    std::string text;
+    for (size_t i = 0; i < bytes.size(); i++)
+    {
+        text += hex[(uint8_t)bytes[i] >> 4];
+        text += hex[(uint8_t)bytes[i] & 0xF];
+    }
+    return text;
+}
+
+static bool fromHex(const char *text, std::string &bytes)
+{
+    bytes.clear();
+    while (isxdigit((unsigned char)text[0]) && isxdigit((unsigned char)text[1]))
+    {
+        char pair[3] = {text[0], text[1], 0};
+        bytes += (char)strtol(pair, NULL, 16);
+        text += 2;
+    }
+    return *text == 0 || isspace((unsigned char)*text);
+}
+
+// For diffs: ASCII frames as the unit would read them, anything else, eg. an upload chunk, as hex
+static std::string describe(const std::string &frame)
+{
+    bool ascii = !frame.empty() && frame[frame.size() - 1] == '\r';
+    for (size_t i = 0; ascii && i < frame.size() - 1; i++) ascii = isprint((unsigned char)frame[i]);
+    
+    return ascii ? frame.substr(0, frame.size() - 1) : toHex(frame);
+}
+
+// The expected file: a line per method with its counts, then a line of hex per frame it sends. # to end of line is a comment.
+static bool readExpected(const char *path, std::vector<resultType> &expected)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    
+    bool ok = true;
+    std::vector<int> declared;
+    char line[1024];
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+        
+        char name[32];
+        int frames, sent, okFlag;
+        if (sscanf(line, "method %31s frames %i bytes %i ok %i", name, &frames, &sent, &okFlag) == 4)
+        {
+            resultType method;
+            method.name = name;
+            method.sent = sent;
+            method.received = 0;
+            method.ok = okFlag;
+            expected.push_back(method);
+            declared.push_back(frames);
+            continue;
+        }
+        
+        std::string frame;
+        ok = !expected.empty() && fromHex(line, frame) && !frame.empty();
+        if (ok) expected.back().frames.push_back(frame);
+    }
+    fclose(file);
+    
+    // A hand edit that lost or added a line would otherwise move the budget with it
+    for (size_t i = 0; ok && i < expected.size(); i++) ok = ((int)expected[i].frames.size() == declared[i]);
+    
+    return ok;
+}
+
+static void writeExpected(FILE *file, const resultType &result)
+{
+    fprintf(file, "method %s frames %i bytes %i ok %i\r\n", result.name.c_str(), (int)result.frames.size(), result.sent, result.ok);
+    for (size_t i = 0; i < result.frames.size(); i++) fprintf(file, "%s\r\n", toHex(result.frames[i]).c_str());
+    fprintf(file, "\r\n");
+}
+
+// Per frame, the wait for the send period or for the ack, whichever is longer, and a little for waking up to it. 
+// One period and one latency over, for the first send and the last ack.
+static int budgetMs(const methodType &method, const resultType &result, int latencyMs, int baud)
+{
+    static const int wakeMs = 2;
+    
+    int budget = method.periodMs + latencyMs;
+    for (size_t i = 0; i < result.frames.size(); i++)
+    {
+        int wireMs = (int)((result.frames[i].size() + kTV1FrameLength) * 10 * 1000 / baud) + 1;
+        budget += ((latencyMs + wireMs > method.periodMs) ? latencyMs + wireMs : method.periodMs) + wakeMs;
+    }
+    return budget;
+}
+
+static int diffFrames(const resultType &expected, const resultType &result)
+{
+    static const int shown = 4;
+    
+    int differences = 0;
+    size_t count = (expected.frames.size() > result.frames.size()) ? expected.frames.size() : result.frames.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        bool hasExpected = i < expected.frames.size();
+        bool hasSent = i < result.frames.size();
+        if (hasExpected && hasSent && expected.frames[i] == result.frames[i]) continue;
+        
+        if (differences++ < shown)
+        {
+            printf("  frame %2i: expected %s\n", (int)i, hasExpected ? describe(expected.frames[i]).c_str() : "nothing");
+            printf("            sent     %s\n", hasSent ? describe(result.frames[i]).c_str() : "nothing");
+        }
+    }
+    if (differences > shown) printf("  ...and %i more frames differ\n", differences - shown);
+    
+    return differences;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outputPath = NULL;
+    const char *expectedPath = NULL;
+    int latencyMs = 10;
+    int baud = kTV1BaudDefault;
+    
+    int option;
+    while ((option = getopt(argc, argv, "o:c:l:b:")) != -1)
+    {
+        switch (option)
+        {
+            case 'o': outputPath = optarg; break;
+            case 'c': expectedPath = optarg; break;
+            case 'l': latencyMs = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            default: optind = argc + 1;
+        }
+    }
+    
+    if (optind != argc - 1 || baud <= 0)
+    {
+        fprintf(stderr, "usage: %s [-c expected] [-o expected] [-l stand-in latency ms] [-b baud] <port>\n", argv[0]);
+        return 2;
+    }
+    
+    std::vector<resultType> expected;
+    if (expectedPath && !readExpected(expectedPath, expected))
+    {
+        fprintf(stderr, "could not read %s\n", expectedPath);
+        return 2;
+    }
+    
+    FILE *output = outputPath ? fopen(outputPath, "w") : NULL;
+    if (outputPath && !output)
+    {
+        fprintf(stderr, "could not write %s\n", outputPath);
+        return 2;
+    }
+    if (output) fprintf(output, "# Frames each method sends, in hex, as checked by spk_tvone_golden -c. Regenerate with -o only for a deliberate change.\r\n\r\n");
+    
+    // A full slot of EDID, the same every run
+    FILE *edid = tmpfile();
+    const uint8_t edidHeader[8] = {0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+    for (int i = 0; i < 256; i++) fputc(i < 8 ? edidHeader[i] : (i * 7) & 0xFF, edid);
+    
+    char tracePath[64];
+    snprintf(tracePath, sizeof(tracePath), "/tmp/spk_tvone_golden.%i.tv1t", (int)getpid());
+    std::string recordPath = std::string("record:") + tracePath + "@" + argv[optind];
+    
+    int regressions = 0;
+    for (int m = 0; m < methodCount; m++)
+    {
+        // TASK: Run the method on its own, recording what it sends
+        
+        resultType result;
+        result.name = methods[m].name;
+        int ms;
+        
+        {
+            SPKTVOne tvOne(recordPath.c_str(), NC);
+            uint64_t startUs = tvOne.timeUs();
+            result.ok = methods[m].run(tvOne, edid);
+            ms = (tvOne.timeUs() - startUs) / 1000;
+        }
+        
+        if (!readTrace(tracePath, result))
+        {
+            fprintf(stderr, "could not read back the trace of %s\n", result.name.c_str());
+            return 1;
+        }
+        
+        int budget = budgetMs(methods[m], result, latencyMs, baud);
+        printf("%-22s frames %4i sent %6i received %6i ms %6i budget %6i ok %i\n", 
+               result.name.c_str(), (int)result.frames.size(), result.sent, result.received, ms, budget, result.ok);
+        if (output) writeExpected(output, result);
+        
+        if (ms > budget) { printf("  REGRESSION: took %ims, budget %ims at %ims latency\n", ms, budget, latencyMs); regressions++; }
+        
+        // TASK: Hold it to the expected frames
+        
+        if (!expectedPath) continue;
+        
+        const resultType *golden = NULL;
+        for (size_t i = 0; i < expected.size() && !golden; i++) if (expected[i].name == result.name) golden = &expected[i];
+        if (!golden)
+        {
+            printf("  REGRESSION: no expected frames\n");
+            regressions++;
+            continue;
+        }
+        
+        if (result.ok != golden->ok)                          { printf("  REGRESSION: %s where expected to %s\n", result.ok ? "succeeded" : "failed", golden->ok ? "succeed" : "fail"); regressions++; }
+        if (result.sent > golden->sent)                       { printf("  REGRESSION: sent %i bytes, budget %i\n", result.sent, golden->sent); regressions++; }
+        if (result.frames.size() > golden->frames.size())     { printf("  REGRESSION: sent %i frames, budget %i\n", (int)result.frames.size(), (int)golden->frames.size()); regressions++; }
+        if (diffFrames(*golden, result))                      { printf("  REGRESSION: frames differ from expected\n"); regressions++; }
+    }
+    
+    unlink(tracePath);
+    fclose(edid);
+    if (output) fclose(output);
+    
+    printf("%i regressions\n", regressions);
+    
+    return regressions ? 1 : 0;
+}
+
+#endif
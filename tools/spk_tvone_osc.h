@@ -0,0 +1,213 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Minimal OSC encoding and decoding for the network bridge tools
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// OSC 1.0 with just int32 and string arguments, which is all the bridge protocol needs. Bundles are unpacked, their time tags ignored.
+// Reading works in place on the received packet, so the packet must outlive the message.
+
+#ifndef SPKTVOne_OSC_h
+#define SPKTVOne_OSC_h
+
+#include <stdint.h>
+#include <string.h>
+
+struct SPKOSCMessage
+{
+    const char *address;
+    const char *types;      // Type tags still to read, without the leading comma
+    const uint8_t *arg;     // Next argument
+    const uint8_t *end;
+};
+
+inline int32_t spkOSCReadInt32(const uint8_t *at)
+{
+    return (int32_t)((uint32_t)at[0] << 24 | (uint32_t)at[1] << 16 | (uint32_t)at[2] << 8 | (uint32_t)at[3]);
+}
+
+// Strings are null terminated then padded to a multiple of four bytes
+inline const char* spkOSCReadString(const uint8_t *&at, const uint8_t *end)
+{
+    const uint8_t *terminator = (const uint8_t*)memchr(at, 0, end - at);
+    if (!terminator) return NULL;
+    
+    const char *string = (const char*)at;
+    const uint8_t *next = at + ((terminator - at + 4) & ~3);
+    if (next > end) return NULL;
+    
+    at = next;
+    return string;
+}
+
+inline bool spkOSCParse(const uint8_t *data, int length, SPKOSCMessage &message)
+{
+    const uint8_t *at = data;
+    const uint8_t *end = data + length;
+    
+    message.address = spkOSCReadString(at, end);
+    if (!message.address || message.address[0] != '/') return false;
+    
+    const char *types = spkOSCReadString(at, end);
+    if (!types || types[0] != ',') return false;
+    
+    message.types = types + 1;
+    message.arg = at;
+    message.end = end;
+    return true;
+}
+
+inline bool spkOSCNextInt(SPKOSCMessage &message, int32_t &value)
+{
+    if (*message.types != 'i' || message.arg + 4 > message.end) return false;
+    
+    value = spkOSCReadInt32(message.arg);
+    message.arg += 4;
+    message.types++;
+    return true;
+}
+
+inline bool spkOSCNextString(SPKOSCMessage &message, const char *&value)
+{
+    if (*message.types != 's') return false;
+    
+    value = spkOSCReadString(message.arg, message.end);
+    if (!value) return false;
+    
+    message.types++;
+    return true;
+}
+
+// Calls handler(message) for each message in a packet, descending into bundles
+template <typename Handler> inline void spkOSCForEach(const uint8_t *data, int length, Handler &handler)
+{
+    if (length >= 16 && memcmp(data, "#bundle", 8) == 0)
+    {
+        const uint8_t *at = data + 16;
+        const uint8_t *end = data + length;
+        while (at + 4 <= end)
+        {
+            int32_t size = spkOSCReadInt32(at);
+            at += 4;
+            if (size <= 0 || size > end - at) return;
+            
+            spkOSCForEach(at, size, handler);
+            at += size;
+        }
+        return;
+    }
+    
+    SPKOSCMessage message;
+    if (spkOSCParse(data, length, message)) handler(message);
+}
+
+// Builds one message, or a bundle of them. Arguments must match the types given to beginMessage.
+struct SPKOSCWriter
+{
+    static const int capacity = 1472;   // What fits in one UDP packet over ethernet
+    uint8_t data[capacity];
+    int  length;
+    bool overflow;
+    bool bundle;
+    int  sizeAt;
+    
+    SPKOSCWriter() : length(0), overflow(false), bundle(false), sizeAt(0) {}
+    
+    void beginBundle()
+    {
+        length = 0;
+        overflow = false;
+        bundle = true;
+        putBytes("#bundle", 8);
+        putInt(0);
+        putInt(1);  // Time tag for immediately
+    }
+    
+    void beginMessage(const char *address, const char *types)
+    {
+        if (!bundle)
+        {
+            length = 0;
+            overflow = false;
+        }
+        else
+        {
+            sizeAt = length;
+            putInt(0);
+        }
+        
+        addString(address);
+        
+        char tags[32] = ",";
+        strncat(tags, types, sizeof(tags) - 2);
+        addString(tags);
+    }
+    
+    void endMessage()
+    {
+        if (!bundle || overflow) return;
+        
+        int32_t size = length - sizeAt - 4;
+        data[sizeAt] = size >> 24;
+        data[sizeAt + 1] = size >> 16;
+        data[sizeAt + 2] = size >> 8;
+        data[sizeAt + 3] = size;
+    }
+    
+    void addInt(int32_t value)
+    {
+        putInt(value);
+    }
+    
+    void addString(const char *value)
+    {
+        int stringLength = strlen(value);
+        int padded = (stringLength + 4) & ~3;
+        if (length + padded > capacity)
+        {
+            overflow = true;
+            return;
+        }
+        
+        memset(data + length, 0, padded);
+        memcpy(data + length, value, stringLength);
+        length += padded;
+    }
+    
+  private:
+    void putInt(int32_t value)
+    {
+        uint8_t bytes[4] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+        putBytes(bytes, 4);
+    }
+    
+    void putBytes(const void *bytes, int count)
+    {
+        if (length + count > capacity)
+        {
+            overflow = true;
+            return;
+        }
+        
+        memcpy(data + length, bytes, count);
+        length += count;
+    }
+};
+
+#endif
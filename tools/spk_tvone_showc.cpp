@@ -0,0 +1,418 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Show compiler: turns a text cue list into the binary show that SPKTVOne::runCue streams to the unit
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_showc tools/spk_tvone_showc.cpp
+// spk_tvone_showc show.txt show.tv1s     binary, to map from a file
+// spk_tvone_showc show.txt show.h        C array, to build into flash
+//
+// Cue list format, one statement per line, # to end of line is a comment:
+//
+// cue <name>                               starts a cue, names are up to 16 characters
+// <function> <channel> <window> <payload>  a write, eg. AdjustWindowsZoomLevel 0 A 150
+// resolution <resolution> [<edid slot>]    as SPKTVOne::setResolution, eg. resolution 1080p60 1
+// aspect <fit|hfill|vfill|1to1>            as SPKTVOne::setAspect
+//
+// Functions are kTV1Function names, with or without the prefix. Channels can be RGB1-6 or SIS1-2, windows A, B, Z, LogoA or LogoB,
+// and payloads kTV1Resolution names, as the firmware selected in spk_tvone.h has them, or source names. Numbers can be decimal or 0x hex.
+//
+// Within a cue, writes that a later write to the same thing makes redundant are dropped, and writes to the resolution picked by
+// AdjustResolutionImageToAdjust are grouped behind their selection. Writes that do something rather than set something,
+// eg. PresetLoad, AdjustOutputsTake or AdjustFrontPanelLock, stay exactly where they are and nothing is moved across them.
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "spk_tvone.h"
+#include "spk_tvone_functions.h"
+#include "spk_tvone_resolutions.h"
+#include "spk_tvone_show.h"
+
+struct showWrite
+{
+    uint8_t channel;
+    uint8_t window;
+    int32_t func;
+    int32_t payload;
+    int     context;    // The ImageToAdjust selection in force when written, -1 if not yet selected in this cue
+    int     line;
+};
+
+struct showCue
+{
+    std::string name;
+    std::vector<showWrite> writes;
+    int lines;
+};
+
+static const char *sourceName;
+static int sourceLine;
+
+static void fail(const char *message, const char *detail = "")
+{
+    fprintf(stderr, "%s:%i: %s%s\n", sourceName, sourceLine, message, detail);
+    exit(1);
+}
+
+static bool parseNumber(const char *token, int32_t &value)
+{
+    char *end;
+    value = strtol(token, &end, 0);
+    return *token && *end == 0;
+}
+
+static int32_t parseChannel(const char *token)
+{
+    static const struct {const char *name; int32_t channel;} channels[] = 
+    {
+        {"RGB1", kTV1SourceRGB1}, {"RGB2", kTV1SourceRGB2}, {"RGB3", kTV1SourceRGB3}, 
+        {"RGB4", kTV1SourceRGB4}, {"RGB5", kTV1SourceRGB5}, {"RGB6", kTV1SourceRGB6},
+        {"SIS1", kTV1SourceSIS1}, {"SIS2", kTV1SourceSIS2}
+    };
+    
+    int32_t value;
+    if (parseNumber(token, value)) return value;
+    for (size_t i = 0; i < sizeof(channels) / sizeof(channels[0]); i++)
+    {
+        if (strcmp(channels[i].name, token) == 0) return channels[i].channel;
+    }
+    
+    fail("unknown channel ", token);
+    return 0;
+}
+
+static int32_t parseWindow(const char *token)
+{
+    static const struct {const char *name; int32_t window;} windows[] = 
+    {
+        {"A", kTV1WindowIDA}, {"B", kTV1WindowIDB}, {"Z", kTV1WindowIDZ}, {"LogoA", kTV1WindowIDLogoA}, {"LogoB", kTV1WindowIDLogoB}
+    };
+    
+    int32_t value;
+    if (parseNumber(token, value)) return value;
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++)
+    {
+        if (strcmp(windows[i].name, token) == 0) return windows[i].window;
+    }
+    
+    fail("unknown window ", token);
+    return 0;
+}
+
+static int32_t parsePayload(const char *token)
+{
+    int32_t value;
+    if (parseNumber(token, value)) return value;
+    
+    const SPKTVOneResolution *resolution = kTV1ResolutionNamed(token);
+    if (resolution) return resolution->number;
+    
+    return parseChannel(token);
+}
+
+static void addWrite(showCue &cue, int32_t channel, int32_t window, int32_t func, int32_t payload)
+{
+    const char *error = kTV1FunctionWriteError(channel, window, func, payload);
+    if (error) fail("can't write that, ", error);
+    
+    showWrite write = {(uint8_t)channel, (uint8_t)window, func, payload, -1, sourceLine};
+    cue.writes.push_back(write);
+}
+
+static void parseLine(char *text, std::vector<showCue> &cues)
+{
+    char *comment = strchr(text, '#');
+    if (comment) *comment = 0;
+    
+    std::vector<const char*> tokens;
+    for (char *token = strtok(text, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) tokens.push_back(token);
+    if (tokens.empty()) return;
+    
+    if (strcmp(tokens[0], "cue") == 0)
+    {
+        if (tokens.size() != 2) fail("cue takes a name");
+        if (strlen(tokens[1]) > kTV1ShowCueNameLength) fail("cue name too long, ", tokens[1]);
+        
+        showCue cue;
+        cue.name = tokens[1];
+        cue.lines = 0;
+        cues.push_back(cue);
+        return;
+    }
+    
+    if (cues.empty()) fail("statement before the first cue");
+    showCue &cue = cues.back();
+    cue.lines++;
+    
+    if (strcmp(tokens[0], "resolution") == 0)
+    {
+        if (tokens.size() < 2 || tokens.size() > 3) fail("resolution takes a resolution and optionally an EDID slot");
+        
+        addWrite(cue, 0, kTV1WindowIDA, kTV1FunctionAdjustOutputsOutputResolution, parsePayload(tokens[1]));
+        if (tokens.size() == 3)
+        {
+            int32_t edidSlot = parsePayload(tokens[2]);
+            addWrite(cue, kTV1SourceRGB1, kTV1WindowIDA, kTV1FunctionAdjustSourceEDID, edidSlot);
+            addWrite(cue, kTV1SourceRGB2, kTV1WindowIDA, kTV1FunctionAdjustSourceEDID, edidSlot);
+        }
+        return;
+    }
+    
+    if (strcmp(tokens[0], "aspect") == 0)
+    {
+        static const struct {const char *name; int32_t aspect;} aspects[] = {{"fit", 1}, {"hfill", 2}, {"vfill", 3}, {"1to1", 4}};
+        
+        if (tokens.size() != 2) fail("aspect takes fit, hfill, vfill or 1to1");
+        
+        int32_t aspect = -1;
+        for (size_t i = 0; i < sizeof(aspects) / sizeof(aspects[0]); i++)
+        {
+            if (strcmp(aspects[i].name, tokens[1]) == 0) aspect = aspects[i].aspect;
+        }
+        if (aspect == -1) fail("unknown aspect, SPK fill needs to read the unit so can't be compiled: ", tokens[1]);
+        
+        addWrite(cue, kTV1SourceRGB1, kTV1WindowIDA, kTV1FunctionAdjustSourceAspectCorrect, aspect);
+        addWrite(cue, kTV1SourceRGB2, kTV1WindowIDA, kTV1FunctionAdjustSourceAspectCorrect, aspect);
+        return;
+    }
+    
+    if (tokens.size() != 4) fail("expected <function> <channel> <window> <payload>");
+    
+    const char *name = tokens[0];
+    if (strncmp(name, "kTV1Function", 12) == 0) name += 12;
+    const SPKTVOneFunction *function = kTV1FunctionNamed(name);
+    if (!function) fail("unknown function ", tokens[0]);
+    
+    addWrite(cue, parseChannel(tokens[1]), parseWindow(tokens[2]), function->func, parsePayload(tokens[3]));
+}
+
+static bool isSelector(const showWrite &write)
+{
+    return write.func == kTV1FunctionAdjustResolutionImageToAdjust;
+}
+
+// Triggers end a run like any other action, so a lock, writes, unlock cue keeps all three in place
+static bool setsState(const showWrite &write)
+{
+    if (kTV1FunctionHasFlag(write.func, kTV1FunctionFlagTrigger)) return false;
+    return kTV1FunctionHasFlag(write.func, kTV1FunctionFlagCacheable) || kTV1FunctionHasFlag(write.func, kTV1FunctionFlagImageToAdjust);
+}
+
+static bool sameTarget(const showWrite &a, const showWrite &b)
+{
+    bool contextMatters = kTV1FunctionHasFlag(a.func, kTV1FunctionFlagImageToAdjust);
+    return a.func == b.func && a.channel == b.channel && a.window == b.window && (!contextMatters || a.context == b.context);
+}
+
+// Orders one run of state-setting writes, none of which do anything but set a value.
+// Resolution parameters go first, grouped behind their selection so each is set on the right resolution, then everything else.
+static void compileRun(const std::vector<showWrite> &run, int &selection, std::vector<showWrite> &out)
+{
+    std::vector<showWrite> kept;
+    for (size_t i = 0; i < run.size(); i++)
+    {
+        if (isSelector(run[i])) continue;
+        
+        bool superseded = false;
+        for (size_t j = i + 1; j < run.size() && !superseded; j++) superseded = sameTarget(run[i], run[j]);
+        if (!superseded) kept.push_back(run[i]);
+    }
+    
+    // Selections in the order of their last use, so the run finishes on the same selection as written
+    std::vector<showWrite> selectors;
+    for (size_t i = run.size(); i-- > 0; )
+    {
+        if (!isSelector(run[i])) continue;
+        
+        bool later = false;
+        for (size_t j = 0; j < selectors.size(); j++) later = later || (selectors[j].payload == run[i].payload);
+        if (!later) selectors.insert(selectors.begin(), run[i]);
+    }
+    
+    // Writes for the selection already in force need no selector
+    int entry = selection;
+    for (size_t i = 0; i < kept.size(); i++)
+    {
+        bool current = (kept[i].context == -1 || kept[i].context == entry);
+        if (kTV1FunctionHasFlag(kept[i].func, kTV1FunctionFlagImageToAdjust) && current) out.push_back(kept[i]);
+    }
+    
+    for (size_t s = 0; s < selectors.size(); s++)
+    {
+        bool last = (s == selectors.size() - 1);
+        
+        std::vector<showWrite> group;
+        for (size_t i = 0; i < kept.size(); i++)
+        {
+            bool inGroup = kTV1FunctionHasFlag(kept[i].func, kTV1FunctionFlagImageToAdjust) && kept[i].context == selectors[s].payload;
+            if (inGroup && selectors[s].payload != entry) group.push_back(kept[i]);
+        }
+        
+        if (group.empty() && !last) continue;
+        if (selectors[s].payload == selection && last) continue;
+        
+        out.push_back(selectors[s]);
+        selection = selectors[s].payload;
+        out.insert(out.end(), group.begin(), group.end());
+    }
+    
+    for (size_t i = 0; i < kept.size(); i++)
+    {
+        if (!kTV1FunctionHasFlag(kept[i].func, kTV1FunctionFlagImageToAdjust)) out.push_back(kept[i]);
+    }
+}
+
+static std::vector<showWrite> compileCue(showCue &cue)
+{
+    // TASK: Note which resolution each write applies to, then compile the runs between writes that do something
+    
+    int selection = -1;
+    for (size_t i = 0; i < cue.writes.size(); i++)
+    {
+        if (isSelector(cue.writes[i])) selection = cue.writes[i].payload;
+        else cue.writes[i].context = selection;
+    }
+    
+    std::vector<showWrite> out;
+    std::vector<showWrite> run;
+    selection = -1;
+    
+    for (size_t i = 0; i < cue.writes.size(); i++)
+    {
+        if (setsState(cue.writes[i]))
+        {
+            run.push_back(cue.writes[i]);
+            continue;
+        }
+        
+        compileRun(run, selection, out);
+        run.clear();
+        out.push_back(cue.writes[i]);
+    }
+    compileRun(run, selection, out);
+    
+    return out;
+}
+
+static bool writeShow(const char *path, const std::vector<uint8_t> &show)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+    
+    size_t length = strlen(path);
+    bool header = (length > 2 && strcmp(path + length - 2, ".h") == 0);
+    
+    if (header)
+    {
+        // C array named after the file, eg. shows/opening.h gives kTV1Show_opening
+        const char *base = strrchr(path, '/');
+        std::string name(base ? base + 1 : path);
+        name = name.substr(0, name.size() - 2);
+        for (size_t i = 0; i < name.size(); i++) if (!isalnum((unsigned char)name[i])) name[i] = '_';
+        
+        fprintf(file, "// Compiled by spk_tvone_showc, do not edit\n\n#include <stdint.h>\n\n");
+        fprintf(file, "const uint8_t kTV1Show_%s[%u] = \n{", name.c_str(), (unsigned)show.size());
+        for (size_t i = 0; i < show.size(); i++) fprintf(file, "%s0x%02X,", (i % 16) ? " " : "\n    ", show[i]);
+        fprintf(file, "\n};\n");
+    }
+    else
+    {
+        fwrite(&show[0], 1, show.size(), file);
+    }
+    
+    return fclose(file) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <cue list> <show.tv1s | show.h>\n", argv[0]);
+        return 2;
+    }
+    
+    sourceName = argv[1];
+    FILE *source = fopen(sourceName, "r");
+    if (!source)
+    {
+        perror(sourceName);
+        return 1;
+    }
+    
+    std::vector<showCue> cues;
+    char text[256];
+    while (fgets(text, sizeof(text), source))
+    {
+        sourceLine++;
+        parseLine(text, cues);
+    }
+    fclose(source);
+    
+    if (cues.size() > 0xFFFF) fail("too many cues");
+    
+    // TASK: Lay out header, cue table, then every cue's frames
+    
+    std::vector<uint8_t> show(kTV1ShowHeaderLength + cues.size() * kTV1ShowCueLength, 0);
+    memcpy(&show[0], "TV1S", 4);
+    show[4] = kTV1ShowVersion;
+    kTV1ShowWrite(&show[6], cues.size(), 2);
+    
+    uint32_t frameCount = 0;
+    for (size_t c = 0; c < cues.size(); c++)
+    {
+        std::vector<showWrite> writes = compileCue(cues[c]);
+        if (writes.size() > 0xFFFF) fail("too many writes in cue ", cues[c].name.c_str());
+        
+        uint8_t *entry = &show[kTV1ShowHeaderLength + c * kTV1ShowCueLength];
+        kTV1ShowWrite(entry, frameCount, 4);
+        kTV1ShowWrite(entry + 4, writes.size(), 2);
+        strncpy((char*)entry + 8, cues[c].name.c_str(), kTV1ShowCueNameLength);
+        
+        for (size_t i = 0; i < writes.size(); i++)
+        {
+            char frame[kTV1FrameLength];
+            kTV1EncodeWriteFrame(frame, writes[i].channel, writes[i].window, writes[i].func, writes[i].payload);
+            show.insert(show.end(), frame, frame + kTV1FrameLength);
+        }
+        frameCount += writes.size();
+        
+        printf("cue %-16s %3u writes from %3i lines -> %3u frames\n", cues[c].name.c_str(), (unsigned)cues[c].writes.size(), cues[c].lines, (unsigned)writes.size());
+    }
+    
+    if (!writeShow(argv[2], show))
+    {
+        perror(argv[2]);
+        return 1;
+    }
+    
+    printf("%u cues, %u frames, %u bytes\n", (unsigned)cues.size(), frameCount, (unsigned)show.size());
+    
+    return 0;
+}
+
+#endif
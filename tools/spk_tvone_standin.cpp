@@ -0,0 +1,325 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Stand-in: answers the TV-One RS232 protocol on a pseudo terminal, so the library can be exercised without a unit
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_standin tools/spk_tvone_standin.cpp -lutil
+//
+// spk_tvone_standin [-l latency ms] [-j jitter ms] [-n glitch %] [-r reboot ms] [-b baud] [-k preset load ms] [-p link path] [-v]
+//
+// Prints the pseudo terminal's path, or links it at -p, for use as SPKTVOne's txPin. Run several with different latencies
+// to stand in for a rack of units, eg. for SPKTVOne::commandSynchronised.
+// Writes are stored and echoed back in the ack, reads return what was last written. Uploads are acked per chunk.
+// To exercise link recovery, -n drops or adds a character in that percentage of acks. SIGUSR1 reboots the stand-in:
+// it goes quiet for the -r period, forgets what was written and prints a boot message. SIGUSR2 does the same into new firmware.
+// With -b, frames sent at any other rate arrive as noise, as they would at a unit set to that rate on its front panel.
+// Presets store and load everything written. A load takes the -k period, during which PresetLoad reads back as 1.
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <errno.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+
+#include "spk_tvone.h"
+#include "spk_tvone_show.h"
+
+static int latencyMs = 10;
+static int jitterMs = 0;
+static int glitchPercent = 0;
+static int rebootMs = 3000;
+static int presetLoadMs = 300;
+static int32_t softwareVersion = 415;
+static speed_t baudSpeed = 0;
+static bool verbose = false;
+
+static volatile sig_atomic_t rebootRequested = 0;
+
+static std::map<uint32_t, int32_t> registers;
+static std::map<uint32_t, int32_t> presets[11];
+static int32_t currentPreset = 1;
+static uint64_t presetLoadDoneMs = 0;
+
+static int hexValue(const char *text, int length)
+{
+    int value = 0;
+    for (int i = 0; i < length; i++)
+    {
+        char c = text[i];
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (digit < 0) return -1;
+        value = (value << 4) | digit;
+    }
+    return value;
+}
+
+static void sleepMs(int ms)
+{
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+}
+
+static uint64_t nowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void requestReboot(int signal)
+{
+    rebootRequested = (signal == SIGUSR2) ? 2 : 1;
+}
+
+static void reboot(int fd)
+{
+    if (rebootRequested == 2) softwareVersion++;
+    rebootRequested = 0;
+    
+    if (verbose) fprintf(stderr, "rebooting\n");
+    
+    // Whatever arrives while booting is lost, as is everything written before
+    sleepMs(rebootMs);
+    tcflush(fd, TCIFLUSH);
+    registers.clear();
+    
+    const char banner[] = "\r\nTV-One stand-in boot\r\n";
+    if (write(fd, banner, sizeof(banner) - 1) < 0) exit(0);
+}
+
+static void readFully(int fd, char *buffer, int length)
+{
+    int got = 0;
+    while (got < length)
+    {
+        int n = read(fd, buffer + got, length - got);
+        if (n > 0) got += n;
+        else if (n < 0 && errno != EAGAIN && errno != EINTR) exit(0);
+        if (rebootRequested) reboot(fd);
+    }
+}
+
+static void respond(int fd, const char *ack, int length)
+{
+    sleepMs(latencyMs + (jitterMs ? rand() % (jitterMs + 1) : 0));
+    
+    // A glitch either loses a character or adds line noise, somewhere in the ack
+    char glitched[64];
+    if (glitchPercent && rand() % 100 < glitchPercent && length < (int)sizeof(glitched))
+    {
+        int at = rand() % length;
+        bool drop = rand() % 2;
+        memcpy(glitched, ack, at);
+        if (!drop) glitched[at] = (char)(rand() % 256);
+        memcpy(glitched + at + (drop ? 0 : 1), ack + at + (drop ? 1 : 0), length - at - (drop ? 1 : 0));
+        ack = glitched;
+        length += drop ? -1 : 1;
+        
+        if (verbose) fprintf(stderr, "glitch, %s at %i\n", drop ? "dropped" : "noise", at);
+    }
+    
+    if (write(fd, ack, length) != length) exit(0);
+}
+
+// A frame as sent by SPKTVOne::command: F, hex bytes and checksum, CR. 20 characters for a write, 14 for a read.
+static void handleFrame(int fd, const char *frame, int length)
+{
+    int bytes = (length - 2) / 2;
+    int cmd[9];
+    uint8_t checksum = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        cmd[i] = hexValue(frame + 1 + i*2, 2);
+        if (cmd[i] < 0) return;
+        if (i < bytes - 1) checksum += cmd[i];
+    }
+    
+    // The unit ignores frames it can't make sense of, so the sender times out
+    if (checksum != cmd[bytes - 1]) return;
+    
+    bool isRead = cmd[0] & 0x80;
+    if (isRead != (length == 14)) return;
+    
+    int channel = cmd[1];
+    int window = cmd[2];
+    int func = (cmd[3] << 8) | cmd[4];
+    uint32_t key = (channel << 24) | (window << 16) | func;
+    
+    int32_t payload = 0;
+    if (isRead)
+    {
+        payload = registers.count(key) ? registers[key] : 0;
+        if (func == kTV1FunctionReadSoftwareVersion) payload = softwareVersion;
+        if (func == kTV1FunctionReadProductType) payload = 10;
+        if (func == kTV1FunctionReadBoardType) payload = 2;
+        if (func == kTV1FunctionPresetLoad) payload = (nowMs() < presetLoadDoneMs) ? 1 : 0;
+    }
+    else
+    {
+        payload = (cmd[5] << 16) | (cmd[6] << 8) | cmd[7];
+        
+        // Presets are 1-10, and hold everything but the preset functions themselves
+        if (func == kTV1FunctionPreset && payload >= 1 && payload <= 10) currentPreset = payload;
+        
+        if (func == kTV1FunctionPresetStore && payload == 1)
+        {
+            presets[currentPreset] = registers;
+        }
+        else if (func == kTV1FunctionPresetLoad && payload == 1)
+        {
+            for (std::map<uint32_t, int32_t>::iterator it = presets[currentPreset].begin(); it != presets[currentPreset].end(); ++it) registers[it->first] = it->second;
+            presetLoadDoneMs = nowMs() + presetLoadMs;
+        }
+        else if (func != kTV1FunctionPreset)
+        {
+            registers[key] = payload;
+        }
+    }
+    
+    if (verbose) fprintf(stderr, "%s %02X %02X %04X %06X\n", isRead ? "read " : "write", channel, window, func, payload & 0xFFFFFF);
+    
+    char ack[32];
+    snprintf(ack, sizeof(ack), "F%02X%02X%02X%04X%06X%02X\r", 0x40 | (isRead ? 1 : 0), channel, window, func, payload & 0xFFFFFF, 0);
+    respond(fd, ack, kTV1FrameLength);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *linkPath = NULL;
+    
+    int option;
+    while ((option = getopt(argc, argv, "l:j:n:r:b:k:p:v")) != -1)
+    {
+        switch (option)
+        {
+            case 'l': latencyMs = atoi(optarg); break;
+            case 'j': jitterMs = atoi(optarg); break;
+            case 'n': glitchPercent = atoi(optarg); break;
+            case 'r': rebootMs = atoi(optarg); break;
+            case 'b':
+                switch (atoi(optarg))
+                {
+                    case 9600:   baudSpeed = B9600;   break;
+                    case 19200:  baudSpeed = B19200;  break;
+                    case 38400:  baudSpeed = B38400;  break;
+                    case 57600:  baudSpeed = B57600;  break;
+                    case 115200: baudSpeed = B115200; break;
+                    case 230400: baudSpeed = B230400; break;
+                    default:
+                        fprintf(stderr, "unsupported baud rate %s\n", optarg);
+                        return 2;
+                }
+                break;
+            case 'k': presetLoadMs = atoi(optarg); break;
+            case 'p': linkPath = optarg; break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-l latency ms] [-j jitter ms] [-n glitch %%] [-r reboot ms] [-b baud] [-k preset load ms] [-p link path] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    
+    int master, slave;
+    char name[64];
+    if (openpty(&master, &slave, name, NULL, NULL) < 0)
+    {
+        perror("openpty");
+        return 1;
+    }
+    
+    struct termios options;
+    tcgetattr(slave, &options);
+    cfmakeraw(&options);
+    tcsetattr(slave, TCSANOW, &options);
+    
+    if (linkPath)
+    {
+        unlink(linkPath);
+        if (symlink(name, linkPath) < 0)
+        {
+            perror(linkPath);
+            return 1;
+        }
+    }
+    
+    printf("%s\n", name);
+    fflush(stdout);
+    
+    // No SA_RESTART, so a reboot interrupts the blocking read straight away
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestReboot;
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+    
+    // TASK: Answer frames and upload chunks until killed
+    
+    char frame[kTV1FrameLength];
+    int framePos = 0;
+    
+    while (true)
+    {
+        char c;
+        readFully(master, &c, 1);
+        
+        if (framePos == 0 && c == 'S')
+        {
+            // Uploads from SPKTVOne::uploadFile are always 41 bytes, whatever the chunk's length
+            char chunk[40];
+            readFully(master, chunk, sizeof(chunk));
+            
+            const char ack[] = {0x53, 0x02, 0x40, (char)0x95};
+            respond(master, ack, sizeof(ack));
+            continue;
+        }
+        
+        // The pty keeps the rate its slave side was set to, so we can see whether the sender matches ours
+        if (baudSpeed)
+        {
+            struct termios current;
+            tcgetattr(master, &current);
+            if (cfgetospeed(&current) != baudSpeed) c = (char)(rand() % 256);
+        }
+        
+        if (framePos == 0 && c != 'F') continue;
+        
+        frame[framePos++] = c;
+        if (c == '\r')
+        {
+            handleFrame(master, frame, framePos);
+            framePos = 0;
+        }
+        else if (framePos == kTV1FrameLength)
+        {
+            framePos = 0;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,263 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Stress: many producer threads queueing to one SPKTVOne port worker, reporting contention and throughput
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -pthread -DSPK_TVONE_POSIX -I. -o spk_tvone_stress tools/spk_tvone_stress.cpp spk_tvone_mbed.cpp spk_tvone_posix.cpp
+//
+// spk_tvone_stress [-t threads] [-n commands per thread] [-g group size] [-m minimum period ms] [-k keyer retunes] [-w window moves] <port>
+//
+// Against a stand-in with no latency, eg. spk_tvone_standin -l 0 -p /tmp/tv1 & spk_tvone_stress -m 0 /tmp/tv1
+// With -k, instead of the producers, times that many keyer retunes that each nudge one setting: diffed by setKeyer, then sent in full.
+// With -w, queues that many window moves with nothing draining, so the queue would fill, then checks the unit ends at the last one.
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "spk_tvone_mbed.h"
+
+struct producerResult
+{
+    int queued;
+    int retries;
+    uint64_t totalQueueNs;
+    uint64_t maxQueueNs;
+};
+
+static uint64_t timeNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static std::atomic<bool> go(false);
+
+static void produce(SPKTVOne *tvOne, int index, int count, int groupSize, producerResult *result)
+{
+    result->queued = 0;
+    result->retries = 0;
+    result->totalQueueNs = 0;
+    result->maxQueueNs = 0;
+    
+    SPKTVOne::queuedCommand group[SPKTVOne::commandQueueLength] = {};
+    
+    // Start together, so the threads really do contend
+    while (!go) std::this_thread::yield();
+    
+    while (result->queued < count)
+    {
+        // Each thread works its own window and priority, so its writes can be told apart in the stand-in
+        SPKTVOne::commandPriority priority = (SPKTVOne::commandPriority)(index % SPKTVOne::priorityCount);
+        for (int i = 0; i < groupSize; i++)
+        {
+            group[i].window = (index % 2) ? kTV1WindowIDB : kTV1WindowIDA;
+            group[i].func = kTV1FunctionAdjustWindowsZoomLevel;
+            group[i].payload = 100 + (result->queued + i) % 900;
+        }
+        
+        uint64_t start = timeNs();
+        bool ok = tvOne->queueCommands(priority, group, groupSize);
+        uint64_t took = timeNs() - start;
+        
+        result->totalQueueNs += took;
+        if (took > result->maxQueueNs) result->maxQueueNs = took;
+        
+        if (ok) result->queued += groupSize;
+        else
+        {
+            // Full: a real producer would drop or coalesce, here we back off and try again
+            result->retries++;
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Nudges one setting per retune, as a live-tuning UI would. Full means the window's keyer cache is cleared first, so all fourteen go.
+static void keyerRetunes(SPKTVOne &tvOne, int retunes, bool full, int &writes, uint64_t &elapsedNs)
+{
+    SPKTVOne::keyerType keyer = {true, 16, 16, 16, 235, 240, 240, 10, 10, 10, false, false, false, false};
+    
+    writes = 0;
+    uint64_t start = timeNs();
+    for (int i = 0; i < retunes; i++)
+    {
+        keyer.minY = 16 + i % 32;
+        if (full) tvOne.invalidateKeyer();
+        
+        int queued = tvOne.setKeyer(keyer);
+        if (queued > 0) writes += queued;
+        tvOne.processQueue();
+    }
+    elapsedNs = timeNs() - start;
+}
+
+// Moves window A faster than the link could ever keep up, then drains and reads back where the unit put it. 
+// Every move must be accepted, and the position sent last must be the one requested last.
+static bool windowMoves(SPKTVOne &tvOne, int moves)
+{
+    SPKTVOne::windowGeometryType geometry = {200, 50, 50, 0, 0, 0, 0, 100, 50, 50};
+    
+    int refused = 0;
+    for (int i = 0; i < moves; i++)
+    {
+        // Zoom and shrink change now and then, so groups differ in what they write and have to be replaced or queued whole
+        geometry.zoom = (i / 7 % 2) ? 300 : 200;
+        geometry.shrink = (i / 11 % 2) ? 80 : 100;
+        geometry.panH = i % 101;
+        geometry.panV = 100 - i % 101;
+        if (tvOne.setWindowGeometry(geometry) < 0) refused++;
+    }
+    int waiting = tvOne.queuedCount(SPKTVOne::priorityInteractive);
+    
+    tvOne.processQueue();
+    
+    int32_t zoom = -1, shrink = -1, panH = -1, panV = -1;
+    bool read = tvOne.readCommand(0, kTV1WindowIDA, kTV1FunctionAdjustWindowsZoomLevel, zoom) && 
+                tvOne.readCommand(0, kTV1WindowIDA, kTV1FunctionAdjustWindowsShrinkLevel, shrink) && 
+                tvOne.readCommand(0, kTV1WindowIDA, kTV1FunctionAdjustWindowsZoomPanH, panH) && 
+                tvOne.readCommand(0, kTV1WindowIDA, kTV1FunctionAdjustWindowsZoomPanV, panV);
+    
+    SPKTVOne::queueStatsType stats = tvOne.getQueueStats(SPKTVOne::priorityInteractive);
+    printf("window moves:   %i moves, %i refused, %i waiting, %i sent, %i superseded\n", moves, refused, waiting, stats.sent, stats.superseded);
+    printf("window at:      zoom %i shrink %i pan %i,%i, last requested zoom %i shrink %i pan %i,%i\n", 
+           (int)zoom, (int)shrink, (int)panH, (int)panV, geometry.zoom, geometry.shrink, geometry.panH, geometry.panV);
+    
+    bool landed = zoom == geometry.zoom && shrink == geometry.shrink && panH == geometry.panH && panV == geometry.panV;
+    return read && refused == 0 && landed && stats.failed == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+    int count = 1000;
+    int groupSize = 1;
+    int minimumMs = -1;
+    int keyerCount = 0;
+    int moveCount = 0;
+    
+    int option;
+    while ((option = getopt(argc, argv, "t:n:g:m:k:w:")) != -1)
+    {
+        switch (option)
+        {
+            case 't': threads = atoi(optarg); break;
+            case 'n': count = atoi(optarg); break;
+            case 'g': groupSize = atoi(optarg); break;
+            case 'm': minimumMs = atoi(optarg); break;
+            case 'k': keyerCount = atoi(optarg); break;
+            case 'w': moveCount = atoi(optarg); break;
+            default: optind = argc + 1;
+        }
+    }
+    
+    if (optind != argc - 1 || groupSize < 1 || groupSize > SPKTVOne::commandQueueLength)
+    {
+        fprintf(stderr, "usage: %s [-t threads] [-n commands per thread] [-g group size] [-m minimum period ms] [-k keyer retunes] [-w window moves] <port>\n", argv[0]);
+        return 2;
+    }
+    
+    SPKTVOne tvOne(argv[optind], NC);
+    if (minimumMs >= 0) tvOne.setCommandMinimumPeriod(minimumMs);
+    
+    if (keyerCount > 0)
+    {
+        int diffWrites, fullWrites;
+        uint64_t diffNs, fullNs;
+        keyerRetunes(tvOne, keyerCount, true, fullWrites, fullNs);
+        keyerRetunes(tvOne, keyerCount, false, diffWrites, diffNs);
+        
+        printf("keyer full:     %i retunes, %5i writes, %7.1fms each\n", keyerCount, fullWrites, fullNs / 1e6 / keyerCount);
+        printf("keyer diffed:   %i retunes, %5i writes, %7.1fms each\n", keyerCount, diffWrites, diffNs / 1e6 / keyerCount);
+        
+        SPKTVOne::queueStatsType stats = tvOne.getQueueStats(SPKTVOne::priorityInteractive);
+        return (stats.failed == 0) ? 0 : 1;
+    }
+    
+    if (moveCount > 0) return windowMoves(tvOne, moveCount) ? 0 : 1;
+    
+    tvOne.startWorker();
+    
+    // TASK: Run the producers flat out, then wait for the worker to drain the queue
+    
+    std::vector<producerResult> results(threads);
+    std::vector<std::thread> producers;
+    
+    for (int i = 0; i < threads; i++) producers.push_back(std::thread(produce, &tvOne, i, count, groupSize, &results[i]));
+    uint64_t start = timeNs();
+    go = true;
+    for (int i = 0; i < threads; i++) producers[i].join();
+    uint64_t produced = timeNs();
+    
+    int queued = 0;
+    for (int i = 0; i < SPKTVOne::priorityCount; i++) queued += tvOne.queuedCount((SPKTVOne::commandPriority)i);
+    while (queued > 0)
+    {
+        usleep(1000);
+        queued = 0;
+        for (int i = 0; i < SPKTVOne::priorityCount; i++) queued += tvOne.queuedCount((SPKTVOne::commandPriority)i);
+    }
+    tvOne.stopWorker();
+    uint64_t finished = timeNs();
+    
+    // TASK: Report
+    
+    int retries = 0;
+    int total = 0;
+    uint64_t totalQueueNs = 0;
+    uint64_t maxQueueNs = 0;
+    int calls = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        retries += results[i].retries;
+        total += results[i].queued;
+        totalQueueNs += results[i].totalQueueNs;
+        if (results[i].maxQueueNs > maxQueueNs) maxQueueNs = results[i].maxQueueNs;
+        calls += results[i].queued / groupSize + results[i].retries;
+    }
+    
+    int sent = 0, failed = 0, contended = 0;
+    for (int i = 0; i < SPKTVOne::priorityCount; i++)
+    {
+        SPKTVOne::queueStatsType stats = tvOne.getQueueStats((SPKTVOne::commandPriority)i);
+        printf("priority %i: sent %6i, failed %4i, full %6i, contended %6i, mean delay %5ims, max delay %5ims\n", 
+               i, stats.sent, stats.failed, stats.dropped, stats.contended, stats.sent ? stats.totalDelayMs / stats.sent : 0, stats.maxDelayMs);
+        sent += stats.sent;
+        failed += stats.failed;
+        contended += stats.contended;
+    }
+    
+    double seconds = (finished - start) / 1e9;
+    printf("%i threads queued %i commands in %.3fs, then drained by %.3fs\n", threads, total, (produced - start) / 1e9, seconds);
+    printf("queue calls: mean %luns, max %luns, %i retried when full, %i contended claims\n", 
+           (unsigned long)(calls ? totalQueueNs / calls : 0), (unsigned long)maxQueueNs, retries, contended);
+    printf("throughput: %.0f commands/s, %i failed\n", sent / seconds, failed);
+    
+    return (sent == total && failed == 0) ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,109 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Sync take: measures cross-unit skew of SPKTVOne::commandSynchronised against sending to each unit in turn
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_synctake tools/spk_tvone_synctake.cpp spk_tvone_mbed.cpp spk_tvone_posix.cpp
+//
+// spk_tvone_synctake [-n takes] <port> <port> ...
+//
+// Try it against stand-ins with different latencies, eg.
+// spk_tvone_standin -l 5 -p /tmp/tv1a & spk_tvone_standin -l 20 -j 2 -p /tmp/tv1b & spk_tvone_synctake /tmp/tv1a /tmp/tv1b
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "spk_tvone_mbed.h"
+
+int main(int argc, char *argv[])
+{
+    int takes = 20;
+    
+    int option;
+    while ((option = getopt(argc, argv, "n:")) != -1)
+    {
+        if (option == 'n') takes = atoi(optarg);
+        else
+        {
+            fprintf(stderr, "usage: %s [-n takes] <port> <port> ...\n", argv[0]);
+            return 2;
+        }
+    }
+    
+    int count = argc - optind;
+    if (count < 1 || count > SPKTVOne::maxSyncUnits)
+    {
+        fprintf(stderr, "need 1 to %i ports\n", SPKTVOne::maxSyncUnits);
+        return 2;
+    }
+    
+    SPKTVOne *units[SPKTVOne::maxSyncUnits];
+    SPKTVOne::queuedCommand commands[SPKTVOne::maxSyncUnits];
+    for (int i = 0; i < count; i++)
+    {
+        units[i] = new SPKTVOne(argv[optind + i], NC);
+        SPKTVOne::queuedCommand take = {0, kTV1WindowIDA, kTV1FunctionAdjustOutputsTake, 1, SPKTVOne::writeVerified, SPKTVOne::periodsType()};
+        commands[i] = take;
+    }
+    
+    // TASK: Each unit in turn, as a show would without the sync primitive. Also warms up the latency estimates.
+    
+    int sequentialWorstUs = 0;
+    int sequentialTotalUs = 0;
+    for (int t = 0; t < takes; t++)
+    {
+        uint64_t first = 0, last = 0;
+        for (int i = 0; i < count; i++)
+        {
+            units[i]->command(commands[i].channel, commands[i].window, commands[i].func, commands[i].payload);
+            last = units[0]->timeUs();
+            if (i == 0) first = last;
+        }
+        int skewUs = last - first;
+        sequentialTotalUs += skewUs;
+        if (skewUs > sequentialWorstUs) sequentialWorstUs = skewUs;
+    }
+    
+    // TASK: Synchronised
+    
+    int syncWorstUs = 0;
+    int syncTotalUs = 0;
+    int failed = 0;
+    for (int t = 0; t < takes; t++)
+    {
+        SPKTVOne::syncResultType result;
+        if (!SPKTVOne::commandSynchronised(units, commands, count, 0, &result)) failed++;
+        
+        syncTotalUs += result.skewUs;
+        if (result.skewUs > syncWorstUs) syncWorstUs = result.skewUs;
+    }
+    
+    for (int i = 0; i < count; i++) printf("%s: latency %uus\n", argv[optind + i], units[i]->commandLatencyUs(kTV1FunctionAdjustOutputsTake));
+    printf("sequential:   mean skew %6ius, worst %6ius\n", sequentialTotalUs / takes, sequentialWorstUs);
+    printf("synchronised: mean skew %6ius, worst %6ius, %i failed\n", syncTotalUs / takes, syncWorstUs, failed);
+    
+    return failed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,185 @@
+// *spark audio-visual
+// RS232 Control for TV-One products
+// Trace: summarises a recorded timing trace, the latency and error behaviour of the unit it came from
+
+/* Copyright (c) 2011 Toby Harris, MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software 
+ * and associated documentation files (the "Software"), to deal in the Software without restriction, 
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute, 
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is 
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or 
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING 
+ * BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND 
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, 
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Host tool, built with SPK_TVONE_POSIX defined so an mbed build of the library skips it, eg.
+// g++ -std=c++11 -DSPK_TVONE_POSIX -I. -o spk_tvone_trace tools/spk_tvone_trace.cpp
+//
+// spk_tvone_trace [-d] <trace>
+//
+// Traces are recorded by opening the unit as "record:<trace>@<device>", see spk_tvone_posix.h. -d dumps every record.
+// An ack is complete at its CR for an F frame, or its fourth byte for an S chunk. Garbled counts replies that weren't exactly an ack.
+
+#if defined(SPK_TVONE_POSIX)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "spk_tvone_posix.h"
+
+static bool readVarint(FILE *file, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+struct frameType
+{
+    std::string sent;
+    uint64_t sentUs;
+    std::string reply;
+    uint64_t firstReplyUs;
+    uint64_t ackUs;
+};
+
+static void printPercentiles(const char *label, std::vector<uint64_t> &values)
+{
+    if (values.empty())
+    {
+        printf("%-18s none\n", label);
+        return;
+    }
+    
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    printf("%-18s %6zu, min %6.1fms, median %6.1fms, p90 %6.1fms, p99 %6.1fms, max %6.1fms\n", label, n,
+           values[0] / 1e3, values[n / 2] / 1e3, values[(n * 9) / 10] / 1e3, values[(n * 99) / 100] / 1e3, values[n - 1] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    bool dump = false;
+    
+    int option;
+    while ((option = getopt(argc, argv, "d")) != -1)
+    {
+        if (option == 'd') dump = true;
+        else optind = argc + 1;
+    }
+    
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-d] <trace>\n", argv[0]);
+        return 2;
+    }
+    
+    FILE *file = fopen(argv[optind], "rb");
+    char header[8];
+    if (!file || fread(header, 1, 8, file) != 8 || memcmp(header, "TV1T", 4) != 0 || header[4] != kTV1TraceVersion)
+    {
+        fprintf(stderr, "%s is not a version %i trace\n", argv[optind], kTV1TraceVersion);
+        return 1;
+    }
+    
+    // TASK: Read the records, pairing what came back with the frame it followed
+    
+    std::vector<frameType> frames;
+    uint64_t timeUs = 0;
+    int kind;
+    while ((kind = fgetc(file)) != EOF)
+    {
+        uint64_t deltaUs, length;
+        if (!readVarint(file, deltaUs) || !readVarint(file, length) || length > 4096) break;
+        
+        std::string bytes(length, 0);
+        if (fread(&bytes[0], 1, length, file) != length) break;
+        timeUs += deltaUs;
+        
+        if (dump)
+        {
+            printf("%10.3fms %c", timeUs / 1e3, kind);
+            for (size_t i = 0; i < bytes.size(); i++)
+            {
+                if (bytes[i] >= 0x20 && bytes[i] < 0x7F) printf("%c", bytes[i]);
+                else printf("<%02X>", (uint8_t)bytes[i]);
+            }
+            printf("\n");
+        }
+        
+        if (kind == 'T')
+        {
+            frameType frame = {bytes, timeUs, "", 0, 0};
+            frames.push_back(frame);
+        }
+        else if (kind == 'R' && !frames.empty())
+        {
+            frameType &frame = frames.back();
+            if (frame.reply.empty()) frame.firstReplyUs = timeUs;
+            frame.reply += bytes;
+            
+            bool complete = (frame.sent[0] == 'F') ? frame.reply.find('\r') != std::string::npos : frame.reply.size() >= 4;
+            if (complete && !frame.ackUs) frame.ackUs = timeUs;
+        }
+    }
+    fclose(file);
+    
+    // TASK: Summarise
+    
+    std::vector<uint64_t> writeAcks, readAcks, chunkAcks, firstBytes, gaps;
+    int unanswered = 0, garbled = 0, refused = 0;
+    
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        frameType &frame = frames[i];
+        if (i > 0) gaps.push_back(frame.sentUs - frames[i - 1].sentUs);
+        if (frame.sent[0] != 'F' && frame.sent[0] != 'S') continue;
+        
+        if (frame.reply.empty()) unanswered++;
+        else firstBytes.push_back(frame.firstReplyUs - frame.sentUs);
+        
+        bool clean = (frame.sent[0] == 'F') ? frame.reply.size() == 20 && frame.reply[0] == 'F' && frame.reply[19] == '\r' : frame.reply.size() == 4;
+        if (!frame.reply.empty() && !clean) garbled++;
+        if (!frame.ackUs) continue;
+        
+        uint64_t latencyUs = frame.ackUs - frame.sentUs;
+        if (frame.sent[0] == 'S') chunkAcks.push_back(latencyUs);
+        else if (frame.sent.size() == 14) readAcks.push_back(latencyUs);
+        else writeAcks.push_back(latencyUs);
+        
+        // An F ack's second character is 4 when the unit accepted the command
+        size_t start = frame.reply.find('F');
+        if (frame.sent[0] == 'F' && (start == std::string::npos || start + 1 >= frame.reply.size() || frame.reply[start + 1] != '4')) refused++;
+    }
+    
+    printf("%zu frames over %.3fs\n", frames.size(), frames.empty() ? 0.0 : (frames.back().sentUs - frames[0].sentUs) / 1e6);
+    printPercentiles("write acks", writeAcks);
+    printPercentiles("read acks", readAcks);
+    printPercentiles("upload chunk acks", chunkAcks);
+    printPercentiles("first reply byte", firstBytes);
+    printPercentiles("frame to frame", gaps);
+    printf("%i unanswered, %i garbled, %i refused\n", unanswered, garbled, refused);
+    
+    return 0;
+}
+
+#endif